@@ -0,0 +1,143 @@
+#ifndef CMU462_AFFINE2F_H
+#define CMU462_AFFINE2F_H
+
+#include <stddef.h>
+
+#include "CMU462.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace CMU462 {
+
+/**
+ * Single precision 2D vector for screen space work. Unlike Vector2D
+ * everything is inline and constexpr, so vertex loops stay in registers.
+ */
+struct Vec2f {
+
+  float x, y;
+
+  constexpr Vec2f( ) : x ( 0 ), y ( 0 ) { }
+  constexpr Vec2f( float x, float y ) : x ( x ), y ( y ) { }
+  explicit Vec2f( const Vector2D& v ) : x ( (float) v.x ), y ( (float) v.y ) { }
+
+  constexpr Vec2f operator+( const Vec2f& v ) const { return Vec2f(x + v.x, y + v.y); }
+  constexpr Vec2f operator-( const Vec2f& v ) const { return Vec2f(x - v.x, y - v.y); }
+  constexpr Vec2f operator-( void ) const { return Vec2f(-x, -y); }
+  constexpr Vec2f operator*( float r ) const { return Vec2f(x * r, y * r); }
+
+  inline Vec2f& operator+=( const Vec2f& v ) { x += v.x; y += v.y; return *this; }
+  inline Vec2f& operator-=( const Vec2f& v ) { x -= v.x; y -= v.y; return *this; }
+
+  constexpr float dot( const Vec2f& v ) const { return x * v.x + y * v.y; }
+  constexpr float cross( const Vec2f& v ) const { return x * v.y - y * v.x; }
+
+}; // struct Vec2f
+
+constexpr Vec2f operator*( float r, const Vec2f& v ) { return v * r; }
+
+/**
+ * Single precision affine transformation in SVG matrix order:
+ *
+ *   | a c e |
+ *   | b d f |
+ *   | 0 0 1 |
+ *
+ * Composition and application are inline with no homogeneous divide.
+ */
+struct Affine2f {
+
+  float a, b, c, d, e, f;
+
+  constexpr Affine2f( ) : a ( 1 ), b ( 0 ), c ( 0 ), d ( 1 ), e ( 0 ), f ( 0 ) { }
+  constexpr Affine2f( float a, float b, float c, float d, float e, float f ) :
+    a ( a ), b ( b ), c ( c ), d ( d ), e ( e ), f ( f ) { }
+
+  static constexpr Affine2f identity( ) { return Affine2f(); }
+  static constexpr Affine2f translate( float x, float y ) {
+    return Affine2f(1, 0, 0, 1, x, y);
+  }
+  static constexpr Affine2f scale( float x, float y ) {
+    return Affine2f(x, 0, 0, y, 0, 0);
+  }
+
+  // true if the bottom row of m is ( 0 0 1 )
+  static inline bool is_affine( const Matrix3x3& m ) {
+    return m(2,0) == 0 && m(2,1) == 0 && m(2,2) == 1;
+  }
+
+  // the top two rows of m, which must be affine
+  explicit Affine2f( const Matrix3x3& m ) :
+    a ( (float) m(0,0) ), b ( (float) m(1,0) ),
+    c ( (float) m(0,1) ), d ( (float) m(1,1) ),
+    e ( (float) m(0,2) ), f ( (float) m(1,2) ) { }
+
+  constexpr Vec2f operator*( const Vec2f& p ) const {
+    return Vec2f(a * p.x + c * p.y + e, b * p.x + d * p.y + f);
+  }
+
+  // this applied after t
+  constexpr Affine2f operator*( const Affine2f& t ) const {
+    return Affine2f(a * t.a + c * t.b,     b * t.a + d * t.b,
+                    a * t.c + c * t.d,     b * t.c + d * t.d,
+                    a * t.e + c * t.f + e, b * t.e + d * t.f + f);
+  }
+
+  constexpr float det( void ) const { return a * d - b * c; }
+
+  // inverse, the transformation must not be singular
+  inline Affine2f inv( void ) const {
+    float r = 1 / det();
+    return Affine2f( d * r, -b * r, -c * r, a * r,
+                     (c * f - d * e) * r, (b * e - a * f) * r );
+  }
+
+}; // struct Affine2f
+
+// Batch transforms //
+
+// in place is fine
+inline void transform_points( const Affine2f& t, const Vec2f* points,
+                              size_t count, Vec2f* out ) {
+  size_t i = 0;
+#ifdef __SSE2__
+  // two points per register: ( x0 y0 x1 y1 )
+  __m128 ac = _mm_setr_ps(t.a, t.b, t.a, t.b);
+  __m128 cd = _mm_setr_ps(t.c, t.d, t.c, t.d);
+  __m128 ef = _mm_setr_ps(t.e, t.f, t.e, t.f);
+  for (; i + 2 <= count; i += 2) {
+    __m128 p = _mm_loadu_ps(&points[i].x);
+    __m128 x = _mm_shuffle_ps(p, p, _MM_SHUFFLE(2, 2, 0, 0));
+    __m128 y = _mm_shuffle_ps(p, p, _MM_SHUFFLE(3, 3, 1, 1));
+    p = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ac, x), _mm_mul_ps(cd, y)), ef);
+    _mm_storeu_ps(&out[i].x, p);
+  }
+#endif
+  for (; i < count; i++) out[i] = t * points[i];
+}
+
+inline void transform_points( const Affine2f& t, const Vector2D* points,
+                              size_t count, Vec2f* out ) {
+  size_t i = 0;
+#ifdef __SSE2__
+  __m128 ac = _mm_setr_ps(t.a, t.b, t.a, t.b);
+  __m128 cd = _mm_setr_ps(t.c, t.d, t.c, t.d);
+  __m128 ef = _mm_setr_ps(t.e, t.f, t.e, t.f);
+  for (; i + 2 <= count; i += 2) {
+    __m128 p0 = _mm_cvtpd_ps(_mm_loadu_pd(&points[i].x));
+    __m128 p1 = _mm_cvtpd_ps(_mm_loadu_pd(&points[i + 1].x));
+    __m128 p = _mm_movelh_ps(p0, p1);
+    __m128 x = _mm_shuffle_ps(p, p, _MM_SHUFFLE(2, 2, 0, 0));
+    __m128 y = _mm_shuffle_ps(p, p, _MM_SHUFFLE(3, 3, 1, 1));
+    p = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ac, x), _mm_mul_ps(cd, y)), ef);
+    _mm_storeu_ps(&out[i].x, p);
+  }
+#endif
+  for (; i < count; i++) out[i] = t * Vec2f(points[i]);
+}
+
+} // namespace CMU462
+
+#endif // CMU462_AFFINE2F_H
@@ -0,0 +1,128 @@
+#include "CMU462.h"
+#include "svg.h"
+#include "texture.h"
+#include "viewport.h"
+#include "software_renderer.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <atomic>
+#include <new>
+#include <vector>
+
+using namespace std;
+using namespace CMU462;
+
+/**
+ * Checks that the imp renderer draws a frame without allocating once it
+ * has warmed up. Every document given is drawn on both color pipelines,
+ * with and without linear light, at sample rates 1, 2 and 4: two frames
+ * warm up the sample buffers, scratch vectors and the OpenMP pool, and
+ * the next ones must not reach operator new at all. Exits non-zero on
+ * failure.
+ */
+
+static const size_t kSize = 512;
+static const int kWarmup = 2;
+static const int kFrames = 4;
+
+// allocations from any thread, tiles are drawn in parallel
+static atomic<size_t> allocations(0);
+
+void* operator new( size_t size ) {
+  allocations++;
+  void* p = malloc(size ? size : 1);
+  if (!p) throw bad_alloc();
+  return p;
+}
+
+void* operator new[]( size_t size ) {
+  return operator new(size);
+}
+
+void operator delete( void* p ) noexcept { free(p); }
+void operator delete[]( void* p ) noexcept { free(p); }
+
+static void collect_images( vector<SVGElement*>& elements,
+                            vector<Image*>& images ) {
+  for (size_t i = 0; i < elements.size(); ++i) {
+    SVGElement* element = elements[i];
+    if (element->type == IMAGE) {
+      images.push_back(static_cast<Image*>(element));
+    } else if (element->type == GROUP) {
+      collect_images(static_cast<Group*>(element)->elements, images);
+    }
+  }
+}
+
+// allocations while drawing the measured frames
+static size_t count_allocations( SoftwareRendererImp& renderer, SVG& svg ) {
+  for (int i = 0; i < kWarmup; i++) renderer.draw_svg(svg);
+  size_t before = allocations;
+  for (int i = 0; i < kFrames; i++) renderer.draw_svg(svg);
+  return allocations - before;
+}
+
+int main( int argc, char** argv ) {
+
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s <svg>...\n", argv[0]);
+    return 2;
+  }
+
+  vector<unsigned char> target(4 * kSize * kSize);
+  Matrix3x3 norm_to_screen = Matrix3x3::identity();
+  norm_to_screen(0,0) = kSize;
+  norm_to_screen(1,1) = kSize;
+
+  SoftwareRendererImp renderer;
+  // Sampler2D has no destructor body
+  Sampler2DImp& sampler = *new Sampler2DImp();
+  sampler.set_layout(TEXELS_TILED);
+  renderer.set_tex_sampler(&sampler);
+  renderer.set_render_target(&target[0], kSize, kSize);
+
+  int failures = 0;
+  for (int f = 1; f < argc; f++) {
+
+    SVG* svg = new SVG();
+    if (SVGParser::load(argv[f], svg) < 0) {
+      fprintf(stderr, "failed to load %s\n", argv[f]);
+      delete svg;
+      failures++;
+      continue;
+    }
+    // mips are built outside the frame, as by the viewer
+    vector<Image*> images;
+    collect_images(svg->elements, images);
+    for (size_t i = 0; i < images.size(); i++) {
+      Texture& tex = images[i]->texture();
+      if (tex.mips_valid || tex.mipmap.empty()) continue;
+      sampler.generate_mips(tex, 0);
+      tex.mips_valid = true;
+    }
+
+    // same view as DrawSVG::auto_adjust
+    ViewportImp viewport;
+    float span = 1.2 * max(svg->width, svg->height) / 2;
+    viewport.set_viewbox(svg->width / 2, svg->height / 2, span);
+    renderer.set_canvas_to_screen(norm_to_screen * viewport.get_canvas_to_norm());
+
+    for (int c = 0; c < 12; c++) {
+      bool fixed_point = c & 1, linear_light = c & 2;
+      size_t rate = 1 << (c >> 2);
+      renderer.set_fixed_point(fixed_point);
+      renderer.set_linear_light(linear_light);
+      renderer.set_sample_rate(rate);
+
+      size_t count = count_allocations(renderer, *svg);
+      failures += count != 0;
+      fprintf(stderr, "%-40s %-5s %-6s %zux  %zu allocations  %s\n", argv[f],
+              fixed_point ? "fixed" : "float", linear_light ? "linear" : "srgb",
+              rate, count, count ? "FAIL" : "ok");
+    }
+    delete svg;
+  }
+
+  return failures ? 1 : 0;
+}
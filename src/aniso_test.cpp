@@ -0,0 +1,112 @@
+#include "CMU462.h"
+#include "svg.h"
+#include "texture.h"
+#include "software_renderer.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <vector>
+
+using namespace std;
+using namespace CMU462;
+
+/**
+ * Checks anisotropic filtering of images through the imp renderer.
+ *
+ * Images are rasterized axis aligned, as by the reference, so the pixel
+ * footprint handed to the sampler is axis aligned too (dudy = dvdx = 0)
+ * and anisotropy is only ever along u or v. This covers that case: a
+ * stripe texture minified 16:1 across the stripes' constant axis, drawn
+ * upright, turned and mirrored. Stripes run along the minified axis, so
+ * an exact box filter of level 0 keeps them sharp. Anisotropic sampling
+ * has to stay close to it while trilinear, filtering at the major axis,
+ * blurs them to gray. Exits non-zero on failure.
+ */
+
+static const size_t kSize = 256;
+static const size_t kRatio = 16;
+
+// stripes four texels wide, across u (vertical) or across v (horizontal)
+static unsigned char stripe( size_t x, size_t y, bool vertical ) {
+  return (((vertical ? x : y) / 4) & 1) ? 255 : 0;
+}
+
+static Image* make_image( bool vertical ) {
+  Image* image = new Image();
+  image->tex.width = image->tex.height = kSize;
+  MipLevel level;
+  level.width = level.height = kSize;
+  level.texels.resize(4 * kSize * kSize);
+  for (size_t y = 0; y < kSize; y++) {
+    for (size_t x = 0; x < kSize; x++) {
+      unsigned char* t = &level.texels[4 * (y * kSize + x)];
+      t[0] = t[1] = t[2] = stripe(x, y, vertical);
+      t[3] = 255;
+    }
+  }
+  image->tex.mipmap.push_back(level);
+  return image;
+}
+
+// RMS error of the drawn w x h image against the box filtered texture
+static double render_error( SoftwareRendererImp& renderer, Sampler2DImp& sampler,
+                            SampleMethod method, bool vertical, bool mirrored ) {
+
+  size_t w = vertical ? kSize : kSize / kRatio;
+  size_t h = vertical ? kSize / kRatio : kSize;
+
+  SVG svg;
+  Image* image = make_image(vertical);
+  sampler.generate_mips(image->tex, 0);
+  image->tex.mips_valid = true;
+  image->position  = Vector2D(mirrored ? w : 0, mirrored ? h : 0);
+  image->dimension = Vector2D(mirrored ? -(double) w : w, mirrored ? -(double) h : h);
+  svg.width = kSize; svg.height = kSize;
+  svg.elements.push_back(image);
+
+  vector<unsigned char> target(4 * kSize * kSize);
+  renderer.set_render_target(&target[0], kSize, kSize);
+  sampler.set_sample_method(method);
+  renderer.draw_svg(svg);
+
+  // a pixel covers one texel across the stripes, mirrored images flip it
+  double sum = 0;
+  for (size_t y = 0; y < h; y++) {
+    for (size_t x = 0; x < w; x++) {
+      size_t tx = mirrored ? w - 1 - x : x;
+      size_t ty = mirrored ? h - 1 - y : y;
+      double expected = vertical ? stripe(tx, 0, true) : stripe(0, ty, false);
+      double e = target[4 * (y * kSize + x)] - expected;
+      sum += e * e;
+    }
+  }
+  return sqrt(sum / (w * h));
+}
+
+int main( void ) {
+
+  SoftwareRendererImp renderer;
+  // Sampler2D has no destructor body
+  Sampler2DImp& sampler = *new Sampler2DImp();
+  sampler.set_layout(TEXELS_TILED);
+  renderer.set_tex_sampler(&sampler);
+  renderer.set_canvas_to_screen(Matrix3x3::identity());
+  renderer.set_sample_rate(1);
+  renderer.set_canvas_outline(false);
+
+  int failures = 0;
+  for (int c = 0; c < 4; c++) {
+    bool vertical = c < 2, mirrored = c & 1;
+    double aniso = render_error(renderer, sampler, ANISOTROPIC, vertical, mirrored);
+    double trilinear = render_error(renderer, sampler, TRILINEAR, vertical, mirrored);
+
+    // trilinear failing shows the case needs anisotropic filtering at all
+    bool ok = aniso < 2 && trilinear > 40;
+    failures += !ok;
+    fprintf(stderr, "%-10s %-8s aniso rms %7.2f  trilinear rms %7.2f  %s\n",
+            vertical ? "vertical" : "horizontal", mirrored ? "mirrored" : "upright",
+            aniso, trilinear, ok ? "ok" : "FAIL");
+  }
+
+  return failures ? 1 : 0;
+}
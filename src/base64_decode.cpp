@@ -0,0 +1,138 @@
+#include "base64_decode.h"
+
+#include <string.h>
+#include <stdint.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+
+namespace CMU462 {
+
+static const signed char kInvalid    = -1;
+static const signed char kWhitespace = -2;
+
+struct Base64Table {
+  signed char value[256];
+  Base64Table() {
+    memset(value, kInvalid, sizeof(value));
+    for (int c = 'A'; c <= 'Z'; c++) value[c] = c - 'A';
+    for (int c = 'a'; c <= 'z'; c++) value[c] = c - 'a' + 26;
+    for (int c = '0'; c <= '9'; c++) value[c] = c - '0' + 52;
+    value[(int) '+'] = 62;
+    value[(int) '/'] = 63;
+    value[(int) ' '] = value[(int) '\t'] = kWhitespace;
+    value[(int) '\n'] = value[(int) '\r'] = kWhitespace;
+  }
+};
+
+static const Base64Table& base64_table() {
+  static const Base64Table table;
+  return table;
+}
+
+#if defined(__SSE2__)
+
+// bytes of x that lie in [lo, hi]
+static inline __m128i in_range( __m128i x, char lo, char hi ) {
+  return _mm_and_si128(_mm_cmpgt_epi8(x, _mm_set1_epi8(lo - 1)),
+                       _mm_cmplt_epi8(x, _mm_set1_epi8(hi + 1)));
+}
+
+// Decodes 16 characters into 12 bytes. Returns false without writing if
+// any of them is not in the alphabet (whitespace, padding, end of text),
+// in which case the caller takes the scalar path for this stretch.
+static inline bool decode16( unsigned char* dst, const char* src ) {
+
+  __m128i c = _mm_loadu_si128((const __m128i*) src);
+
+  // translate characters to their 6-bit values with range masks
+  __m128i upper = in_range(c, 'A', 'Z');
+  __m128i lower = in_range(c, 'a', 'z');
+  __m128i digit = in_range(c, '0', '9');
+  __m128i plus  = _mm_cmpeq_epi8(c, _mm_set1_epi8('+'));
+  __m128i slash = _mm_cmpeq_epi8(c, _mm_set1_epi8('/'));
+
+  __m128i valid = _mm_or_si128(_mm_or_si128(upper, lower),
+                               _mm_or_si128(digit, _mm_or_si128(plus, slash)));
+  if (_mm_movemask_epi8(valid) != 0xffff) return false;
+
+  __m128i shift = _mm_and_si128(upper, _mm_set1_epi8(-'A'));
+  shift = _mm_or_si128(shift, _mm_and_si128(lower, _mm_set1_epi8(26 - 'a')));
+  shift = _mm_or_si128(shift, _mm_and_si128(digit, _mm_set1_epi8(52 - '0')));
+  shift = _mm_or_si128(shift, _mm_and_si128(plus,  _mm_set1_epi8(62 - '+')));
+  shift = _mm_or_si128(shift, _mm_and_si128(slash, _mm_set1_epi8(63 - '/')));
+  __m128i v = _mm_add_epi8(c, shift);
+
+  // merge each group of four sextets a,b,c,d into one 24-bit value:
+  // 16-bit pairs (a << 6 | b), (c << 6 | d), then ab << 12 | cd
+  __m128i even = _mm_and_si128(v, _mm_set1_epi16(0x00ff));
+  __m128i odd  = _mm_srli_epi16(v, 8);
+  __m128i pairs = _mm_or_si128(_mm_slli_epi16(even, 6), odd);
+  __m128i words = _mm_madd_epi16(pairs, _mm_set1_epi32(0x00011000));
+
+  uint32_t w[4];
+  _mm_storeu_si128((__m128i*) w, words);
+  for (int i = 0; i < 4; i++) {
+    dst[3 * i + 0] = w[i] >> 16;
+    dst[3 * i + 1] = w[i] >> 8;
+    dst[3 * i + 2] = w[i];
+  }
+  return true;
+}
+
+#endif // __SSE2__
+
+size_t base64_decode_into( vector<unsigned char>& out,
+                           const char* text, size_t length ) {
+
+  const signed char* table = base64_table().value;
+
+  // whitespace only makes the output shorter, so this is an upper bound
+  out.resize(length / 4 * 3 + 3);
+  unsigned char* dst = out.empty() ? NULL : &out[0];
+  size_t n = 0;
+
+  const char* p = text;
+  const char* end = text + length;
+  uint32_t acc = 0; int sextets = 0;
+
+  while (p < end) {
+
+#if defined(__SSE2__)
+    // fast path while no partial group is pending and the text is clean
+    if (sextets == 0) {
+      while (end - p >= 16 && decode16(dst + n, p)) { p += 16; n += 12; }
+    }
+#endif
+
+    // scalar path: whitespace and the next complete group, then back to
+    // the fast path
+    for (; p < end; p++) {
+      signed char v = table[(unsigned char) *p];
+      if (v == kWhitespace) continue;
+      if (v == kInvalid) { end = p; break; }
+      acc = (acc << 6) | v;
+      if (++sextets == 4) {
+        dst[n++] = acc >> 16; dst[n++] = acc >> 8; dst[n++] = acc;
+        acc = 0; sextets = 0;
+        p++;
+        break;
+      }
+    }
+  }
+
+  // trailing partial group (the padding that followed it is implied)
+  if (sextets == 3) {
+    dst[n++] = acc >> 10; dst[n++] = acc >> 2;
+  } else if (sextets == 2) {
+    dst[n++] = acc >> 4;
+  }
+
+  out.resize(n);
+  return n;
+}
+
+} // namespace CMU462
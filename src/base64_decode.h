@@ -0,0 +1,18 @@
+#ifndef CMU462_BASE64_DECODE_H
+#define CMU462_BASE64_DECODE_H
+
+#include <vector>
+#include <stddef.h>
+
+namespace CMU462 {
+
+// Decodes base64 text in a single pass, skipping spaces, tabs and line
+// breaks inline. Decoding stops at the first padding character or any
+// other character outside the base64 alphabet. The decoded bytes replace
+// the contents of out; returns the number of decoded bytes.
+size_t base64_decode_into( std::vector<unsigned char>& out,
+                           const char* text, size_t length );
+
+} // namespace CMU462
+
+#endif // CMU462_BASE64_DECODE_H
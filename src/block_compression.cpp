@@ -0,0 +1,206 @@
+#include "block_compression.h"
+
+#include <math.h>
+#include <string.h>
+#include <stdint.h>
+
+namespace CMU462 {
+
+// Color blocks //
+
+static inline uint16_t pack_565( const float c[3] ) {
+  int r = (int) (c[0] * 31 / 255 + 0.5f);
+  int g = (int) (c[1] * 63 / 255 + 0.5f);
+  int b = (int) (c[2] * 31 / 255 + 0.5f);
+  return (uint16_t) ((r << 11) | (g << 5) | b);
+}
+
+static inline void unpack_565( uint16_t c, unsigned char* rgb ) {
+  int r = (c >> 11) & 31, g = (c >> 5) & 63, b = c & 31;
+  rgb[0] = (r << 3) | (r >> 2);
+  rgb[1] = (g << 2) | (g >> 4);
+  rgb[2] = (b << 3) | (b >> 2);
+}
+
+// the four palette entries of a color block, RGBA
+static void color_palette( uint16_t c0, uint16_t c1, bool four_colors,
+                           unsigned char palette[16] ) {
+  unpack_565(c0, palette);     palette[3]  = 255;
+  unpack_565(c1, palette + 4); palette[7]  = 255;
+  for (int k = 0; k < 3; k++) {
+    int a = palette[k], b = palette[4 + k];
+    if (four_colors) {
+      palette[8 + k]  = (2 * a + b) / 3;
+      palette[12 + k] = (a + 2 * b) / 3;
+    } else {
+      palette[8 + k]  = (a + b) / 2;
+      palette[12 + k] = 0;
+    }
+  }
+  palette[11] = 255;
+  palette[15] = four_colors ? 255 : 0;
+}
+
+// Endpoints are the extremes of the texels along their principal axis,
+// pulled in slightly so the palette covers the bulk of the block, then
+// every texel takes the nearest of the four palette entries.
+static void encode_color_block( const unsigned char* rgba,
+                                unsigned char* block ) {
+
+  float mean[3] = { 0, 0, 0 };
+  for (int i = 0; i < 16; i++) {
+    for (int k = 0; k < 3; k++) mean[k] += rgba[4 * i + k];
+  }
+  for (int k = 0; k < 3; k++) mean[k] /= 16;
+
+  float cov[6] = { 0, 0, 0, 0, 0, 0 }; // rr rg rb gg gb bb
+  for (int i = 0; i < 16; i++) {
+    float r = rgba[4 * i] - mean[0];
+    float g = rgba[4 * i + 1] - mean[1];
+    float b = rgba[4 * i + 2] - mean[2];
+    cov[0] += r * r; cov[1] += r * g; cov[2] += r * b;
+    cov[3] += g * g; cov[4] += g * b; cov[5] += b * b;
+  }
+
+  // principal axis by power iteration
+  float axis[3] = { 1, 1, 1 };
+  for (int iter = 0; iter < 6; iter++) {
+    float x = cov[0] * axis[0] + cov[1] * axis[1] + cov[2] * axis[2];
+    float y = cov[1] * axis[0] + cov[3] * axis[1] + cov[4] * axis[2];
+    float z = cov[2] * axis[0] + cov[4] * axis[1] + cov[5] * axis[2];
+    float len = sqrtf(x * x + y * y + z * z);
+    if (len < 1e-6f) break;
+    axis[0] = x / len; axis[1] = y / len; axis[2] = z / len;
+  }
+
+  float lo = 0, hi = 0;
+  for (int i = 0; i < 16; i++) {
+    float t = 0;
+    for (int k = 0; k < 3; k++) t += (rgba[4 * i + k] - mean[k]) * axis[k];
+    if (t < lo) lo = t;
+    if (t > hi) hi = t;
+  }
+  float inset = (hi - lo) / 16;
+  lo += inset; hi -= inset;
+
+  float c_hi[3], c_lo[3];
+  for (int k = 0; k < 3; k++) {
+    c_hi[k] = fminf(fmaxf(mean[k] + hi * axis[k], 0), 255);
+    c_lo[k] = fminf(fmaxf(mean[k] + lo * axis[k], 0), 255);
+  }
+
+  // c0 > c1 selects the four color palette
+  uint16_t c0 = pack_565(c_hi), c1 = pack_565(c_lo);
+  if (c0 < c1) { uint16_t t = c0; c0 = c1; c1 = t; }
+
+  uint32_t indices = 0;
+  if (c0 != c1) {
+    unsigned char palette[16];
+    color_palette(c0, c1, true, palette);
+    for (int i = 0; i < 16; i++) {
+      int best = 0, best_dist = 1 << 30;
+      for (int p = 0; p < 4; p++) {
+        int dist = 0;
+        for (int k = 0; k < 3; k++) {
+          int d = rgba[4 * i + k] - palette[4 * p + k];
+          dist += d * d;
+        }
+        if (dist < best_dist) { best_dist = dist; best = p; }
+      }
+      indices |= (uint32_t) best << (2 * i);
+    }
+  }
+
+  block[0] = c0 & 0xff; block[1] = c0 >> 8;
+  block[2] = c1 & 0xff; block[3] = c1 >> 8;
+  for (int i = 0; i < 4; i++) block[4 + i] = (indices >> (8 * i)) & 0xff;
+}
+
+static void decode_color_block( const unsigned char* block,
+                                unsigned char* rgba, bool force_four ) {
+  uint16_t c0 = block[0] | (block[1] << 8);
+  uint16_t c1 = block[2] | (block[3] << 8);
+  uint32_t indices = block[4] | (block[5] << 8) | (block[6] << 16) |
+                     ((uint32_t) block[7] << 24);
+
+  unsigned char palette[16];
+  color_palette(c0, c1, force_four || c0 > c1, palette);
+  for (int i = 0; i < 16; i++) {
+    memcpy(rgba + 4 * i, palette + 4 * ((indices >> (2 * i)) & 3), 4);
+  }
+}
+
+// Alpha blocks //
+
+static void alpha_palette( int a0, int a1, unsigned char palette[8] ) {
+  palette[0] = a0; palette[1] = a1;
+  if (a0 > a1) {
+    for (int i = 1; i < 7; i++) palette[1 + i] = ((7 - i) * a0 + i * a1) / 7;
+  } else {
+    for (int i = 1; i < 5; i++) palette[1 + i] = ((5 - i) * a0 + i * a1) / 5;
+    palette[6] = 0; palette[7] = 255;
+  }
+}
+
+static void encode_alpha_block( const unsigned char* rgba,
+                                unsigned char* block ) {
+  int lo = 255, hi = 0;
+  for (int i = 0; i < 16; i++) {
+    int a = rgba[4 * i + 3];
+    if (a < lo) lo = a;
+    if (a > hi) hi = a;
+  }
+
+  // hi > lo selects the eight value palette
+  uint64_t indices = 0;
+  if (hi > lo) {
+    unsigned char palette[8];
+    alpha_palette(hi, lo, palette);
+    for (int i = 0; i < 16; i++) {
+      int best = 0, best_dist = 256;
+      for (int p = 0; p < 8; p++) {
+        int d = rgba[4 * i + 3] - palette[p];
+        if (d < 0) d = -d;
+        if (d < best_dist) { best_dist = d; best = p; }
+      }
+      indices |= (uint64_t) best << (3 * i);
+    }
+  }
+
+  block[0] = hi; block[1] = lo;
+  for (int i = 0; i < 6; i++) block[2 + i] = (indices >> (8 * i)) & 0xff;
+}
+
+static void decode_alpha_block( const unsigned char* block,
+                                unsigned char* rgba ) {
+  uint64_t indices = 0;
+  for (int i = 0; i < 6; i++) indices |= (uint64_t) block[2 + i] << (8 * i);
+
+  unsigned char palette[8];
+  alpha_palette(block[0], block[1], palette);
+  for (int i = 0; i < 16; i++) {
+    rgba[4 * i + 3] = palette[(indices >> (3 * i)) & 7];
+  }
+}
+
+// Block formats //
+
+void encode_bc1_block( const unsigned char* rgba, unsigned char* block ) {
+  encode_color_block(rgba, block);
+}
+
+void decode_bc1_block( const unsigned char* block, unsigned char* rgba ) {
+  decode_color_block(block, rgba, false);
+}
+
+void encode_bc3_block( const unsigned char* rgba, unsigned char* block ) {
+  encode_alpha_block(rgba, block);
+  encode_color_block(rgba, block + 8);
+}
+
+void decode_bc3_block( const unsigned char* block, unsigned char* rgba ) {
+  decode_color_block(block + 8, rgba, true);
+  decode_alpha_block(block, rgba);
+}
+
+} // namespace CMU462
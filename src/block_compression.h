@@ -0,0 +1,23 @@
+#ifndef CMU462_BLOCK_COMPRESSION_H
+#define CMU462_BLOCK_COMPRESSION_H
+
+namespace CMU462 {
+
+// BC1 / BC3 (DXT1 / DXT5) compatible codecs for 4x4 blocks of RGBA8
+// texels. Blocks hold 16 texels in row order, 64 bytes.
+
+// Bytes per compressed block.
+static const int kBC1BlockBytes = 8;
+static const int kBC3BlockBytes = 16;
+
+// BC1 stores color only, alpha decodes as 255.
+void encode_bc1_block( const unsigned char* rgba, unsigned char* block );
+void decode_bc1_block( const unsigned char* block, unsigned char* rgba );
+
+// BC3 adds an interpolated alpha block in front of the color block.
+void encode_bc3_block( const unsigned char* rgba, unsigned char* block );
+void decode_bc3_block( const unsigned char* block, unsigned char* rgba );
+
+} // namespace CMU462
+
+#endif // CMU462_BLOCK_COMPRESSION_H
@@ -0,0 +1,579 @@
+#include "deflate.h"
+
+#include <string.h>
+#include <algorithm>
+
+using namespace std;
+
+namespace CMU462 {
+
+static const unsigned LENBASE[29] =  {3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258};
+static const unsigned LENEXTRA[29] = {0,0,0,0,0,0,0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4,  4,  5,  5,  5,  5,  0};
+static const unsigned DISTBASE[30] =  {1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577};
+static const unsigned DISTEXTRA[30] = {0,0,0,0,1,1,2, 2, 3, 3, 4, 4, 5, 5,  6,  6,  7,  7,  8,  8,   9,   9,  10,  10,  11,  11,  12,   12,   13,   13};
+static const unsigned CLCL[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15}; // code length code order
+
+// Input bytes per independently compressed slice. Each slice restarts the
+// match window, which costs a little ratio but lets slices run in parallel.
+static const size_t kSliceSize = 1 << 18;
+
+// Tokens collected before a block is closed and its Huffman codes built.
+static const size_t kBlockTokens = 1 << 14;
+
+static const unsigned kHashBits  = 15;
+static const unsigned kHashSize  = 1 << kHashBits;
+static const unsigned kWindowSize = 1 << 15;
+static const unsigned kWindowMask = kWindowSize - 1;
+static const unsigned kMinMatch = 3;
+static const unsigned kMaxMatch = 258;
+
+// Checksums //
+
+struct CRCTables {
+  uint32_t t[8][256];
+  CRCTables() {
+    for (uint32_t n = 0; n < 256; n++) {
+      uint32_t c = n;
+      for (int k = 0; k < 8; k++) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+      t[0][n] = c;
+    }
+    for (uint32_t n = 0; n < 256; n++) {
+      for (int k = 1; k < 8; k++) t[k][n] = (t[k - 1][n] >> 8) ^ t[0][t[k - 1][n] & 0xff];
+    }
+  }
+};
+
+static const CRCTables& crc_tables() {
+  static const CRCTables tables;
+  return tables;
+}
+
+static inline uint32_t load32le( const unsigned char* p ) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+uint32_t crc32( uint32_t crc, const unsigned char* data, size_t size ) {
+
+  // slice-by-8: fold eight input bytes per step through eight tables
+  const uint32_t (*t)[256] = crc_tables().t;
+  crc = ~crc;
+  while (size >= 8) {
+    uint32_t one = crc ^ load32le(data);
+    uint32_t two = load32le(data + 4);
+    crc = t[7][one & 0xff] ^ t[6][(one >> 8) & 0xff] ^ t[5][(one >> 16) & 0xff] ^ t[4][one >> 24] ^
+          t[3][two & 0xff] ^ t[2][(two >> 8) & 0xff] ^ t[1][(two >> 16) & 0xff] ^ t[0][two >> 24];
+    data += 8; size -= 8;
+  }
+  while (size--) crc = t[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+  return ~crc;
+}
+
+static const uint32_t kAdlerBase = 65521;
+
+uint32_t adler32( uint32_t adler, const unsigned char* data, size_t size ) {
+
+  uint32_t a = adler & 0xffff, b = adler >> 16;
+  while (size) {
+    // 5552 is the largest run that cannot overflow b before the modulo
+    size_t n = size < 5552 ? size : 5552;
+    size -= n;
+    for (; n >= 8; n -= 8, data += 8) {
+      a += data[0]; b += a; a += data[1]; b += a;
+      a += data[2]; b += a; a += data[3]; b += a;
+      a += data[4]; b += a; a += data[5]; b += a;
+      a += data[6]; b += a; a += data[7]; b += a;
+    }
+    for (; n; n--) { a += *data++; b += a; }
+    a %= kAdlerBase; b %= kAdlerBase;
+  }
+  return (b << 16) | a;
+}
+
+uint32_t adler32_combine( uint32_t adler1, uint32_t adler2, size_t size2 ) {
+
+  uint32_t rem = (uint32_t) (size2 % kAdlerBase);
+  uint32_t a = adler1 & 0xffff;
+  uint32_t b = (uint32_t) (((uint64_t) rem * a) % kAdlerBase);
+  a += (adler2 & 0xffff) + kAdlerBase - 1;
+  b += (adler1 >> 16) + (adler2 >> 16) + kAdlerBase - rem;
+  if (a >= kAdlerBase) a -= kAdlerBase;
+  if (a >= kAdlerBase) a -= kAdlerBase;
+  if (b >= kAdlerBase * 2) b -= kAdlerBase * 2;
+  if (b >= kAdlerBase) b -= kAdlerBase;
+  return (b << 16) | a;
+}
+
+// Symbol Tables //
+
+struct SymbolTables {
+  unsigned char length_code[kMaxMatch + 1]; // match length -> index into LENBASE
+  unsigned char dist_code[512];             // see dist_symbol
+  SymbolTables() {
+    for (unsigned c = 0; c < 29; c++) {
+      unsigned last = c == 28 ? 258 : LENBASE[c] + (1u << LENEXTRA[c]) - 1;
+      for (unsigned l = LENBASE[c]; l <= last && l <= kMaxMatch; l++) length_code[l] = c;
+    }
+    length_code[258] = 28;
+    for (unsigned c = 0; c < 30; c++) {
+      unsigned last = DISTBASE[c] + (1u << DISTEXTRA[c]) - 1;
+      for (unsigned d = DISTBASE[c]; d <= last; d++) {
+        if (d <= 256) dist_code[d - 1] = c;
+        else dist_code[256 + ((d - 1) >> 7)] = c;
+      }
+    }
+  }
+};
+
+static const SymbolTables& symbol_tables() {
+  static const SymbolTables tables;
+  return tables;
+}
+
+// distance codes above 256 start on multiples of 128, so the upper half of
+// the table is indexed by (dist - 1) / 128
+static inline unsigned dist_symbol( const SymbolTables& st, unsigned dist ) {
+  return dist <= 256 ? st.dist_code[dist - 1] : st.dist_code[256 + ((dist - 1) >> 7)];
+}
+
+// Huffman Coding //
+
+struct HuffmanCode {
+
+  unsigned char lengths[288];
+  uint16_t codes[288]; // bit reversed, ready for the LSB-first bit writer
+
+  // build length limited codes for the given symbol frequencies
+  void build( const unsigned* freq, unsigned num_symbols, unsigned max_bits ) {
+
+    memset(lengths, 0, sizeof(lengths));
+
+    // used symbols sorted by ascending frequency
+    unsigned sorted[288]; unsigned used = 0;
+    for (unsigned s = 0; s < num_symbols; s++) if (freq[s]) sorted[used++] = s;
+    sort(sorted, sorted + used, [freq]( unsigned a, unsigned b ) {
+      return freq[a] < freq[b] || (freq[a] == freq[b] && a < b);
+    });
+
+    // keep every tree complete: a lone symbol gets a sibling
+    if (used < 2) {
+      unsigned s = used ? sorted[0] : 0;
+      lengths[s] = 1; lengths[s == 0 ? 1 : 0] = 1;
+      assign_codes(num_symbols);
+      return;
+    }
+
+    // two-queue Huffman construction: leaves come in sorted order and the
+    // internal nodes are created with non-decreasing weights
+    unsigned weight[2 * 288], parent[2 * 288];
+    for (unsigned i = 0; i < used; i++) weight[i] = freq[sorted[i]];
+    unsigned leaf = 0, node = used;
+    for (unsigned k = used; k < 2 * used - 1; k++) {
+      unsigned pick[2];
+      for (int j = 0; j < 2; j++) {
+        if (leaf < used && (node >= k || weight[leaf] <= weight[node])) pick[j] = leaf++;
+        else pick[j] = node++;
+      }
+      weight[k] = weight[pick[0]] + weight[pick[1]];
+      parent[pick[0]] = parent[pick[1]] = k;
+    }
+
+    // depth of every node, the root is the last one created
+    unsigned depth[2 * 288];
+    depth[2 * used - 2] = 0;
+    unsigned num_codes[64] = {0};
+    for (int k = 2 * used - 3; k >= 0; k--) {
+      depth[k] = depth[parent[k]] + 1;
+      if (k < (int) used) num_codes[min(depth[k], 63u)]++;
+    }
+
+    // fold codes deeper than max_bits back in until the Kraft sum fits
+    for (unsigned i = max_bits + 1; i < 64; i++) {
+      num_codes[max_bits] += num_codes[i]; num_codes[i] = 0;
+    }
+    uint32_t total = 0;
+    for (unsigned i = max_bits; i > 0; i--) total += num_codes[i] << (max_bits - i);
+    while (total != (1u << max_bits)) {
+      num_codes[max_bits]--;
+      for (unsigned i = max_bits - 1; i > 0; i--) {
+        if (num_codes[i]) { num_codes[i]--; num_codes[i + 1] += 2; break; }
+      }
+      total--;
+    }
+
+    // rarest symbols get the longest codes
+    unsigned next = 0;
+    for (unsigned len = max_bits; len > 0; len--) {
+      for (unsigned n = num_codes[len]; n > 0; n--) lengths[sorted[next++]] = len;
+    }
+
+    assign_codes(num_symbols);
+  }
+
+  // canonical codes from the lengths
+  void assign_codes( unsigned num_symbols ) {
+    unsigned count[16] = {0}, next_code[16];
+    for (unsigned s = 0; s < num_symbols; s++) count[lengths[s]]++;
+    count[0] = 0;
+    unsigned code = 0;
+    for (unsigned len = 1; len <= 15; len++) {
+      code = (code + count[len - 1]) << 1;
+      next_code[len] = code;
+    }
+    for (unsigned s = 0; s < num_symbols; s++) {
+      unsigned len = lengths[s];
+      if (!len) { codes[s] = 0; continue; }
+      unsigned c = next_code[len]++, r = 0;
+      for (unsigned i = 0; i < len; i++) { r = (r << 1) | (c & 1); c >>= 1; }
+      codes[s] = r;
+    }
+  }
+
+}; // struct HuffmanCode
+
+// Bit Output //
+
+struct BitWriter {
+
+  vector<unsigned char>& out;
+  uint64_t buf;
+  unsigned count;
+
+  BitWriter( vector<unsigned char>& out ) : out ( out ), buf ( 0 ), count ( 0 ) { }
+
+  inline void put( uint32_t bits, unsigned n ) {
+    buf |= (uint64_t) bits << count;
+    count += n;
+    if (count >= 32) {
+      size_t s = out.size();
+      out.resize(s + 4);
+      out[s + 0] = buf; out[s + 1] = buf >> 8; out[s + 2] = buf >> 16; out[s + 3] = buf >> 24;
+      buf >>= 32; count -= 32;
+    }
+  }
+
+  // pad with zero bits up to the next byte boundary and flush
+  void align() {
+    while (count > 0) {
+      out.push_back(buf & 0xff);
+      buf >>= 8;
+      count = count > 8 ? count - 8 : 0;
+    }
+    buf = 0;
+  }
+
+}; // struct BitWriter
+
+// Block Encoding //
+
+struct Token {
+  uint16_t length; // match length, or the literal byte when dist is 0
+  uint16_t dist;
+};
+
+static void write_stored( BitWriter& bw, const unsigned char* raw, size_t size, bool final ) {
+  do {
+    size_t len = size < 65535 ? size : 65535;
+    size -= len;
+    bw.put(final && !size ? 1 : 0, 1);
+    bw.put(0, 2);
+    bw.align();
+    bw.put(len, 16);
+    bw.put(~len & 0xffff, 16);
+    bw.out.insert(bw.out.end(), raw, raw + len);
+    raw += len;
+  } while (size);
+}
+
+// writes tokens as one dynamic Huffman block, or as stored blocks when
+// those come out smaller (raw holds the input the tokens encode)
+static void write_block( BitWriter& bw, const Token* tokens, size_t num_tokens,
+                         const unsigned char* raw, size_t raw_size, bool final ) {
+
+  const SymbolTables& st = symbol_tables();
+
+  unsigned lit_freq[286] = {0}, dist_freq[30] = {0};
+  for (size_t i = 0; i < num_tokens; i++) {
+    const Token& t = tokens[i];
+    if (!t.dist) { lit_freq[t.length]++; continue; }
+    lit_freq[257 + st.length_code[t.length]]++;
+    dist_freq[dist_symbol(st, t.dist)]++;
+  }
+  lit_freq[256] = 1;
+
+  HuffmanCode lit, dist;
+  lit.build(lit_freq, 286, 15);
+  dist.build(dist_freq, 30, 15);
+
+  unsigned hlit = 286, hdist = 30;
+  while (hlit > 257 && !lit.lengths[hlit - 1]) hlit--;
+  while (hdist > 1 && !dist.lengths[hdist - 1]) hdist--;
+
+  // run-length encode the code lengths with symbols 16, 17 and 18
+  unsigned char all[286 + 30];
+  memcpy(all, lit.lengths, hlit);
+  memcpy(all + hlit, dist.lengths, hdist);
+  unsigned total = hlit + hdist;
+
+  unsigned char cl_sym[286 + 30], cl_extra[286 + 30]; unsigned num_cl = 0;
+  unsigned cl_freq[19] = {0};
+  for (unsigned i = 0; i < total;) {
+    unsigned value = all[i], run = 1;
+    while (i + run < total && all[i + run] == value) run++;
+    i += run;
+    if (value == 0) {
+      while (run >= 11) {
+        unsigned r = min(run, 138u);
+        cl_sym[num_cl] = 18; cl_extra[num_cl++] = r - 11; run -= r;
+      }
+      if (run >= 3) {
+        cl_sym[num_cl] = 17; cl_extra[num_cl++] = run - 3; run = 0;
+      }
+    } else {
+      cl_sym[num_cl] = value; cl_extra[num_cl++] = 0; run--;
+      while (run >= 3) {
+        unsigned r = min(run, 6u);
+        cl_sym[num_cl] = 16; cl_extra[num_cl++] = r - 3; run -= r;
+      }
+    }
+    while (run--) { cl_sym[num_cl] = value; cl_extra[num_cl++] = 0; }
+  }
+  for (unsigned i = 0; i < num_cl; i++) cl_freq[cl_sym[i]]++;
+
+  HuffmanCode cl;
+  cl.build(cl_freq, 19, 7);
+  unsigned hclen = 19;
+  while (hclen > 4 && !cl.lengths[CLCL[hclen - 1]]) hclen--;
+
+  // compare against storing the input as is
+  static const unsigned cl_extra_bits[19] = {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,2,3,7};
+  uint64_t bits = 3 + 14 + 3 * hclen;
+  for (unsigned s = 0; s < 19; s++) bits += (uint64_t) cl_freq[s] * (cl.lengths[s] + cl_extra_bits[s]);
+  for (unsigned s = 0; s < 286; s++) {
+    bits += (uint64_t) lit_freq[s] * (lit.lengths[s] + (s > 256 ? LENEXTRA[s - 257] : 0));
+  }
+  for (unsigned s = 0; s < 30; s++) bits += (uint64_t) dist_freq[s] * (dist.lengths[s] + DISTEXTRA[s]);
+  uint64_t stored_bits = (raw_size + 5 * (raw_size / 65535 + 1)) * 8 + 7;
+  if (stored_bits <= bits) {
+    write_stored(bw, raw, raw_size, final);
+    return;
+  }
+
+  // block header and code tables
+  bw.put(final ? 1 : 0, 1);
+  bw.put(2, 2);
+  bw.put(hlit - 257, 5);
+  bw.put(hdist - 1, 5);
+  bw.put(hclen - 4, 4);
+  for (unsigned i = 0; i < hclen; i++) bw.put(cl.lengths[CLCL[i]], 3);
+  for (unsigned i = 0; i < num_cl; i++) {
+    unsigned s = cl_sym[i];
+    bw.put(cl.codes[s], cl.lengths[s]);
+    if (s >= 16) bw.put(cl_extra[i], cl_extra_bits[s]);
+  }
+
+  // compressed data
+  for (size_t i = 0; i < num_tokens; i++) {
+    const Token& t = tokens[i];
+    if (!t.dist) {
+      bw.put(lit.codes[t.length], lit.lengths[t.length]);
+      continue;
+    }
+    unsigned lc = st.length_code[t.length];
+    bw.put(lit.codes[257 + lc], lit.lengths[257 + lc]);
+    bw.put(t.length - LENBASE[lc], LENEXTRA[lc]);
+    unsigned dc = dist_symbol(st, t.dist);
+    bw.put(dist.codes[dc], dist.lengths[dc]);
+    bw.put(t.dist - DISTBASE[dc], DISTEXTRA[dc]);
+  }
+  bw.put(lit.codes[256], lit.lengths[256]);
+}
+
+// LZ77 Matching //
+
+static inline unsigned match_length( const unsigned char* a, const unsigned char* b,
+                                     unsigned max_len ) {
+  unsigned n = 0;
+  while (n + 8 <= max_len) {
+    uint64_t x, y;
+    memcpy(&x, a + n, 8); memcpy(&y, b + n, 8);
+    if (x != y) return n + (__builtin_ctzll(x ^ y) >> 3); // little endian
+    n += 8;
+  }
+  while (n < max_len && a[n] == b[n]) n++;
+  return n;
+}
+
+static inline unsigned hash3( const unsigned char* p ) {
+  uint32_t v = p[0] | (p[1] << 8) | (p[2] << 16);
+  return (v * 2654435761u) >> (32 - kHashBits);
+}
+
+class SliceCompressor {
+ public:
+
+  SliceCompressor( DeflateLevel level ) : level ( level ) {
+    max_chain = level == DEFLATE_SMALL ? 128 : 8;
+    nice_length = level == DEFLATE_SMALL ? kMaxMatch : 32;
+    lazy = level == DEFLATE_SMALL;
+  }
+
+  void compress( vector<unsigned char>& out, const unsigned char* in,
+                 size_t size, bool final ) {
+
+    BitWriter bw ( out );
+
+    if (level == DEFLATE_STORE) {
+      write_stored(bw, in, size, final);
+    } else if (size == 0) {
+      // empty fixed Huffman block holding only the end code
+      bw.put(final ? 1 : 0, 1); bw.put(1, 2); bw.put(0, 7);
+    } else {
+      if (level != DEFLATE_RLE) {
+        head.assign(kHashSize, -1);
+        prev.resize(kWindowSize);
+      }
+      tokens.reserve(kBlockTokens);
+
+      size_t block_start = 0, pos = 0;
+      while (pos < size) {
+        tokens.clear();
+        while (pos < size && tokens.size() < kBlockTokens) {
+          pos = level == DEFLATE_RLE ? next_token_rle(in, size, pos)
+                                     : next_token(in, size, pos);
+        }
+        write_block(bw, &tokens[0], tokens.size(),
+                    in + block_start, pos - block_start, final && pos == size);
+        block_start = pos;
+      }
+    }
+
+    if (!final && level != DEFLATE_STORE) {
+      // end the slice on a byte boundary with an empty stored block
+      bw.put(0, 3);
+      bw.align();
+      bw.put(0x0000, 16);
+      bw.put(0xffff, 16);
+    }
+    bw.align();
+  }
+
+ private:
+
+  DeflateLevel level;
+  unsigned max_chain, nice_length;
+  bool lazy;
+
+  vector<int32_t> head, prev;
+  vector<Token> tokens;
+
+  inline void insert( const unsigned char* in, size_t pos ) {
+    unsigned h = hash3(in + pos);
+    prev[pos & kWindowMask] = head[h];
+    head[h] = (int32_t) pos;
+  }
+
+  inline unsigned longest_match( const unsigned char* in, size_t size, size_t pos,
+                                 unsigned& best_dist ) {
+    unsigned max_len = (unsigned) min((size_t) kMaxMatch, size - pos);
+    unsigned best = 0;
+    int32_t cand = head[hash3(in + pos)];
+    for (unsigned chain = max_chain; cand >= 0 && chain; chain--) {
+      size_t dist = pos - cand;
+      if (dist >= kWindowSize) break;
+      if (in[cand + best] == in[pos + best]) {
+        unsigned len = match_length(in + cand, in + pos, max_len);
+        if (len > best) {
+          best = len; best_dist = (unsigned) dist;
+          if (len >= nice_length || len == max_len) break;
+        }
+      }
+      int32_t next = prev[cand & kWindowMask];
+      if (next >= cand) break; // slot reused by a newer position
+      cand = next;
+    }
+    return best;
+  }
+
+  inline void literal( unsigned char c ) {
+    Token t = { c, 0 }; tokens.push_back(t);
+  }
+
+  inline void match( unsigned length, unsigned dist ) {
+    Token t = { (uint16_t) length, (uint16_t) dist }; tokens.push_back(t);
+  }
+
+  // emit the token starting at pos, returns the position after it
+  size_t next_token( const unsigned char* in, size_t size, size_t pos ) {
+
+    if (pos + kMinMatch > size) { literal(in[pos]); return pos + 1; }
+
+    unsigned dist = 0;
+    unsigned len = longest_match(in, size, pos, dist);
+    insert(in, pos);
+
+    // lazy evaluation: prefer a longer match starting one byte later
+    if (lazy && len >= kMinMatch && len < nice_length && pos + 1 + kMinMatch <= size) {
+      unsigned next_dist = 0;
+      unsigned next_len = longest_match(in, size, pos + 1, next_dist);
+      if (next_len > len) { literal(in[pos]); return pos + 1; }
+    }
+
+    if (len < kMinMatch) { literal(in[pos]); return pos + 1; }
+
+    match(len, dist);
+    size_t end = pos + len;
+    size_t last = min(end, size - kMinMatch + 1);
+    for (size_t p = pos + 1; p < last; p++) insert(in, p);
+    return end;
+  }
+
+  // runs of the previous byte only, no hashing at all
+  size_t next_token_rle( const unsigned char* in, size_t size, size_t pos ) {
+    if (pos > 0) {
+      unsigned max_len = (unsigned) min((size_t) kMaxMatch, size - pos);
+      unsigned len = match_length(in + pos, in + pos - 1, max_len);
+      if (len >= kMinMatch) { match(len, 1); return pos + len; }
+    }
+    literal(in[pos]);
+    return pos + 1;
+  }
+
+}; // class SliceCompressor
+
+void deflate_zlib( vector< vector<unsigned char> >& pieces,
+                   const unsigned char* in, size_t size, DeflateLevel level ) {
+
+  int num_slices = size ? (int) ((size + kSliceSize - 1) / kSliceSize) : 1;
+  pieces.assign(num_slices, vector<unsigned char>());
+  vector<uint32_t> sums (num_slices);
+
+  #pragma omp parallel for schedule(dynamic)
+  for (int i = 0; i < num_slices; i++) {
+    size_t begin = i * kSliceSize;
+    size_t length = min(kSliceSize, size - begin);
+
+    vector<unsigned char>& out = pieces[i];
+    out.reserve(level == DEFLATE_STORE ? length + length / 8192 + 16 : length / 2 + 64);
+    if (i == 0) {
+      // CMF: deflate with a 32K window, FLG: level hint and check bits
+      out.push_back(0x78);
+      out.push_back(level == DEFLATE_SMALL ? 0xda : 0x01);
+    }
+
+    SliceCompressor compressor ( level );
+    compressor.compress(out, in + begin, length, i == num_slices - 1);
+    sums[i] = adler32(1, in + begin, length);
+  }
+
+  uint32_t adler = sums[0];
+  for (int i = 1; i < num_slices; i++) {
+    size_t length = min(kSliceSize, size - i * kSliceSize);
+    adler = adler32_combine(adler, sums[i], length);
+  }
+
+  vector<unsigned char>& last = pieces.back();
+  last.push_back(adler >> 24); last.push_back(adler >> 16);
+  last.push_back(adler >> 8);  last.push_back(adler);
+}
+
+} // namespace CMU462
@@ -0,0 +1,34 @@
+#ifndef CMU462_DEFLATE_H
+#define CMU462_DEFLATE_H
+
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+namespace CMU462 {
+
+// Compression effort of the deflate encoder, fastest first.
+typedef enum DeflateLevel {
+  DEFLATE_STORE, // stored blocks, no compression at all
+  DEFLATE_RLE,   // runs of the previous byte only
+  DEFLATE_FAST,  // greedy matching over short hash chains
+  DEFLATE_SMALL  // lazy matching over long hash chains
+} DeflateLevel;
+
+// Compresses in[0..size) into a zlib stream (RFC 1950 / RFC 1951). The input
+// is split into slices that are compressed in parallel; each slice ends on a
+// byte boundary and becomes one entry of pieces, so concatenating the pieces
+// in order yields the complete stream (header and adler32 included).
+void deflate_zlib( std::vector< std::vector<unsigned char> >& pieces,
+                   const unsigned char* in, size_t size, DeflateLevel level );
+
+// Running checksums, start with adler = 1 and crc = 0.
+uint32_t adler32( uint32_t adler, const unsigned char* data, size_t size );
+uint32_t crc32( uint32_t crc, const unsigned char* data, size_t size );
+
+// Adler32 of the concatenation of two buffers given their separate sums.
+uint32_t adler32_combine( uint32_t adler1, uint32_t adler2, size_t size2 );
+
+} // namespace CMU462
+
+#endif // CMU462_DEFLATE_H
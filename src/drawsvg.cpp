@@ -3,13 +3,28 @@
 #include <sstream>
 #include <iostream>
 #include <cstdlib>
+#include <cstring>
+#include <chrono>
 
 using namespace std;
 
 namespace CMU462 {
 
+// input idle time before a preview frame is refined, in milliseconds
+static const int kRefineDelay = 120;
+
 DrawSVG::~DrawSVG() {
 
+  // stop the render thread
+  if (render_thread.joinable()) {
+    {
+      lock_guard<mutex> lock(frame_mutex);
+      stop_rendering = true;
+    }
+    frame_posted.notify_one();
+    render_thread.join();
+  }
+
   tabs.clear();
   viewport_imp.clear();
   viewport_ref.clear();
@@ -57,7 +72,10 @@ void DrawSVG::init() {
   software_renderer = software_renderer_imp; // use imp at launch
 
   // texture sampler implementations
-  sampler_imp = new Sampler2DImp();
+  Sampler2DImp* tiled_sampler = new Sampler2DImp();
+  tiled_sampler->set_layout(TEXELS_TILED);
+  tiled_sampler->set_compression_threshold(2048 * 2048);
+  sampler_imp = tiled_sampler;
   sampler_ref = new Sampler2DRef();
   sampler = sampler_imp; // use imp at launch
 
@@ -86,6 +104,8 @@ void DrawSVG::init() {
   // initial osd
   osd = "Software Renderer";
 
+  // software frames are drawn off the event loop
+  render_thread = thread(&DrawSVG::render_loop, this);
 }
 
 void DrawSVG::render() {
@@ -94,8 +114,10 @@ void DrawSVG::render() {
     redraw();
   }
 
+  // only uploads rows changed since the last present
   if( method == Software ) {
-    display_pixels( &framebuffer[0] );
+    take_frame();
+    framebuffer.present();
   }
 
   if (show_zoom) {
@@ -106,13 +128,15 @@ void DrawSVG::render() {
 
 void DrawSVG::resize( size_t width, size_t height ) {
 
+  wait_render_idle();
   this->width  = width;
   this->height = height;
 
-  // resize render target
-  framebuffer.resize( 4 * width * height);
-  software_renderer_imp->set_render_target(&framebuffer[0], width, height);
-  software_renderer_ref->set_render_target(&framebuffer[0], width, height);
+  // resize presentation buffer, frames of the old size are dropped and
+  // the render thread sizes its frames from the next request
+  framebuffer.resize( width, height );
+  frame_ready = false;
+  shown_y0 = shown_y1 = 0;
 
   // update hardware renderer
   hardware_renderer->resize(width, height);
@@ -128,6 +152,11 @@ void DrawSVG::resize( size_t width, size_t height ) {
 
 void DrawSVG::key_event( char key ) {
 
+  // keys change state the render thread reads, a frame or refinement
+  // dropped here is drawn by the redraw at the end
+  bool dropped = wait_render_idle();
+  size_t requested = frames_requested;
+
   switch( key ) {
 
     // reset view transformation
@@ -152,7 +181,7 @@ void DrawSVG::key_event( char key ) {
       setRenderMethod( Software );
       break;
 
-    // switch between iml and ref sampler
+    // switch between the imp and ref mip generators
     case ';':
       sampler = sampler_imp;
       regenerate_mipmap(current_tab); redraw();
@@ -162,6 +191,63 @@ void DrawSVG::key_event( char key ) {
       regenerate_mipmap(current_tab); redraw();
       break;
 
+    // toggle anisotropic filtering in the imp sampler
+    case 'A':
+      if (sampler_imp->get_sample_method() == ANISOTROPIC) {
+        sampler_imp->set_sample_method(TRILINEAR);
+        osd = "Trilinear Filtering";
+      } else {
+        sampler_imp->set_sample_method(ANISOTROPIC);
+        osd = "Anisotropic Filtering";
+      }
+      redraw();
+      break;
+
+    // toggle the fixed point color pipeline of the imp renderer
+    case 'F':
+      {
+        SoftwareRendererImp* imp =
+          static_cast<SoftwareRendererImp*>(software_renderer_imp);
+        imp->set_fixed_point(!imp->get_fixed_point());
+        osd = imp->get_fixed_point() ? "Fixed Point Colors" : "Float Colors";
+      }
+      redraw();
+      break;
+
+    // toggle antialiased lines in the imp renderer
+    case 'L':
+      {
+        SoftwareRendererImp* imp =
+          static_cast<SoftwareRendererImp*>(software_renderer_imp);
+        imp->set_line_antialiasing(!imp->get_line_antialiasing());
+        osd = imp->get_line_antialiasing() ? "Antialiased Lines" : "Aliased Lines";
+      }
+      redraw();
+      break;
+
+    // toggle linear light blending and mip filtering in the imp renderer
+    case 'G':
+      {
+        SoftwareRendererImp* imp =
+          static_cast<SoftwareRendererImp*>(software_renderer_imp);
+        bool linear = !imp->get_linear_light();
+        imp->set_linear_light(linear);
+        static_cast<Sampler2DImp*>(sampler_imp)->set_linear_mips(linear);
+
+        // the mips of every document are filtered again
+        for (size_t i = 0; i < tabs.size(); ++i) refilter_mipmap(i);
+        osd = linear ? "Linear Light" : "sRGB Blending";
+      }
+      redraw();
+      break;
+
+    // block compress the textures of the current document
+    case 'C':
+      compress_textures(current_tab);
+      osd = "Compressed Textures";
+      redraw();
+      break;
+
     // change render method
     case 'S':
       setRenderMethod( Software ); info();
@@ -178,6 +264,14 @@ void DrawSVG::key_event( char key ) {
       }
       break;
 
+    // toggle the tile error heatmap of the diff
+    case 'M':
+      if (show_diff) {
+        show_heatmap = !show_heatmap;
+        redraw();
+      }
+      break;
+
     // toggle zoom
     case 'Z':
       show_zoom = !show_zoom;
@@ -215,23 +309,29 @@ void DrawSVG::key_event( char key ) {
       setTab( 8 );
       break;
 
+    // toggle progressive refinement while panning and zooming
+    case 'P':
+      progressive = !progressive;
+      osd = progressive ? "Progressive Refinement" : "Full Quality Interaction";
+      break;
+
     default:
-      return;
+      break;
   }
+
+  if (dropped && requested == frames_requested) redraw();
 }
 
 void DrawSVG::cursor_event( float x, float y, unsigned char keys ) {
   
   // translate when left mouse button is held down
-  // diff is disabled when panning - it's too slow
   if (keys & (1 << 2)) {
   
-    show_diff = false;
     float dx = (x - cursor_x) / width  * tabs[current_tab]->width;
     float dy = (y - cursor_y) / height * tabs[current_tab]->height;
     viewport_imp[current_tab]->update_viewbox(dx, dy, 1);
     viewport_ref[current_tab]->update_viewbox(dx, dy, 1);
-    redraw();
+    redraw(true);
   }
   
   // register new cursor location
@@ -240,15 +340,13 @@ void DrawSVG::cursor_event( float x, float y, unsigned char keys ) {
 }
 
 void DrawSVG::scroll_event( float offset_x, float offset_y ) {
-  // diff is disabled when zooming - it's too slow
   if (offset_x || offset_y) {
-    show_diff = false;
     // prevent inverting axis when scrolling too fast
     float scale = 1 + 0.05 * offset_x + 0.05 * offset_y;
     scale = scale < 0.5 ? 0.5 : (scale > 1.5 ? 1.5 : scale); 
     viewport_imp[current_tab]->update_viewbox(0, 0, scale);
     viewport_ref[current_tab]->update_viewbox(0, 0, scale);
-    redraw();
+    redraw(true);
   }
 }
 
@@ -258,23 +356,26 @@ void DrawSVG::clear( void ) {
     hardware_renderer->clear_target();
   }
 
-  if( method == Software ) {
-    software_renderer->clear_target();    
-  }
+  // the software renderers clear their targets in draw_svg, clearing
+  // here as well would defeat the dirty rows of the imp
 }
 
 void DrawSVG::newTab( SVG* svg ) {
+  bool dropped = wait_render_idle();
   if (tabs.size() < 9) {
     tabs.push_back(svg);
   } else {
     fprintf(stderr, "DrawSVG can only hold up to 9 tabs");
   }
+  if (dropped) redraw();
 }
 
 void DrawSVG::delTab( size_t tab_index ) {
+  bool dropped = wait_render_idle();
   if (tab_index < tabs.size()) {
     tabs.erase(tabs.begin() + tab_index);
   }
+  if (dropped && current_tab < tabs.size()) redraw();
 }
 
 void DrawSVG::setTab( size_t tab_index ) {
@@ -289,38 +390,28 @@ void DrawSVG::setTab( size_t tab_index ) {
   }
 }
 
-void DrawSVG::draw_diff() {
+void DrawSVG::draw_diff( const FrameRequest& request, unsigned char* pixels ) {
 
-  // get reference output
-  software_renderer_ref->draw_svg(*tabs[current_tab]);
-  
-  // save reference output
-  vector<unsigned char> reference ( 4 * width * height );
-  memcpy(&reference[0], &framebuffer[0], 4 * width * height );
-  memset(&framebuffer[0], 255, 4 * width * height);
+  SVG& svg = *tabs[request.tab];
+  size_t width = request.width, height = request.height;
 
-  // get implementation output
-  software_renderer_imp->draw_svg(*tabs[current_tab]);
+  // the reference renders into its own buffer, alongside the imp
+  diff_reference.resize( 4 * width * height );
+  software_renderer_ref->set_render_target(&diff_reference[0], width, height);
 
-  // take difference and count errors
-  int errorCount = 0;
-  for( size_t i = 0; i < width * height; i++ ) {
-
-    framebuffer[i*4 + 0] = abs(reference[i*4 + 0] - framebuffer[i*4 + 0]);
-    framebuffer[i*4 + 1] = abs(reference[i*4 + 1] - framebuffer[i*4 + 1]);
-    framebuffer[i*4 + 2] = abs(reference[i*4 + 2] - framebuffer[i*4 + 2]);
-    framebuffer[i*4 + 3] = 255;
-
-    for( int k = 0; k < 3; k++ ) {
-      if( framebuffer[i*4+k] ) {
-        errorCount++;
-        break;
-      }
-    }
-  
-    osd = to_string(errorCount) + " pixels different";
+  #pragma omp parallel sections
+  {
+    #pragma omp section
+    software_renderer_ref->draw_svg(svg);
+
+    #pragma omp section
+    software_renderer_imp->draw_svg(svg);
   }
+  software_renderer_ref->set_render_target(pixels, width, height);
 
+  // take difference and count errors
+  diff_images(&diff_reference[0], pixels, width, height, pixels, diff_metrics);
+  if (request.heatmap) draw_heatmap(diff_metrics, width, height, pixels);
 }
 
 void DrawSVG::draw_zoom() {
@@ -398,8 +489,6 @@ void DrawSVG::draw_zoom() {
 void DrawSVG::inc_sample_rate() {
   if (method == Software) {
     sample_rate += sample_rate < 4 ? 1 : 0;
-    software_renderer_imp->set_sample_rate(sample_rate);
-    software_renderer_ref->set_sample_rate(sample_rate);
     redraw();
   }
 }
@@ -407,49 +496,315 @@ void DrawSVG::inc_sample_rate() {
 void DrawSVG::dec_sample_rate() {
   if (method == Software) {
     sample_rate -= sample_rate > 1 ? 1 : 0;
-    software_renderer_imp->set_sample_rate(sample_rate);
-    software_renderer_ref->set_sample_rate(sample_rate);
     redraw();
   }
 }
 
-void DrawSVG::redraw() {
+void DrawSVG::redraw( bool interactive ) {
 
   clear();
 
   // set canvas_to_screen transformation
   Matrix3x3 m_imp = norm_to_screen * viewport_imp[current_tab]->get_canvas_to_norm();
   Matrix3x3 m_ref = norm_to_screen * viewport_ref[current_tab]->get_canvas_to_norm();
-  software_renderer_imp->set_canvas_to_screen( m_imp ); 
-  software_renderer_ref->set_canvas_to_screen( m_ref ); 
   hardware_renderer->set_canvas_to_screen( m_ref );
 
   switch (method) {
 
     case Hardware:  
+      // the hardware renderer reads the image's own texture
+      share_textures(current_tab, true);
       hardware_renderer->draw_svg(*tabs[current_tab]);
       break;
       
-    case Software: 
+    case Software: {
+
+      // post the latest view, replacing a request that has not started
+      lock_guard<mutex> lock(frame_mutex);
+      frame_request.tab = current_tab;
+      frame_request.imp_to_screen = m_imp;
+      frame_request.ref_to_screen = m_ref;
+      frame_request.renderer = software_renderer;
+      frame_request.diff = show_diff;
+      frame_request.heatmap = show_heatmap;
+      frame_request.sample_rate = sample_rate;
+      frame_request.interactive = interactive;
+      frame_request.preview = interactive && progressive;
+      frame_request.width = width;
+      frame_request.height = height;
+      frames_requested++;
+
+      // a full quality frame or refinement being drawn is stale now, an
+      // interactive one is finished so the view keeps up with the input
+      if (rendering && !rendering_interactive) frame_cancel.cancel();
+      frame_posted.notify_one();
+      break;
+    }
+
+  }
+}
+
+void DrawSVG::render_loop() {
+
+  unique_lock<mutex> lock(frame_mutex);
+  while (true) {
+    // a ready frame is in the only frame that may be drawn, it has to be
+    // shown first
+    auto posted = [this] {
+      return stop_rendering ||
+             (frames_finished != frames_requested && !frame_ready);
+    };
+    if (refine_pending) {
+      // the last frame was a preview, refine it once input is idle
+      frame_posted.wait_for(lock, chrono::milliseconds(kRefineDelay), posted);
+    } else {
+      frame_posted.wait(lock, posted);
+    }
+    if (stop_rendering) return;
+
+    // everything requested so far is covered by the latest request, a
+    // refinement redraws it at full quality
+    FrameRequest request = frame_request;
+    size_t requested = frames_requested;
+    if (frames_finished == frames_requested) {
+      if (!refine_pending || frame_ready) continue;
+      request.interactive = request.preview = false;
+    }
+    refine_pending = false;
+    rendering = true;
+    rendering_interactive = request.interactive;
+    frame_cancel.reset();
+
+    // the shown frame was fenced when it was taken over
+    unsigned char* pixels = NULL;
+    if (framebuffer.get_width() == request.width &&
+        framebuffer.get_height() == request.height) {
+      pixels = framebuffer.pixels(1 - framebuffer.shown());
+    }
+    lock.unlock();
+
+    // previews skip supersampling
+    bool preview = request.preview && request.sample_rate > 1;
+    bool drawn = pixels &&
+      render_frame(request, pixels, preview ? 1 : request.sample_rate);
+
+    // a cancelled frame is dropped, the request that cancelled it is next
+    if (!drawn) {
+      lock.lock();
+      frames_finished = requested;
+      rendering = false;
+      frame_finished.notify_all();
+      continue;
+    }
+
+    // rows the frame may have drawn
+    size_t y0 = 0, y1 = request.height;
+    if (!request.diff && request.renderer == software_renderer_imp) {
+      static_cast<SoftwareRendererImp*>(software_renderer_imp)->get_drawn_rows(y0, y1);
+    }
+
+    // the drawn frame becomes the ready one
+    string text;
+    if (request.diff) {
+      char psnr[32];
+      snprintf(psnr, sizeof(psnr), "%.1f", diff_metrics.psnr);
+      char mean[32];
+      snprintf(mean, sizeof(mean), "%.2f", diff_metrics.mean_error);
+      text = to_string(diff_metrics.mismatches) + " pixels different, max " +
+             to_string(diff_metrics.max_error) + ", mean " + mean +
+             ", PSNR " + psnr + " dB";
+    }
+
+    lock.lock();
+    frame_ready = true;
+    ready_y0 = y0; ready_y1 = y1;
+    frame_osd = text;
+    frames_finished = requested;
+    rendering = false;
+    refine_pending = preview;
+    frame_finished.notify_all();
+  }
+}
+
+bool DrawSVG::render_frame( const FrameRequest& request,
+                            unsigned char* pixels, size_t sample_rate ) {
+
+  SVG& svg = *tabs[request.tab];
+  software_renderer_imp->set_canvas_to_screen( request.imp_to_screen );
+  software_renderer_ref->set_canvas_to_screen( request.ref_to_screen );
+
+  // the reference renderer reads the image's own texture
+  share_textures(request.tab, request.diff ||
+                              request.renderer == software_renderer_ref);
+
+  // the frames alternate, so the imp starts from a full clear each time
+  software_renderer_imp->set_render_target(pixels, request.width, request.height);
+  software_renderer_ref->set_render_target(pixels, request.width, request.height);
+  software_renderer_imp->set_sample_rate(sample_rate);
+  software_renderer_ref->set_sample_rate(sample_rate);
+
+  // only imp frames can be cancelled
+  if (request.diff) {
+    draw_diff(request, pixels);
+  } else if (request.renderer == software_renderer_imp) {
+    RenderJob job;
+    job.token = &frame_cancel;
+    SoftwareRendererImp* imp = static_cast<SoftwareRendererImp*>(software_renderer_imp);
+    return imp->draw_svg(svg, job) == RENDER_COMPLETE;
+  } else {
+    request.renderer->draw_svg(svg);
+  }
+  return true;
+}
 
-      if (show_diff) { draw_diff(); return; }
-      software_renderer->draw_svg(*tabs[current_tab]);
-      display_pixels( &framebuffer[0] );
+bool DrawSVG::wait_render_idle() {
+
+  // the frame in flight is cancelled and requests that have not started
+  // are dropped, so events wait at most for a reference or diff frame,
+  // which cannot be cancelled. The render thread waits for ready frames
+  // to be shown.
+  unique_lock<mutex> lock(frame_mutex);
+  bool dropped = false;
+  while (true) {
+    if (frame_ready) {
+      show_ready_frame();
+    } else if (rendering) {
+      frame_cancel.cancel();
+      dropped = true;
+      frame_finished.wait(lock);
+    } else {
+      if (frames_finished != frames_requested) dropped = true;
+      frames_finished = frames_requested;
       break;
+    }
+  }
+
+  // nothing may start until the next request
+  dropped = dropped || refine_pending;
+  refine_pending = false;
+  return dropped;
+}
 
+void DrawSVG::take_frame() {
+  lock_guard<mutex> lock(frame_mutex);
+  if (frame_ready) show_ready_frame();
+}
+
+void DrawSVG::show_ready_frame() {
+
+  frame_ready = false;
+  size_t ready = 1 - framebuffer.shown();
+  framebuffer.show(ready);
+
+  // rows that are clear in both the ready and the shown frame match, the
+  // texture already holds them
+  size_t y0 = min(ready_y0, shown_y0), y1 = max(ready_y1, shown_y1);
+  if (ready_y0 >= ready_y1) { y0 = shown_y0; y1 = shown_y1; }
+  if (shown_y0 >= shown_y1) { y0 = ready_y0; y1 = ready_y1; }
+  framebuffer.mark_dirty(y0, y1);
+  shown_y0 = ready_y0; shown_y1 = ready_y1;
+
+  // the previously shown frame is drawn next, its last upload was issued
+  // a present ago and has usually finished
+  framebuffer.wait(1 - ready);
+  frame_posted.notify_one();
+
+  if (!frame_osd.empty()) osd = frame_osd;
+}
+
+static void collect_images( const vector<SVGElement*>& elements,
+                            vector<Image*>& images ) {
+  for ( size_t i = 0; i < elements.size(); ++i ) {
+    SVGElement* element = elements[i];
+    if (element->type == IMAGE) {
+      images.push_back(static_cast<Image*>(element));
+    } else if (element->type == GROUP) {
+      collect_images(static_cast<Group*>(element)->elements, images);
+    }
   }
 }
 
 void DrawSVG::regenerate_mipmap(size_t tab_index) {
   if (tab_index < tabs.size()) {
-    SVG* svg = tabs[tab_index];
-    for ( size_t i = 0; i < svg->elements.size(); ++i ) {
-  
-      SVGElement* element = svg->elements[i];
-      if (element->type == IMAGE) {
-          Texture& tex = static_cast<Image*>(element)->tex;
-          sampler->generate_mips(tex, 0);
+    vector<Image*> images;
+    collect_images(tabs[tab_index]->elements, images);
+
+    // Mips are built once per texture, and again when the current sampler
+    // did not build them. Shared textures stay in the imp sampler's layout
+    // whichever sampler builds them. Block compressed textures keep their
+    // mips, rebuilding them would start from the lossy decoded level 0.
+    for ( size_t i = 0; i < images.size(); ++i ) {
+      Texture& tex = images[i]->texture();
+      if (tex.mipmap.empty()) continue;
+      bool compressed = tex.layout == TEXELS_BC1 || tex.layout == TEXELS_BC3;
+      if (tex.mips_valid && (tex.mips_by == sampler || compressed)) continue;
+      if (sampler == sampler_imp) {
+        sampler_imp->generate_mips(tex, 0);
+      } else {
+        // the reference filters in row order
+        set_texel_layout(tex, TEXELS_LINEAR);
+        sampler->generate_mips(tex, 0);
+        set_texel_layout(tex, static_cast<Sampler2DImp*>(sampler_imp)->get_layout());
+      }
+      tex.mips_valid = true;
+      tex.mips_by = sampler;
+
+      // private copies are refilled from the new mips when needed
+      images[i]->drop_private_copy();
+    }
+  }
+}
+
+void DrawSVG::refilter_mipmap(size_t tab_index) {
+  if (tab_index < tabs.size()) {
+    vector<Image*> images;
+    collect_images(tabs[tab_index]->elements, images);
+    // compressed textures keep their mips, rebuilding them would start
+    // from the lossy decoded level 0 and drop the compression
+    for ( size_t i = 0; i < images.size(); ++i ) {
+      Texture& tex = images[i]->texture();
+      if (tex.layout == TEXELS_BC1 || tex.layout == TEXELS_BC3) continue;
+      tex.mips_valid = false;
+    }
+    regenerate_mipmap(tab_index);
+  }
+}
+
+void DrawSVG::share_textures(size_t tab_index, bool private_copies) {
+  if (tab_index < tabs.size()) {
+    vector<Image*> images;
+    collect_images(tabs[tab_index]->elements, images);
+
+    // each shared texture is converted once, later images copy the
+    // first image's row order copy
+    map<const Texture*, const Texture*> converted;
+    for ( size_t i = 0; i < images.size(); ++i ) {
+      Image* image = images[i];
+      if (!image->shared_tex) continue;
+      if (!private_copies) {
+        image->drop_private_copy();
+        continue;
       }
+      const Texture*& copy = converted[image->shared_tex.get()];
+      if (image->tex.mipmap.empty()) {
+        image->make_private_copy(copy ? *copy : *image->shared_tex);
+      }
+      copy = &image->tex;
+    }
+  }
+}
+
+void DrawSVG::compress_textures(size_t tab_index) {
+  if (tab_index < tabs.size()) {
+    regenerate_mipmap(tab_index);
+
+    vector<Image*> images;
+    collect_images(tabs[tab_index]->elements, images);
+
+    // textures shared with other tabs are compressed for those as well
+    for ( size_t i = 0; i < images.size(); ++i ) {
+      if (images[i]->texture().mipmap.empty()) continue;
+      compress_texture(images[i]->texture());
     }
   }
 }
@@ -463,32 +818,4 @@ void DrawSVG::auto_adjust(size_t tab_index) {
   viewport_ref[tab_index]->set_viewbox( w / 2, h / 2, span);
 }
 
-
-void DrawSVG::display_pixels( const unsigned char* pixels ) const {
-
-  // copy pixels to the screen
-  glPushAttrib( GL_VIEWPORT_BIT );
-  glViewport(0, 0, width, height);
-
-  glMatrixMode( GL_PROJECTION );
-  glPushMatrix();
-  glLoadIdentity();
-  glOrtho( 0, width, 0, height, 0, 0 );
-
-  glMatrixMode( GL_MODELVIEW );
-  glPushMatrix();
-  glLoadIdentity();
-  glTranslatef( -1, 1, 0 );
-
-  glRasterPos2f(0, 0);
-  glPixelZoom( 1.0, -1.0 );
-  glDrawPixels( width, height, GL_RGBA, GL_UNSIGNED_BYTE, pixels );
-  glPixelZoom( 1.0, 1.0 );
-
-  glPopAttrib();
-  glMatrixMode( GL_PROJECTION ); glPopMatrix();
-  glMatrixMode( GL_MODELVIEW  ); glPopMatrix();
-
-}
-
 } // namespace CMU462
@@ -2,11 +2,16 @@
 #define CMU462_DRAWSVG_H
 
 #include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 #include "CMU462.h"
 #include "svg.h"
 #include "hardware_renderer.h"
 #include "software_renderer.h"
+#include "image_diff.h"
+#include "pixel_buffer.h"
 
 namespace CMU462 {
 
@@ -38,8 +43,19 @@ class DrawSVG : public Renderer {
     sample_rate (1),
     current_tab (0),
     show_diff (false),
+    show_heatmap (false),
     show_zoom (false),
-    norm_to_screen ( Matrix3x3::identity() )  { }
+    norm_to_screen ( Matrix3x3::identity() ),
+    frames_requested (0),
+    frames_finished (0),
+    frame_ready (false),
+    stop_rendering (false),
+    rendering (false),
+    rendering_interactive (false),
+    refine_pending (false),
+    progressive (true),
+    ready_y0 (0), ready_y1 (0),
+    shown_y0 (0), shown_y1 (0) { }
 
   /**
    * Destructor.
@@ -136,7 +152,7 @@ class DrawSVG : public Renderer {
   SoftwareRenderer* software_renderer_imp;
   SoftwareRenderer* software_renderer_ref;
 
-  /* texture sampler */
+  /* texture samplers, sampler builds the mips */
   Sampler2D* sampler;
   Sampler2D* sampler_imp;
   Sampler2D* sampler_ref;
@@ -146,9 +162,25 @@ class DrawSVG : public Renderer {
   std::vector<Viewport*> viewport_imp;
   std::vector<Viewport*> viewport_ref;
   
+  /* everything a software frame depends on that input can change */
+  struct FrameRequest {
+    size_t tab;
+    Matrix3x3 imp_to_screen;
+    Matrix3x3 ref_to_screen;
+    SoftwareRenderer* renderer;
+    bool diff, heatmap;
+    size_t width, height;
+    size_t sample_rate;
+    bool interactive; // part of a pan or zoom
+    bool preview;     // drawn without supersampling, refined later
+  };
+
   /* diff */
   bool show_diff;
-  void draw_diff();
+  bool show_heatmap;
+  void draw_diff( const FrameRequest& request, unsigned char* pixels );
+  std::vector<unsigned char> diff_reference;
+  DiffMetrics diff_metrics;
   
   /* zoom */
   bool show_zoom;
@@ -162,6 +194,17 @@ class DrawSVG : public Renderer {
   /* regenerate mipmap */
   void regenerate_mipmap(size_t tab_index);
 
+  /* regenerate mipmap even where built, after the imp sampler's filter
+     changed; block compressed textures are left as they are */
+  void refilter_mipmap(size_t tab_index);
+
+  /* fill (or release) the private texture copies read by the reference
+     and hardware renderers for the images of a tab */
+  void share_textures(size_t tab_index, bool private_copies);
+
+  /* block compress the textures of the images of a tab */
+  void compress_textures(size_t tab_index);
+
   /* audo-adjust canvas_to_norm */
   void auto_adjust(size_t tab_index);
 
@@ -172,14 +215,61 @@ class DrawSVG : public Renderer {
   std::vector<Matrix3x3> viewport_save_imp;
   std::vector<Matrix3x3> viewport_save_ref;
 
-  /* framebuffer for software renderer */
-  std::vector<unsigned char> framebuffer;
-
-  // update framebuffer
-  void redraw();
-
-  /* update framebuffer for software renderer */
-  void display_pixels( const unsigned char* pixels ) const;
+  /* framebuffer for software renderer, presented from GPU memory */
+  PixelBuffer framebuffer;
+
+  /* Software frames are drawn on a render thread into the framebuffer
+     frame that is not shown, which then becomes the ready frame. It is
+     shown by render(), and the render thread waits for that before it
+     draws over it. Requests that have not started are replaced by newer
+     ones. Anything the render thread reads besides the request (tabs,
+     renderers, samplers) is only changed after wait_render_idle(). */
+  std::thread render_thread;
+  std::mutex frame_mutex;
+  std::condition_variable frame_posted;
+  std::condition_variable frame_finished;
+  FrameRequest frame_request;
+  size_t frames_requested, frames_finished;
+  bool frame_ready, stop_rendering;
+
+  /* Progressive refinement: while the view changes frames are drawn
+     without supersampling, and the last one is redrawn at the full sample
+     rate once input has been idle for a moment. A new request replaces a
+     refinement that has not started. */
+  bool rendering, refine_pending;
+  bool progressive;
+
+  /* cancels the frame being drawn when a newer one is requested. Frames
+     drawn during interaction are not cancelled, so something reaches the
+     screen while input keeps coming; newer requests wait behind them. */
+  CancelToken frame_cancel;
+  bool rendering_interactive;
+
+  /* rows that may not be clear in the ready frame and in the shown one */
+  size_t ready_y0, ready_y1;
+  size_t shown_y0, shown_y1;
+  std::string frame_osd;
+
+  // render thread body
+  void render_loop();
+
+  // draws one software frame into pixels, false if it was cancelled
+  bool render_frame( const FrameRequest& request, unsigned char* pixels,
+                     size_t sample_rate );
+
+  // cancels the frame in flight, drops pending requests and refinements
+  // and blocks until the render thread is idle, true if a frame was
+  // dropped and the view needs a redraw
+  bool wait_render_idle();
+
+  // shows a newly drawn frame
+  void take_frame();
+
+  // shows the ready frame, with frame_mutex held
+  void show_ready_frame();
+
+  // update framebuffer, interactive for pan and zoom
+  void redraw( bool interactive = false );
 
 };
 
@@ -0,0 +1,146 @@
+#include "image_diff.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <algorithm>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+
+namespace CMU462 {
+
+// Running sums of one span of pixels.
+struct DiffSums {
+  uint64_t mismatches;
+  uint64_t abs_sum;
+  uint64_t sq_sum;
+  int max_error;
+};
+
+// Compares count pixels, writing the difference to diff when not null.
+static void diff_span( const unsigned char* a, const unsigned char* b,
+                       unsigned char* diff, size_t count, int tolerance,
+                       DiffSums& sums ) {
+  size_t i = 0;
+
+#ifdef __SSE2__
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i rgb = _mm_set1_epi32(0x00ffffff);
+  const __m128i alpha = _mm_set1_epi32((int) 0xff000000);
+  const __m128i tol = _mm_set1_epi8((char) tolerance);
+  __m128i max_v = zero, abs_v = zero, sq_v = zero;
+
+  for (; i + 4 <= count; i += 4) {
+    __m128i va = _mm_loadu_si128((const __m128i*) (a + 4 * i));
+    __m128i vb = _mm_loadu_si128((const __m128i*) (b + 4 * i));
+    __m128i d = _mm_or_si128(_mm_subs_epu8(va, vb), _mm_subs_epu8(vb, va));
+    d = _mm_and_si128(d, rgb);
+    if (diff) _mm_storeu_si128((__m128i*) (diff + 4 * i), _mm_or_si128(d, alpha));
+
+    // a pixel mismatches if any channel is above the tolerance
+    __m128i over = _mm_cmpeq_epi32(_mm_subs_epu8(d, tol), zero);
+    sums.mismatches += 4 - __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(over)));
+
+    max_v = _mm_max_epu8(max_v, d);
+    abs_v = _mm_add_epi64(abs_v, _mm_sad_epu8(d, zero));
+    __m128i lo = _mm_unpacklo_epi8(d, zero), hi = _mm_unpackhi_epi8(d, zero);
+    __m128i sq = _mm_add_epi32(_mm_madd_epi16(lo, lo), _mm_madd_epi16(hi, hi));
+    sq_v = _mm_add_epi64(sq_v, _mm_add_epi64(_mm_unpacklo_epi32(sq, zero),
+                                             _mm_unpackhi_epi32(sq, zero)));
+  }
+
+  uint64_t lanes[2];
+  _mm_storeu_si128((__m128i*) lanes, abs_v); sums.abs_sum += lanes[0] + lanes[1];
+  _mm_storeu_si128((__m128i*) lanes, sq_v);  sums.sq_sum += lanes[0] + lanes[1];
+  unsigned char bytes[16];
+  _mm_storeu_si128((__m128i*) bytes, max_v);
+  for (int k = 0; k < 16; k++) sums.max_error = max(sums.max_error, (int) bytes[k]);
+#endif
+
+  for (; i < count; i++) {
+    bool mismatch = false;
+    for (int k = 0; k < 3; k++) {
+      int d = abs(a[4 * i + k] - b[4 * i + k]);
+      if (diff) diff[4 * i + k] = d;
+      mismatch |= d > tolerance;
+      sums.max_error = max(sums.max_error, d);
+      sums.abs_sum += d;
+      sums.sq_sum += d * d;
+    }
+    if (diff) diff[4 * i + 3] = 255;
+    sums.mismatches += mismatch;
+  }
+}
+
+void diff_images( const unsigned char* reference, const unsigned char* image,
+                  size_t width, size_t height, unsigned char* diff,
+                  DiffMetrics& metrics, int tolerance, size_t tile_size ) {
+
+  tolerance = min(max(tolerance, 0), 255);
+  tile_size = max(tile_size, (size_t) 1);
+  size_t tiles_x = (width + tile_size - 1) / tile_size;
+  size_t tiles_y = (height + tile_size - 1) / tile_size;
+  metrics.tile_size = tile_size;
+  metrics.tiles_x = tiles_x;
+  metrics.tiles_y = tiles_y;
+  metrics.tile_error.assign(tiles_x * tiles_y, 0);
+
+  uint64_t mismatches = 0, abs_sum = 0, sq_sum = 0;
+  int max_error = 0;
+
+  // one row of tiles per iteration
+  #pragma omp parallel for schedule(dynamic) \
+    reduction(+:mismatches,abs_sum,sq_sum) reduction(max:max_error)
+  for (size_t ty = 0; ty < tiles_y; ty++) {
+    size_t y0 = ty * tile_size, y1 = min(y0 + tile_size, height);
+    for (size_t tx = 0; tx < tiles_x; tx++) {
+      size_t x0 = tx * tile_size, x1 = min(x0 + tile_size, width);
+
+      DiffSums sums = { 0, 0, 0, 0 };
+      for (size_t y = y0; y < y1; y++) {
+        size_t offset = 4 * (y * width + x0);
+        diff_span(reference + offset, image + offset,
+                  diff ? diff + offset : NULL, x1 - x0, tolerance, sums);
+      }
+
+      metrics.tile_error[ty * tiles_x + tx] =
+        (float) sums.abs_sum / (3 * (x1 - x0) * (y1 - y0));
+      mismatches += sums.mismatches;
+      abs_sum += sums.abs_sum;
+      sq_sum += sums.sq_sum;
+      max_error = max(max_error, sums.max_error);
+    }
+  }
+
+  double samples = 3.0 * width * height;
+  metrics.mismatches = mismatches;
+  metrics.max_error = max_error;
+  metrics.mean_error = samples ? abs_sum / samples : 0;
+  double mse = samples ? sq_sum / samples : 0;
+  metrics.psnr = mse ? 10 * log10(255.0 * 255.0 / mse) : INFINITY;
+}
+
+void draw_heatmap( const DiffMetrics& metrics, size_t width, size_t height,
+                   unsigned char* out ) {
+  float peak = 0;
+  for (size_t i = 0; i < metrics.tile_error.size(); i++) {
+    peak = max(peak, metrics.tile_error[i]);
+  }
+  float scale = peak ? 255.f / peak : 0;
+  for (size_t y = 0; y < height; y++) {
+    const float* row = &metrics.tile_error[(y / metrics.tile_size) * metrics.tiles_x];
+    for (size_t x = 0; x < width; x++, out += 4) {
+      float e = row[x / metrics.tile_size];
+      out[0] = (unsigned char) min(255.f, e * scale + 0.5f);
+      out[1] = 0;
+      out[2] = e > 0 ? 32 : 0;
+      out[3] = 255;
+    }
+  }
+}
+
+} // namespace CMU462
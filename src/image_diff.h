@@ -0,0 +1,52 @@
+#ifndef CMU462_IMAGE_DIFF_H
+#define CMU462_IMAGE_DIFF_H
+
+#include <stddef.h>
+#include <vector>
+
+namespace CMU462 {
+
+/**
+ * Error metrics of one RGBA8 image against a reference, over the color
+ * channels only (alpha is ignored).
+ */
+struct DiffMetrics {
+
+  DiffMetrics() : mismatches ( 0 ), max_error ( 0 ), mean_error ( 0 ),
+                  psnr ( 0 ), tile_size ( 0 ), tiles_x ( 0 ), tiles_y ( 0 ) { }
+
+  // pixels with a channel differing by more than the tolerance
+  size_t mismatches;
+
+  // largest absolute channel difference
+  int max_error;
+
+  // mean absolute channel difference
+  double mean_error;
+
+  // peak signal to noise ratio in dB, infinite for identical images
+  double psnr;
+
+  // mean absolute channel difference per tile, tiles in row order
+  size_t tile_size;
+  size_t tiles_x, tiles_y;
+  std::vector<float> tile_error;
+
+};
+
+// Compares image against reference, both width x height RGBA8. When diff
+// is not null it receives |image - reference| per channel with opaque
+// alpha; it may be the image buffer itself. Rows are compared in parallel.
+void diff_images( const unsigned char* reference, const unsigned char* image,
+                  size_t width, size_t height, unsigned char* diff,
+                  DiffMetrics& metrics, int tolerance = 0,
+                  size_t tile_size = 32 );
+
+// Paints the tile errors of metrics into an RGBA8 image of the size that
+// was compared, black for exact tiles up to red for the worst tile.
+void draw_heatmap( const DiffMetrics& metrics, size_t width, size_t height,
+                   unsigned char* out );
+
+} // namespace CMU462
+
+#endif // CMU462_IMAGE_DIFF_H
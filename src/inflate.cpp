@@ -0,0 +1,361 @@
+#include "inflate.h"
+
+#include <string.h>
+#include <stdint.h>
+
+using namespace std;
+
+namespace CMU462 {
+
+static const unsigned LENBASE[29] =  {3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258};
+static const unsigned LENEXTRA[29] = {0,0,0,0,0,0,0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4,  4,  5,  5,  5,  5,  0};
+static const unsigned DISTBASE[30] =  {1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577};
+static const unsigned DISTEXTRA[30] = {0,0,0,0,1,1,2, 2, 3, 3, 4, 4, 5, 5,  6,  6,  7,  7,  8,  8,   9,   9,  10,  10,  11,  11,  12,   12,   13,   13};
+static const unsigned CLCL[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15}; // code length code order
+
+// Number of bits resolved by the first-level table lookup. Longer codes
+// continue into a second-level table hanging off the primary entry.
+static const unsigned kPrimaryBits = 10;
+
+// Spare bytes kept past the end of the output so match copies can move
+// whole 8-byte words without checking for the tail.
+static const size_t kCopySlack = 8;
+
+// Bit Input //
+
+// Little-endian bit reader over the deflate stream with a 64-bit buffer.
+// Refilling tops the buffer up to at least 56 bits, which covers the
+// longest length/distance pair (15 + 5 + 15 + 13 bits) in one go.
+struct BitStream {
+
+  const unsigned char* p;
+  const unsigned char* end;
+  uint64_t buf;
+  unsigned count;
+  size_t pad; // zero bytes fed in after the end of the input
+
+  BitStream( const unsigned char* begin, const unsigned char* end )
+    : p ( begin ), end ( end ), buf ( 0 ), count ( 0 ), pad ( 0 ) { }
+
+  inline void refill() {
+    if (end - p >= 8) {
+      uint64_t word = 0;
+      for (int i = 7; i >= 0; i--) word = (word << 8) | p[i];
+      buf |= word << count;
+      p += (63 - count) >> 3;
+      count |= 56;
+    } else {
+      while (count <= 56) {
+        uint64_t byte = 0;
+        if (p < end) byte = *p++; else pad++;
+        buf |= byte << count;
+        count += 8;
+      }
+    }
+  }
+
+  inline unsigned peek( unsigned n ) const {
+    return (unsigned) (buf & ((1ull << n) - 1));
+  }
+
+  inline void consume( unsigned n ) {
+    buf >>= n; count -= n;
+  }
+
+  inline unsigned bits( unsigned n ) {
+    unsigned v = peek(n); consume(n); return v;
+  }
+
+  // true once decoding has used bits from past the end of the input
+  inline bool overrun() const {
+    return pad * 8 > count;
+  }
+
+  // drop the partial byte and hand unread buffered bytes back to the input
+  inline bool align_to_byte() {
+    consume(count & 7);
+    size_t bytes = count >> 3;
+    if (bytes < pad) return false;
+    p -= bytes - pad;
+    buf = 0; count = 0; pad = 0;
+    return true;
+  }
+
+}; // struct BitStream
+
+// Huffman Decoding //
+
+struct HuffmanEntry {
+  uint16_t symbol; // decoded symbol, or subtable offset when sub != 0
+  uint8_t  length; // bits consumed by this lookup, 0 marks an invalid code
+  uint8_t  sub;    // index bits of the subtable this entry points to
+};
+
+struct HuffmanTable {
+
+  unsigned primary_bits;
+  vector<HuffmanEntry> entries;
+
+  // build the lookup tables from canonical code lengths
+  int build( const unsigned char* lengths, unsigned num_symbols ) {
+
+    unsigned count[16] = {0};
+    for (unsigned i = 0; i < num_symbols; i++) count[lengths[i]]++;
+    count[0] = 0;
+
+    // reject over-subscribed code sets (incomplete ones are legal and the
+    // missing codes simply stay invalid entries)
+    int left = 1; unsigned max_len = 1;
+    for (unsigned len = 1; len <= 15; len++) {
+      left = (left << 1) - count[len];
+      if (left < 0) return 55;
+      if (count[len]) max_len = len;
+    }
+
+    // first canonical code of each length
+    unsigned next_code[16]; unsigned code = 0; next_code[0] = 0;
+    for (unsigned len = 1; len <= 15; len++) {
+      code = (code + count[len - 1]) << 1;
+      next_code[len] = code;
+    }
+
+    // deflate sends codes MSB first, so index the tables by reversed codes
+    unsigned reversed[288];
+    for (unsigned s = 0; s < num_symbols; s++) {
+      unsigned len = lengths[s];
+      if (!len) continue;
+      unsigned c = next_code[len]++, r = 0;
+      for (unsigned i = 0; i < len; i++) { r = (r << 1) | (c & 1); c >>= 1; }
+      reversed[s] = r;
+    }
+
+    primary_bits = max_len < kPrimaryBits ? max_len : kPrimaryBits;
+    unsigned primary_size = 1u << primary_bits;
+    unsigned primary_mask = primary_size - 1;
+
+    // size the subtable under each primary slot by its longest code
+    unsigned char sub_bits[1 << kPrimaryBits];
+    memset(sub_bits, 0, primary_size);
+    for (unsigned s = 0; s < num_symbols; s++) {
+      unsigned len = lengths[s];
+      if (len <= primary_bits) continue;
+      unsigned prefix = reversed[s] & primary_mask;
+      if (len - primary_bits > sub_bits[prefix]) sub_bits[prefix] = len - primary_bits;
+    }
+
+    HuffmanEntry invalid = { 0, 0, 0 };
+    entries.assign(primary_size, invalid);
+    for (unsigned i = 0; i < primary_size; i++) {
+      if (!sub_bits[i]) continue;
+      HuffmanEntry link = { (uint16_t) entries.size(), (uint8_t) primary_bits, sub_bits[i] };
+      entries[i] = link;
+      entries.resize(entries.size() + (1u << sub_bits[i]), invalid);
+    }
+
+    // replicate every code over all slots that share its prefix
+    for (unsigned s = 0; s < num_symbols; s++) {
+      unsigned len = lengths[s];
+      if (!len) continue;
+      if (len <= primary_bits) {
+        HuffmanEntry e = { (uint16_t) s, (uint8_t) len, 0 };
+        for (unsigned r = reversed[s]; r < primary_size; r += 1u << len) entries[r] = e;
+      } else {
+        const HuffmanEntry& link = entries[reversed[s] & primary_mask];
+        unsigned sub_len = len - primary_bits;
+        HuffmanEntry e = { (uint16_t) s, (uint8_t) sub_len, 0 };
+        for (unsigned r = reversed[s] >> primary_bits; r < (1u << link.sub); r += 1u << sub_len) {
+          entries[link.symbol + r] = e;
+        }
+      }
+    }
+
+    return 0;
+  }
+
+  // decode one symbol, returns -1 for a code that is not in the table
+  inline int decode( BitStream& bs ) const {
+    HuffmanEntry e = entries[bs.peek(primary_bits)];
+    if (e.sub) {
+      bs.consume(primary_bits);
+      e = entries[e.symbol + bs.peek(e.sub)];
+    }
+    if (!e.length) return -1;
+    bs.consume(e.length);
+    return e.symbol;
+  }
+
+}; // struct HuffmanTable
+
+// Inflater //
+
+struct Inflater {
+
+  vector<unsigned char>& out;
+  size_t pos;
+  BitStream bs;
+  HuffmanTable codetree, codetreeD, codelengthtree;
+
+  Inflater( vector<unsigned char>& out, const unsigned char* in, size_t size )
+    : out ( out ), pos ( 0 ), bs ( in, in + size ) { }
+
+  // make sure n more bytes (plus copy slack) fit behind pos
+  inline unsigned char* reserve( size_t n ) {
+    if (pos + n + kCopySlack > out.size()) {
+      size_t grown = out.size() * 2;
+      if (grown < pos + n + kCopySlack) grown = pos + n + kCopySlack;
+      out.resize(grown);
+    }
+    return &out[0];
+  }
+
+  int inflate() {
+    unsigned BFINAL = 0;
+    while (!BFINAL) {
+      bs.refill();
+      if (bs.overrun()) return 52; // ran past the input before the final block
+      BFINAL = bs.bits(1);
+      unsigned BTYPE = bs.bits(2);
+      int error;
+      if (BTYPE == 3) return 20; // invalid BTYPE
+      else if (BTYPE == 0) error = inflateNoCompression();
+      else if (BTYPE == 1) error = inflateFixed();
+      else error = inflateDynamic();
+      if (error) return error;
+    }
+    out.resize(pos);
+    return 0;
+  }
+
+  int inflateNoCompression() {
+    if (!bs.align_to_byte()) return 52;
+    const unsigned char* p = bs.p;
+    if (bs.end - p < 4) return 52;
+    size_t LEN = p[0] + 256 * p[1], NLEN = p[2] + 256 * p[3]; p += 4;
+    if (LEN + NLEN != 65535) return 21; // NLEN is not one's complement of LEN
+    if ((size_t) (bs.end - p) < LEN) return 23; // reading outside of in buffer
+    unsigned char* dst = reserve(LEN);
+    memcpy(dst + pos, p, LEN);
+    pos += LEN;
+    bs.p = p + LEN;
+    return 0;
+  }
+
+  int inflateFixed() {
+    unsigned char lengths[288 + 32];
+    memset(lengths +   0, 8, 144);
+    memset(lengths + 144, 9, 112);
+    memset(lengths + 256, 7,  24);
+    memset(lengths + 280, 8,   8);
+    memset(lengths + 288, 5,  32);
+    codetree.build(lengths, 288);
+    codetreeD.build(lengths + 288, 32);
+    return inflateHuffmanBlock();
+  }
+
+  int inflateDynamic() {
+    bs.refill();
+    unsigned HLIT  = bs.bits(5) + 257; // number of literal/length codes
+    unsigned HDIST = bs.bits(5) + 1;   // number of distance codes
+    unsigned HCLEN = bs.bits(4) + 4;   // number of code length codes
+
+    unsigned char codelengthcode[19] = {0};
+    for (unsigned i = 0; i < HCLEN; i++) {
+      bs.refill();
+      codelengthcode[CLCL[i]] = bs.bits(3);
+    }
+    int error = codelengthtree.build(codelengthcode, 19);
+    if (error) return error;
+
+    unsigned char lengths[288 + 32];
+    unsigned i = 0, total = HLIT + HDIST;
+    while (i < total) {
+      bs.refill();
+      int code = codelengthtree.decode(bs);
+      if (code < 0) return 16;
+      if (bs.overrun()) return 50;
+
+      if (code <= 15) { lengths[i++] = code; continue; }
+
+      unsigned value = 0, replength;
+      if (code == 16) { // repeat previous
+        if (i == 0) return 54;
+        value = lengths[i - 1];
+        replength = 3 + bs.bits(2);
+      } else if (code == 17) { // repeat "0" 3-10 times
+        replength = 3 + bs.bits(3);
+      } else { // repeat "0" 11-138 times
+        replength = 11 + bs.bits(7);
+      }
+      if (i + replength > total) return 13; // more lengths than codes
+      memset(lengths + i, value, replength);
+      i += replength;
+    }
+
+    if (lengths[256] == 0) return 64; // the end code must be present
+    error = codetree.build(lengths, HLIT); if (error) return error;
+    error = codetreeD.build(lengths + HLIT, HDIST); if (error) return error;
+    return inflateHuffmanBlock();
+  }
+
+  int inflateHuffmanBlock() {
+    unsigned char* dst = reserve(0);
+    for (;;) {
+      bs.refill();
+      int code = codetree.decode(bs);
+      if (code < 0) return 11;
+      if (bs.overrun()) return 10; // end reached without end code
+
+      if (code < 256) { // literal symbol
+        if (pos + kCopySlack >= out.size()) dst = reserve(1);
+        dst[pos++] = (unsigned char) code;
+        continue;
+      }
+      if (code == 256) return 0; // end code
+      if (code > 285) return 11;
+
+      // length code, the refill above covers all bits of the pair
+      unsigned length = LENBASE[code - 257] + bs.bits(LENEXTRA[code - 257]);
+      int codeD = codetreeD.decode(bs);
+      if (codeD < 0) return 11;
+      if (codeD > 29) return 18; // distance codes 30-31 are never used
+      size_t dist = DISTBASE[codeD] + bs.bits(DISTEXTRA[codeD]);
+      if (bs.overrun()) return 51;
+      if (dist > pos) return 52; // reference before the start of the output
+
+      if (pos + length + kCopySlack > out.size()) dst = reserve(length);
+      copyMatch(dst + pos, dist, length);
+      pos += length;
+    }
+  }
+
+  static inline void copyMatch( unsigned char* dst, size_t dist, size_t length ) {
+    const unsigned char* src = dst - dist;
+    if (dist >= 8) {
+      // 8-byte chunks never overlap their source, the last one may spill
+      // into the copy slack past the match
+      unsigned char* end = dst + length;
+      do { memcpy(dst, src, 8); dst += 8; src += 8; } while (dst < end);
+    } else if (dist == 1) {
+      memset(dst, src[0], length);
+    } else {
+      for (size_t i = 0; i < length; i++) dst[i] = src[i];
+    }
+  }
+
+}; // struct Inflater
+
+int inflate_zlib( vector<unsigned char>& out,
+                  const unsigned char* in, size_t size ) {
+
+  if (size < 2) return 53; // size of zlib data too small
+  if ((in[0] * 256 + in[1]) % 31 != 0) return 24; // FCHECK mismatch
+  unsigned CM = in[0] & 15, CINFO = (in[0] >> 4) & 15, FDICT = (in[1] >> 5) & 1;
+  if (CM != 8 || CINFO > 7) return 25; // only deflate with a 32k window
+  if (FDICT != 0) return 26; // PNG forbids a preset dictionary
+
+  // note: the adler32 checksum is skipped, same as before
+  Inflater inflater(out, in + 2, size - 2);
+  return inflater.inflate();
+}
+
+} // namespace CMU462
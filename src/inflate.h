@@ -0,0 +1,18 @@
+#ifndef CMU462_INFLATE_H
+#define CMU462_INFLATE_H
+
+#include <vector>
+#include <stddef.h>
+
+namespace CMU462 {
+
+// Decompresses a zlib stream (RFC 1950 / RFC 1951) into out. If out is
+// already sized to the expected output length no reallocation happens while
+// decoding; on success it is resized to the exact decompressed size.
+// Returns 0 on success, otherwise one of the LodePNG error codes.
+int inflate_zlib( std::vector<unsigned char>& out,
+                  const unsigned char* in, size_t size );
+
+} // namespace CMU462
+
+#endif // CMU462_INFLATE_H
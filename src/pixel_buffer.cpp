@@ -0,0 +1,169 @@
+#include "pixel_buffer.h"
+
+#include <algorithm>
+
+using namespace std;
+
+namespace CMU462 {
+
+PixelBuffer::~PixelBuffer() {
+  release();
+}
+
+void PixelBuffer::release() {
+
+  for (int i = 0; i < 2; i++) {
+    if (fence[i]) { glDeleteSync(fence[i]); fence[i] = 0; }
+  }
+  if (buffer) {
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer);
+    glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    glDeleteBuffers(1, &buffer); buffer = 0;
+  }
+  if (fbo) { glDeleteFramebuffers(1, &fbo); fbo = 0; }
+  if (texture) { glDeleteTextures(1, &texture); texture = 0; }
+  mapped = NULL;
+}
+
+void PixelBuffer::resize( size_t width, size_t height ) {
+
+  wait(0); wait(1);
+  release();
+  this->width = width;
+  this->height = height;
+  current = 0;
+  size_t size = 2 * 4 * width * height;
+
+  // presentation texture, read through a framebuffer object for blits
+  bool blit = GLEW_VERSION_3_0 || GLEW_ARB_framebuffer_object;
+  if (blit && size) {
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0,
+                 GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    glGenFramebuffers(1, &fbo);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo);
+    glFramebufferTexture2D(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                           GL_TEXTURE_2D, texture, 0);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+  }
+
+  // both frames in a persistently mapped buffer, cached client side
+  // storage as the rasterizer reads back what it blends over
+  bool persistent = GLEW_ARB_buffer_storage && GLEW_ARB_sync;
+  if (texture && persistent) {
+    GLbitfield flags = GL_MAP_READ_BIT | GL_MAP_WRITE_BIT |
+                       GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    glGenBuffers(1, &buffer);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer);
+    glBufferStorage(GL_PIXEL_UNPACK_BUFFER, size, NULL,
+                    flags | GL_CLIENT_STORAGE_BIT);
+    mapped = (unsigned char*) glMapBufferRange(GL_PIXEL_UNPACK_BUFFER,
+                                               0, size, flags);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    if (!mapped) { glDeleteBuffers(1, &buffer); buffer = 0; }
+  }
+
+  if (mapped) {
+    vector<unsigned char>().swap(client);
+    fill(mapped, mapped + size, 0);
+  } else {
+    client.assign(size, 0);
+  }
+  mark_all_dirty();
+}
+
+void PixelBuffer::show( size_t frame ) {
+  current = frame;
+}
+
+void PixelBuffer::wait( size_t frame ) {
+  if (!fence[frame]) return;
+  while (glClientWaitSync(fence[frame], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000)
+         == GL_TIMEOUT_EXPIRED) { }
+  glDeleteSync(fence[frame]);
+  fence[frame] = 0;
+}
+
+void PixelBuffer::mark_dirty( size_t y0, size_t y1 ) {
+  y1 = min(y1, height);
+  if (y0 >= y1) return;
+  if (dirty_y0 >= dirty_y1) {
+    dirty_y0 = y0; dirty_y1 = y1;
+  } else {
+    dirty_y0 = min(dirty_y0, y0); dirty_y1 = max(dirty_y1, y1);
+  }
+}
+
+void PixelBuffer::upload() {
+
+  if (dirty_y0 >= dirty_y1) return;
+  size_t offset = 4 * width * (current * height + dirty_y0);
+
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+  glBindTexture(GL_TEXTURE_2D, texture);
+  if (buffer) {
+    // the copy out of the mapped buffer runs asynchronously
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, dirty_y0, width, dirty_y1 - dirty_y0,
+                    GL_RGBA, GL_UNSIGNED_BYTE, (const GLvoid*) offset);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    if (fence[current]) glDeleteSync(fence[current]);
+    fence[current] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  } else {
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, dirty_y0, width, dirty_y1 - dirty_y0,
+                    GL_RGBA, GL_UNSIGNED_BYTE, &client[offset]);
+  }
+  glBindTexture(GL_TEXTURE_2D, 0);
+
+  dirty_y0 = dirty_y1 = 0;
+}
+
+void PixelBuffer::present() {
+
+  if (!width || !height) return;
+
+  if (fbo) {
+    upload();
+
+    // texture row 0 is the top of the frame, flip on the way out
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+    glBlitFramebuffer(0, 0, width, height, 0, height, width, 0,
+                      GL_COLOR_BUFFER_BIT, GL_NEAREST);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+    return;
+  }
+
+  // no framebuffer objects, copy the whole frame every time
+  glPushAttrib( GL_VIEWPORT_BIT );
+  glViewport(0, 0, width, height);
+
+  glMatrixMode( GL_PROJECTION );
+  glPushMatrix();
+  glLoadIdentity();
+  glOrtho( 0, width, 0, height, 0, 0 );
+
+  glMatrixMode( GL_MODELVIEW );
+  glPushMatrix();
+  glLoadIdentity();
+  glTranslatef( -1, 1, 0 );
+
+  glRasterPos2f(0, 0);
+  glPixelZoom( 1.0, -1.0 );
+  glDrawPixels( width, height, GL_RGBA, GL_UNSIGNED_BYTE, pixels(current) );
+  glPixelZoom( 1.0, 1.0 );
+
+  glPopAttrib();
+  glMatrixMode( GL_PROJECTION ); glPopMatrix();
+  glMatrixMode( GL_MODELVIEW  ); glPopMatrix();
+
+  dirty_y0 = dirty_y1 = 0;
+}
+
+} // namespace CMU462
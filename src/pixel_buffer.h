@@ -0,0 +1,90 @@
+#ifndef CMU462_PIXEL_BUFFER_H
+#define CMU462_PIXEL_BUFFER_H
+
+#include <stddef.h>
+#include <vector>
+
+#include "CMU462.h"
+
+namespace CMU462 {
+
+/**
+ * RGBA8 framebuffer the software renderer draws into, presented with
+ * OpenGL. Rows are top to bottom.
+ *
+ * Holds two frames, so one can be drawn while the other is shown. When
+ * the driver has persistent buffer mapping both live in one mapped pixel
+ * unpack buffer, so the rasterizer writes straight into memory the GPU
+ * copies from. Otherwise they are plain client memory. In both cases only
+ * rows of the shown frame marked dirty are uploaded to a texture, which is
+ * blitted to the window, and presenting an unchanged frame uploads
+ * nothing. Without framebuffer objects it falls back to glDrawPixels.
+ */
+class PixelBuffer {
+ public:
+
+  PixelBuffer( ) : width ( 0 ), height ( 0 ), mapped ( NULL ), current ( 0 ),
+                   texture ( 0 ), buffer ( 0 ), fbo ( 0 ),
+                   dirty_y0 ( 0 ), dirty_y1 ( 0 ) { fence[0] = fence[1] = 0; }
+
+  ~PixelBuffer( );
+
+  // reallocates for a new window size, needs a current GL context and
+  // invalidates pixels() and the contents of both frames
+  void resize( size_t width, size_t height );
+
+  inline size_t get_width( void ) const { return width; }
+  inline size_t get_height( void ) const { return height; }
+
+  // memory of frame 0 or 1 to draw into, 4 * width * height bytes
+  inline unsigned char* pixels( size_t frame ) {
+    unsigned char* base = mapped ? mapped : (client.empty() ? NULL : &client[0]);
+    return base ? base + frame * 4 * width * height : NULL;
+  }
+
+  // true when pixels() is mapped GPU visible memory
+  inline bool is_persistent( void ) const { return mapped != NULL; }
+
+  // frame uploaded and drawn by present(), the other one may be drawn
+  inline size_t shown( void ) const { return current; }
+  void show( size_t frame );
+
+  // blocks until the last upload has read the frame, call before drawing
+  void wait( size_t frame );
+
+  // rows [y0, y1) of the shown frame changed since the last present
+  void mark_dirty( size_t y0, size_t y1 );
+  inline void mark_all_dirty( void ) { mark_dirty(0, height); }
+
+  // uploads the dirty rows and draws the frame over the whole viewport
+  void present( void );
+
+ private:
+
+  size_t width, height;
+
+  // persistently mapped unpack buffer, or client memory without one
+  unsigned char* mapped;
+  std::vector<unsigned char> client;
+  size_t current;
+
+  // GL objects, zero when not in use, a fence per frame
+  GLuint texture;
+  GLuint buffer;
+  GLuint fbo;
+  GLsync fence[2];
+
+  // rows to upload on the next present
+  size_t dirty_y0, dirty_y1;
+
+  // frees all GL objects
+  void release( void );
+
+  // uploads the dirty rows to the texture
+  void upload( void );
+
+}; // class PixelBuffer
+
+} // namespace CMU462
+
+#endif // CMU462_PIXEL_BUFFER_H
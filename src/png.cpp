@@ -1,13 +1,162 @@
 #include "png.h"
+#include "inflate.h"
+#include "deflate.h"
 
+#include <string.h>
+#include <stdlib.h>
 #include <fstream>
 #include <sstream>
 #include <iostream>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 using namespace std;
 
 namespace CMU462 {
 
+// Scanline unfiltering //
+
+// SIMD versions of the PNG reconstruction filters for 8-bit RGB and RGBA
+// rows. Sub, Avg and Paeth depend on the pixel to the left, so they step
+// one pixel per iteration and keep the previous result in a register; Up
+// has no such dependency and runs 16 bytes at a time for any pixel size.
+
+#if defined(__SSE2__)
+
+static inline __m128i load4( const unsigned char* p ) {
+  int v; memcpy(&v, p, 4); return _mm_cvtsi32_si128(v);
+}
+
+static inline __m128i load3( const unsigned char* p ) {
+  int v = 0; memcpy(&v, p, 3); return _mm_cvtsi32_si128(v);
+}
+
+static inline void store4( unsigned char* p, __m128i v ) {
+  int t = _mm_cvtsi128_si32(v); memcpy(p, &t, 4);
+}
+
+static inline void store3( unsigned char* p, __m128i v ) {
+  int t = _mm_cvtsi128_si32(v); memcpy(p, &t, 3);
+}
+
+static inline __m128i select_si128( __m128i mask, __m128i a, __m128i b ) {
+  return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+static inline __m128i abs_epi16( __m128i x ) {
+  __m128i negative = _mm_cmplt_epi16(x, _mm_setzero_si128());
+  return _mm_sub_epi16(_mm_xor_si128(x, negative), negative);
+}
+
+// rows of 3-byte pixels are walked with 4-byte loads while a full word is
+// left in the row, the last pixel is loaded with exactly 3 bytes
+template<int BPP>
+static inline __m128i load_pixel( const unsigned char* p, size_t i, size_t length ) {
+  return (BPP == 4 || i + 4 <= length) ? load4(p + i) : load3(p + i);
+}
+
+template<int BPP>
+static inline void store_pixel( unsigned char* p, __m128i v ) {
+  if (BPP == 4) store4(p, v); else store3(p, v);
+}
+
+template<int BPP>
+static void unfilter_sub_sse2( unsigned char* recon, const unsigned char* scanline,
+                               size_t length ) {
+  __m128i d = _mm_setzero_si128();
+  for (size_t i = 0; i < length; i += BPP) {
+    d = _mm_add_epi8(load_pixel<BPP>(scanline, i, length), d);
+    store_pixel<BPP>(recon + i, d);
+  }
+}
+
+static void unfilter_up_sse2( unsigned char* recon, const unsigned char* scanline,
+                              const unsigned char* precon, size_t length ) {
+  size_t i = 0;
+  for (; i + 16 <= length; i += 16) {
+    __m128i s = _mm_loadu_si128((const __m128i*) (scanline + i));
+    __m128i b = _mm_loadu_si128((const __m128i*) (precon + i));
+    _mm_storeu_si128((__m128i*) (recon + i), _mm_add_epi8(s, b));
+  }
+  for (; i < length; i++) recon[i] = scanline[i] + precon[i];
+}
+
+template<int BPP>
+static void unfilter_avg_sse2( unsigned char* recon, const unsigned char* scanline,
+                               const unsigned char* precon, size_t length ) {
+  const __m128i one = _mm_set1_epi8(1);
+  __m128i d = _mm_setzero_si128();
+  for (size_t i = 0; i < length; i += BPP) {
+    __m128i a = d;
+    __m128i b = load_pixel<BPP>(precon, i, length);
+    // _mm_avg_epu8 rounds up, take the carry back off for odd sums
+    __m128i avg = _mm_avg_epu8(a, b);
+    avg = _mm_sub_epi8(avg, _mm_and_si128(_mm_xor_si128(a, b), one));
+    d = _mm_add_epi8(load_pixel<BPP>(scanline, i, length), avg);
+    store_pixel<BPP>(recon + i, d);
+  }
+}
+
+template<int BPP>
+static void unfilter_paeth_sse2( unsigned char* recon, const unsigned char* scanline,
+                                 const unsigned char* precon, size_t length ) {
+  // work on 16-bit lanes so the predictor distances can go negative
+  const __m128i zero = _mm_setzero_si128();
+  __m128i b = zero, d = zero;
+  for (size_t i = 0; i < length; i += BPP) {
+    __m128i c = b;
+    __m128i a = d;
+    b = _mm_unpacklo_epi8(load_pixel<BPP>(precon, i, length), zero);
+    d = _mm_unpacklo_epi8(load_pixel<BPP>(scanline, i, length), zero);
+
+    // with p = a + b - c: |p - a| = |b - c|, |p - b| = |a - c|
+    __m128i pa = _mm_sub_epi16(b, c);
+    __m128i pb = _mm_sub_epi16(a, c);
+    __m128i pc = _mm_add_epi16(pa, pb);
+    pa = abs_epi16(pa); pb = abs_epi16(pb); pc = abs_epi16(pc);
+
+    __m128i smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+    __m128i nearest = select_si128(_mm_cmpeq_epi16(smallest, pa), a,
+                      select_si128(_mm_cmpeq_epi16(smallest, pb), b, c));
+
+    // byte adds wrap within the low half of each lane, the high half stays 0
+    d = _mm_add_epi8(d, nearest);
+    store_pixel<BPP>(recon + i, _mm_packus_epi16(d, d));
+  }
+}
+
+#endif // __SSE2__
+
+// returns false if the scanline has to go through the scalar filters
+static bool unfilter_scanline_simd( unsigned char* recon, const unsigned char* scanline,
+                                    const unsigned char* precon, size_t bytewidth,
+                                    unsigned long filterType, size_t length ) {
+#if defined(__SSE2__)
+  bool rgb  = bytewidth == 3;
+  bool rgba = bytewidth == 4;
+  switch (filterType) {
+    case 1:
+      if (rgba) { unfilter_sub_sse2<4>(recon, scanline, length); return true; }
+      if (rgb)  { unfilter_sub_sse2<3>(recon, scanline, length); return true; }
+      break;
+    case 2:
+      if (precon) { unfilter_up_sse2(recon, scanline, precon, length); return true; }
+      break;
+    case 3:
+      if (precon && rgba) { unfilter_avg_sse2<4>(recon, scanline, precon, length); return true; }
+      if (precon && rgb)  { unfilter_avg_sse2<3>(recon, scanline, precon, length); return true; }
+      break;
+    case 4:
+      if (precon && rgba) { unfilter_paeth_sse2<4>(recon, scanline, precon, length); return true; }
+      if (precon && rgb)  { unfilter_paeth_sse2<3>(recon, scanline, precon, length); return true; }
+      break;
+  }
+#endif
+  return false;
+}
+
 // Parser routines //
 
 /* picoPNG version 20101224
@@ -28,204 +177,12 @@ namespace CMU462 {
  * 2. Altered source versions must be plainly marked as such, and must not be
  *    misrepresented as being the original software.
  * 3. This notice may not be removed or altered from any source distribution.
+ *
+ * Modified for drawsvg: zlib decompression is done by inflate_zlib (see
+ * inflate.cpp) and scanline unfiltering uses the SIMD filters above.
  */
 int PNGParser::load(const unsigned char *buffer, size_t size, PNG& png) {
     
-  static const unsigned long LENBASE[29] =  {3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258};
-  static const unsigned long LENEXTRA[29] = {0,0,0,0,0,0,0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4,  4,  5,  5,  5,  5,  0};
-  static const unsigned long DISTBASE[30] =  {1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577};
-  static const unsigned long DISTEXTRA[30] = {0,0,0,0,1,1,2, 2, 3, 3, 4, 4, 5, 5,  6,  6,  7,  7,  8,  8,   9,   9,  10,  10,  11,  11,  12,   12,   13,   13};
-  static const unsigned long CLCL[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15}; //code length code lengths
-  struct Zlib //nested functions for zlib decompression
-  {
-    static unsigned long readBitFromStream(size_t& bitp, const unsigned char* bits) { unsigned long result = (bits[bitp >> 3] >> (bitp & 0x7)) & 1; bitp++; return result;}
-    static unsigned long readBitsFromStream(size_t& bitp, const unsigned char* bits, size_t nbits)
-    {
-      unsigned long result = 0;
-      for(size_t i = 0; i < nbits; i++) result += (readBitFromStream(bitp, bits)) << i;
-      return result;
-    }
-    struct HuffmanTree
-    {
-      int makeFromLengths(const std::vector<unsigned long>& bitlen, unsigned long maxbitlen)
-      { //make tree given the lengths
-        unsigned long numcodes = (unsigned long)(bitlen.size()), treepos = 0, nodefilled = 0;
-        std::vector<unsigned long> tree1d(numcodes), blcount(maxbitlen + 1, 0), nextcode(maxbitlen + 1, 0);
-        for(unsigned long bits = 0; bits < numcodes; bits++) blcount[bitlen[bits]]++; //count number of instances of each code length
-        for(unsigned long bits = 1; bits <= maxbitlen; bits++) nextcode[bits] = (nextcode[bits - 1] + blcount[bits - 1]) << 1;
-        for(unsigned long n = 0; n < numcodes; n++) if(bitlen[n] != 0) tree1d[n] = nextcode[bitlen[n]]++; //generate all the codes
-        tree2d.clear(); tree2d.resize(numcodes * 2, 32767); //32767 here means the tree2d isn't filled there yet
-        for(unsigned long n = 0; n < numcodes; n++) //the codes
-        for(unsigned long i = 0; i < bitlen[n]; i++) //the bits for this code
-        {
-          unsigned long bit = (tree1d[n] >> (bitlen[n] - i - 1)) & 1;
-          if(treepos > numcodes - 2) return 55;
-          if(tree2d[2 * treepos + bit] == 32767) //not yet filled in
-          {
-            if(i + 1 == bitlen[n]) { tree2d[2 * treepos + bit] = n; treepos = 0; } //last bit
-            else { tree2d[2 * treepos + bit] = ++nodefilled + numcodes; treepos = nodefilled; } //addresses are encoded as values > numcodes
-          }
-          else treepos = tree2d[2 * treepos + bit] - numcodes; //subtract numcodes from address to get address value
-        }
-        return 0;
-      }
-      int decode(bool& decoded, unsigned long& result, size_t& treepos, unsigned long bit) const
-      { //Decodes a symbol from the tree
-        unsigned long numcodes = (unsigned long)tree2d.size() / 2;
-        if(treepos >= numcodes) return 11; //error: you appeared outside the codetree
-        result = tree2d[2 * treepos + bit];
-        decoded = (result < numcodes);
-        treepos = decoded ? 0 : result - numcodes;
-        return 0;
-      }
-      std::vector<unsigned long> tree2d; //2D representation of a huffman tree: The one dimension is "0" or "1", the other contains all nodes and leaves of the tree.
-    };
-    struct Inflator
-    {
-      int error;
-      void inflate(std::vector<unsigned char>& out, const std::vector<unsigned char>& in, size_t inpos = 0)
-      {
-        size_t bp = 0, pos = 0; //bit pointer and byte pointer
-        error = 0;
-        unsigned long BFINAL = 0;
-        while(!BFINAL && !error)
-        {
-          if(bp >> 3 >= in.size()) { error = 52; return; } //error, bit pointer will jump past memory
-          BFINAL = readBitFromStream(bp, &in[inpos]);
-          unsigned long BTYPE = readBitFromStream(bp, &in[inpos]); BTYPE += 2 * readBitFromStream(bp, &in[inpos]);
-          if(BTYPE == 3) { error = 20; return; } //error: invalid BTYPE
-          else if(BTYPE == 0) inflateNoCompression(out, &in[inpos], bp, pos, in.size());
-          else inflateHuffmanBlock(out, &in[inpos], bp, pos, in.size(), BTYPE);
-        }
-        if(!error) out.resize(pos); //Only now we know the true size of out, resize it to that
-      }
-      void generateFixedTrees(HuffmanTree& tree, HuffmanTree& treeD) //get the tree of a deflated block with fixed tree
-      {
-        std::vector<unsigned long> bitlen(288, 8), bitlenD(32, 5);;
-        for(size_t i = 144; i <= 255; i++) bitlen[i] = 9;
-        for(size_t i = 256; i <= 279; i++) bitlen[i] = 7;
-        tree.makeFromLengths(bitlen, 15);
-        treeD.makeFromLengths(bitlenD, 15);
-      }
-      HuffmanTree codetree, codetreeD, codelengthcodetree; //the code tree for Huffman codes, dist codes, and code length codes
-      unsigned long huffmanDecodeSymbol(const unsigned char* in, size_t& bp, const HuffmanTree& codetree, size_t inlength)
-      { //decode a single symbol from given list of bits with given code tree. return value is the symbol
-        bool decoded; unsigned long ct;
-        for(size_t treepos = 0;;)
-        {
-          if((bp & 0x07) == 0 && (bp >> 3) > inlength) { error = 10; return 0; } //error: end reached without endcode
-          error = codetree.decode(decoded, ct, treepos, readBitFromStream(bp, in)); if(error) return 0; //stop, an error happened
-          if(decoded) return ct;
-        }
-      }
-      void getTreeInflateDynamic(HuffmanTree& tree, HuffmanTree& treeD, const unsigned char* in, size_t& bp, size_t inlength)
-      { //get the tree of a deflated block with dynamic tree, the tree itself is also Huffman compressed with a known tree
-        std::vector<unsigned long> bitlen(288, 0), bitlenD(32, 0);
-        if(bp >> 3 >= inlength - 2) { error = 49; return; } //the bit pointer is or will go past the memory
-        size_t HLIT =  readBitsFromStream(bp, in, 5) + 257; //number of literal/length codes + 257
-        size_t HDIST = readBitsFromStream(bp, in, 5) + 1; //number of dist codes + 1
-        size_t HCLEN = readBitsFromStream(bp, in, 4) + 4; //number of code length codes + 4
-        std::vector<unsigned long> codelengthcode(19); //lengths of tree to decode the lengths of the dynamic tree
-        for(size_t i = 0; i < 19; i++) codelengthcode[CLCL[i]] = (i < HCLEN) ? readBitsFromStream(bp, in, 3) : 0;
-        error = codelengthcodetree.makeFromLengths(codelengthcode, 7); if(error) return;
-        size_t i = 0, replength;
-        while(i < HLIT + HDIST)
-        {
-          unsigned long code = huffmanDecodeSymbol(in, bp, codelengthcodetree, inlength); if(error) return;
-          if(code <= 15)  { if(i < HLIT) bitlen[i++] = code; else bitlenD[i++ - HLIT] = code; } //a length code
-          else if(code == 16) //repeat previous
-          {
-            if(bp >> 3 >= inlength) { error = 50; return; } //error, bit pointer jumps past memory
-            replength = 3 + readBitsFromStream(bp, in, 2);
-            unsigned long value; //set value to the previous code
-            if((i - 1) < HLIT) value = bitlen[i - 1];
-            else value = bitlenD[i - HLIT - 1];
-            for(size_t n = 0; n < replength; n++) //repeat this value in the next lengths
-            {
-              if(i >= HLIT + HDIST) { error = 13; return; } //error: i is larger than the amount of codes
-              if(i < HLIT) bitlen[i++] = value; else bitlenD[i++ - HLIT] = value;
-            }
-          }
-          else if(code == 17) //repeat "0" 3-10 times
-          {
-            if(bp >> 3 >= inlength) { error = 50; return; } //error, bit pointer jumps past memory
-            replength = 3 + readBitsFromStream(bp, in, 3);
-            for(size_t n = 0; n < replength; n++) //repeat this value in the next lengths
-            {
-              if(i >= HLIT + HDIST) { error = 14; return; } //error: i is larger than the amount of codes
-              if(i < HLIT) bitlen[i++] = 0; else bitlenD[i++ - HLIT] = 0;
-            }
-          }
-          else if(code == 18) //repeat "0" 11-138 times
-          {
-            if(bp >> 3 >= inlength) { error = 50; return; } //error, bit pointer jumps past memory
-            replength = 11 + readBitsFromStream(bp, in, 7);
-            for(size_t n = 0; n < replength; n++) //repeat this value in the next lengths
-            {
-              if(i >= HLIT + HDIST) { error = 15; return; } //error: i is larger than the amount of codes
-              if(i < HLIT) bitlen[i++] = 0; else bitlenD[i++ - HLIT] = 0;
-            }
-          }
-          else { error = 16; return; } //error: somehow an unexisting code appeared. This can never happen.
-        }
-        if(bitlen[256] == 0) { error = 64; return; } //the length of the end code 256 must be larger than 0
-        error = tree.makeFromLengths(bitlen, 15); if(error) return; //now we've finally got HLIT and HDIST, so generate the code trees, and the function is done
-        error = treeD.makeFromLengths(bitlenD, 15); if(error) return;
-      }
-      void inflateHuffmanBlock(std::vector<unsigned char>& out, const unsigned char* in, size_t& bp, size_t& pos, size_t inlength, unsigned long btype) 
-      {
-        if(btype == 1) { generateFixedTrees(codetree, codetreeD); }
-        else if(btype == 2) { getTreeInflateDynamic(codetree, codetreeD, in, bp, inlength); if(error) return; }
-        for(;;)
-        {
-          unsigned long code = huffmanDecodeSymbol(in, bp, codetree, inlength); if(error) return;
-          if(code == 256) return; //end code
-          else if(code <= 255) //literal symbol
-          {
-            if(pos >= out.size()) out.resize((pos + 1) * 2); //reserve more room
-            out[pos++] = (unsigned char)(code);
-          }
-          else if(code >= 257 && code <= 285) //length code
-          {
-            size_t length = LENBASE[code - 257], numextrabits = LENEXTRA[code - 257];
-            if((bp >> 3) >= inlength) { error = 51; return; } //error, bit pointer will jump past memory
-            length += readBitsFromStream(bp, in, numextrabits);
-            unsigned long codeD = huffmanDecodeSymbol(in, bp, codetreeD, inlength); if(error) return;
-            if(codeD > 29) { error = 18; return; } //error: invalid dist code (30-31 are never used)
-            unsigned long dist = DISTBASE[codeD], numextrabitsD = DISTEXTRA[codeD];
-            if((bp >> 3) >= inlength) { error = 51; return; } //error, bit pointer will jump past memory
-            dist += readBitsFromStream(bp, in, numextrabitsD);
-            size_t start = pos, back = start - dist; //backwards
-            if(pos + length >= out.size()) out.resize((pos + length) * 2); //reserve more room
-            for(size_t i = 0; i < length; i++) { out[pos++] = out[back++]; if(back >= start) back = start - dist; }
-          }
-        }
-      }
-      void inflateNoCompression(std::vector<unsigned char>& out, const unsigned char* in, size_t& bp, size_t& pos, size_t inlength)
-      {
-        while((bp & 0x7) != 0) bp++; //go to first boundary of byte
-        size_t p = bp / 8;
-        if(p >= inlength - 4) { error = 52; return; } //error, bit pointer will jump past memory
-        unsigned long LEN = in[p] + 256 * in[p + 1], NLEN = in[p + 2] + 256 * in[p + 3]; p += 4;
-        if(LEN + NLEN != 65535) { error = 21; return; } //error: NLEN is not one's complement of LEN
-        if(pos + LEN >= out.size()) out.resize(pos + LEN);
-        if(p + LEN > inlength) { error = 23; return; } //error: reading outside of in buffer
-        for(unsigned long n = 0; n < LEN; n++) out[pos++] = in[p++]; //read LEN bytes of literal data
-        bp = p * 8;
-      }
-    };
-    int decompress(std::vector<unsigned char>& out, const std::vector<unsigned char>& in) //returns error value
-    {
-      Inflator inflator;
-      if(in.size() < 2) { return 53; } //error, size of zlib data too small
-      if((in[0] * 256 + in[1]) % 31 != 0) { return 24; } //error: 256 * in[0] + in[1] must be a multiple of 31, the FCHECK value is supposed to be made that way
-      unsigned long CM = in[0] & 15, CINFO = (in[0] >> 4) & 15, FDICT = (in[1] >> 5) & 1;
-      if(CM != 8 || CINFO > 7) { return 25; } //error: only compression method 8: inflate with sliding window of 32k is supported by the PNG spec
-      if(FDICT != 0) { return 26; } //error: the specification of PNG says about the zlib stream: "The additional flags shall not specify a preset dictionary."
-      inflator.inflate(out, in, 2);
-      return inflator.error; //note: adler32 checksum was skipped and ignored
-    }
-  };
   struct PNGDecoder //nested functions for PNG decoding
   {
     struct Info
@@ -241,7 +198,8 @@ int PNGParser::load(const unsigned char *buffer, size_t size, PNG& png) {
       if(size == 0 || in == 0) { error = 48; return; } //the given data is empty
       readPngHeader(&in[0], size); if(error) return;
       size_t pos = 33; //first byte of the first chunk after the header
-      std::vector<unsigned char> idat; //the data from idat chunks
+      std::vector<unsigned char> idat; //the data from idat chunks, only gathered when there are several
+      const unsigned char* idat_first = 0; size_t idat_first_size = 0, idat_count = 0;
       bool IEND = false, known_type = true;
       info.key_defined = false;
       while(!IEND) //loop through the chunks, ignoring unknown chunks and stopping at IEND chunk. IDAT data is put at the start of the in buffer
@@ -252,7 +210,13 @@ int PNGParser::load(const unsigned char *buffer, size_t size, PNG& png) {
         if(pos + chunkLength >= size) { error = 35; return; } //error: size of the in buffer too small to contain next chunk
         if(in[pos + 0] == 'I' && in[pos + 1] == 'D' && in[pos + 2] == 'A' && in[pos + 3] == 'T') //IDAT chunk, containing compressed image data
         {
-          idat.insert(idat.end(), &in[pos + 4], &in[pos + 4 + chunkLength]);
+          if(idat_count == 0) { idat_first = &in[pos + 4]; idat_first_size = chunkLength; }
+          else
+          {
+            if(idat_count == 1) idat.assign(idat_first, idat_first + idat_first_size);
+            idat.insert(idat.end(), &in[pos + 4], &in[pos + 4 + chunkLength]);
+          }
+          idat_count++;
           pos += (4 + chunkLength);
         }
         else if(in[pos + 0] == 'I' && in[pos + 1] == 'E' && in[pos + 2] == 'N' && in[pos + 3] == 'D')  { pos += 4; IEND = true; }
@@ -300,8 +264,8 @@ int PNGParser::load(const unsigned char *buffer, size_t size, PNG& png) {
       }
       unsigned long bpp = getBpp(info);
       std::vector<unsigned char> scanlines(((info.width * (info.height * bpp + 7)) / 8) + info.height); //now the out buffer will be filled
-      Zlib zlib; //decompress with the Zlib decompressor
-      error = zlib.decompress(scanlines, idat); if(error) return; //stop if the zlib decompressor returned an error
+      if(idat_count > 1) { idat_first = idat.empty() ? 0 : &idat[0]; idat_first_size = idat.size(); } //a single IDAT is inflated in place
+      error = inflate_zlib(scanlines, idat_first, idat_first_size); if(error) return; //stop if the zlib decompressor returned an error
       size_t bytewidth = (bpp + 7) / 8, outlength = (info.height * info.width * bpp + 7) / 8;
       out.resize(outlength); //time to fill the out buffer
       unsigned char* out_ = outlength ? &out[0] : 0; //use a regular pointer to the std::vector for faster code if compiled without optimization
@@ -342,7 +306,7 @@ int PNGParser::load(const unsigned char *buffer, size_t size, PNG& png) {
       }
       if(convert_to_rgba32 && (info.colorType != 6 || info.bitDepth != 8)) //conversion needed
       {
-        std::vector<unsigned char> data = out;
+        std::vector<unsigned char> data; data.swap(out); //convert reads the decoded pixels while refilling out
         error = convert(out, &data[0], info, info.width, info.height);
       }
     }
@@ -360,6 +324,7 @@ int PNGParser::load(const unsigned char *buffer, size_t size, PNG& png) {
     }
     void unFilterScanline(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon, size_t bytewidth, unsigned long filterType, size_t length)
     {
+      if(unfilter_scanline_simd(recon, scanline, precon, bytewidth, filterType, length)) return;
       switch(filterType)
       {
         case 0: for(size_t i = 0; i < length; i++) recon[i] = scanline[i]; break;
@@ -554,10 +519,158 @@ int PNGParser::load(const char* filename, PNG& png) {
 
 }
 
-int PNGParser::save(const char *filename, const PNG& png) {
+// Encoder routines //
+
+static inline unsigned char paeth_predictor( int a, int b, int c ) {
+  int p = a + b - c;
+  int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+  return (pa <= pb && pa <= pc) ? a : pb <= pc ? b : c;
+}
+
+static inline unsigned char filter_byte( int type, int x, int a, int b, int c ) {
+  switch (type) {
+    case 1:  return x - a;
+    case 2:  return x - b;
+    case 3:  return x - ((a + b) >> 1);
+    case 4:  return x - paeth_predictor(a, b, c);
+    default: return x;
+  }
+}
+
+// filter one RGBA row, above is the previous row (all zeros for the first)
+static void filter_row( unsigned char* dst, const unsigned char* row,
+                        const unsigned char* above, size_t stride, int type ) {
+  for (size_t i = 0; i < 4; i++) {
+    dst[i] = filter_byte(type, row[i], 0, above[i], 0);
+  }
+  for (size_t i = 4; i < stride; i++) {
+    dst[i] = filter_byte(type, row[i], row[i - 4], above[i], above[i - 4]);
+  }
+}
+
+// pick the filter with the smallest sum of absolute residuals, the usual
+// heuristic from the PNG specification; all five are scored in one pass
+static int choose_filter( const unsigned char* row, const unsigned char* above,
+                          size_t stride ) {
+  size_t cost[5] = {0};
+  for (size_t i = 0; i < stride; i++) {
+    int x = row[i], b = above[i];
+    int a = i >= 4 ? row[i - 4] : 0;
+    int c = i >= 4 ? above[i - 4] : 0;
+    cost[0] += abs((signed char) x);
+    cost[1] += abs((signed char) (x - a));
+    cost[2] += abs((signed char) (x - b));
+    cost[3] += abs((signed char) (x - ((a + b) >> 1)));
+    cost[4] += abs((signed char) (x - paeth_predictor(a, b, c)));
+  }
+  int best_type = 0;
+  for (int type = 1; type < 5; type++) {
+    if (cost[type] < cost[best_type]) best_type = type;
+  }
+  return best_type;
+}
+
+int PNGParser::encode( vector<unsigned char>& out, const PNG& png,
+                       PNGCompression level ) {
+
+  if (png.width <= 0 || png.height <= 0) return -1;
+  size_t width = png.width, height = png.height;
+  size_t stride = 4 * width, line = stride + 1;
+  if (png.pixels.size() < stride * height) return -1;
+
+  // filter rows in parallel, each row only reads the unfiltered input
+  vector<unsigned char> filtered ( line * height );
+  vector<unsigned char> zeros ( stride, 0 );
+  const unsigned char* pixels = &png.pixels[0];
+
+  #pragma omp parallel for schedule(static)
+  for (int y = 0; y < (int) height; y++) {
+    const unsigned char* row = pixels + y * stride;
+    const unsigned char* above = y ? row - stride : &zeros[0];
+    int type;
+    switch (level) {
+      case PNG_STORE: type = 0; break;
+      case PNG_RLE:   type = 1; break;
+      default:        type = choose_filter(row, above, stride); break;
+    }
+    unsigned char* dst = &filtered[y * line];
+    dst[0] = type;
+    filter_row(dst + 1, row, above, stride, type);
+  }
+
+  // compress, each piece of the stream becomes its own IDAT chunk
+  static const DeflateLevel deflate_levels[] = {
+    DEFLATE_STORE, DEFLATE_RLE, DEFLATE_FAST, DEFLATE_SMALL
+  };
+  vector< vector<unsigned char> > pieces;
+  deflate_zlib(pieces, &filtered[0], filtered.size(), deflate_levels[level]);
+
+  static const unsigned char IDAT[4] = { 'I', 'D', 'A', 'T' };
+  vector<uint32_t> crcs ( pieces.size() );
+
+  #pragma omp parallel for schedule(dynamic)
+  for (int i = 0; i < (int) pieces.size(); i++) {
+    crcs[i] = crc32(crc32(0, IDAT, 4), &pieces[i][0], pieces[i].size());
+  }
+
+  // assemble the file
+  struct Writer {
+    vector<unsigned char>& out;
+    void u32( uint32_t v ) {
+      out.push_back(v >> 24); out.push_back(v >> 16);
+      out.push_back(v >> 8);  out.push_back(v);
+    }
+    void chunk( const char* type, const unsigned char* data, size_t size ) {
+      u32(size);
+      size_t start = out.size();
+      out.insert(out.end(), type, type + 4);
+      out.insert(out.end(), data, data + size);
+      u32(crc32(0, &out[start], size + 4));
+    }
+  } w = { out };
+
+  size_t total = 0;
+  for (size_t i = 0; i < pieces.size(); i++) total += pieces[i].size() + 12;
+  out.clear();
+  out.reserve(total + 64);
+
+  static const unsigned char signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+  out.insert(out.end(), signature, signature + 8);
+
+  unsigned char ihdr[13];
+  ihdr[0] = width >> 24;  ihdr[1] = width >> 16;  ihdr[2] = width >> 8;  ihdr[3] = width;
+  ihdr[4] = height >> 24; ihdr[5] = height >> 16; ihdr[6] = height >> 8; ihdr[7] = height;
+  ihdr[8]  = 8; // bit depth
+  ihdr[9]  = 6; // RGBA
+  ihdr[10] = 0; // deflate
+  ihdr[11] = 0; // adaptive filtering
+  ihdr[12] = 0; // no interlace
+  w.chunk("IHDR", ihdr, 13);
+
+  for (size_t i = 0; i < pieces.size(); i++) {
+    w.u32(pieces[i].size());
+    out.insert(out.end(), IDAT, IDAT + 4);
+    out.insert(out.end(), pieces[i].begin(), pieces[i].end());
+    w.u32(crcs[i]);
+  }
+
+  w.chunk("IEND", NULL, 0);
   return 0;
 }
 
+int PNGParser::save( const char* filename, const PNG& png,
+                     PNGCompression level ) {
+
+  vector<unsigned char> buffer;
+  int error = encode(buffer, png, level);
+  if (error) return error;
+
+  std::ofstream file(filename, std::ios::out|std::ios::binary);
+  if (!file.is_open()) return -1;
+  file.write((const char*) &buffer[0], buffer.size());
+  return file.good() ? 0 : -1;
+}
+
 
 } // namespace CMU462
 
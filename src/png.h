@@ -10,6 +10,14 @@
 
 namespace CMU462 {
 
+// Encoder effort for PNGParser::save, fastest first.
+typedef enum PNGCompression {
+  PNG_STORE, // unfiltered rows in stored deflate blocks
+  PNG_RLE,   // Sub filtered rows, runs of repeated bytes only
+  PNG_FAST,  // adaptive row filters, greedy deflate
+  PNG_SMALL  // adaptive row filters, lazy deflate over long hash chains
+} PNGCompression;
+
 struct PNG {
   int width;
   int height;
@@ -20,7 +28,12 @@ class PNGParser {
  public:
   static int load( const unsigned char* buffer, size_t size, PNG& png );
   static int load( const char* filename, PNG& png );
-  static int save( const char* filename, const PNG& png );
+  static int save( const char* filename, const PNG& png,
+                   PNGCompression level = PNG_FAST );
+
+  // encode 8-bit RGBA pixels into an in-memory PNG file
+  static int encode( std::vector<unsigned char>& out, const PNG& png,
+                     PNGCompression level = PNG_FAST );
 }; // class PNGParser
 
 } // namespace CMU462
@@ -0,0 +1,426 @@
+#include "CMU462.h"
+#include "svg.h"
+#include "png.h"
+#include "texture.h"
+#include "viewport.h"
+#include "image_diff.h"
+#include "software_renderer.h"
+
+#include <sys/stat.h>
+#include <dirent.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <algorithm>
+
+using namespace std;
+using namespace CMU462;
+
+#define msg(s) cerr << "[DrawSVG Regress] " << s << endl;
+
+/**
+ * Headless regression runner. Every SVG is rendered with both the
+ * implementation and the reference software renderer at each sample rate
+ * and sample method, and the two images are compared. Results and timings
+ * are printed and written to report.csv in the output directory, together
+ * with imp, ref and diff PNGs of every failing case. Exits non-zero if any
+ * case fails or any file cannot be loaded.
+ *
+ * Thresholds file, one test per line, '*' sets the defaults and a name
+ * followed by @rate applies to that sample rate only:
+ *
+ *   # svg        tolerance  max mismatch %  max imp/ref time
+ *   *            0          0               0
+ *   lines.svg    16         1.5             2.0
+ *   lines.svg@4  16         1.2             2.0
+ *
+ * A pixel mismatches when a color channel differs by more than the
+ * tolerance. A time ratio of 0 disables the speed check. Both images are
+ * flattened over white first, as the renderers clear to different colors.
+ */
+
+struct Threshold {
+  int tolerance;
+  double max_mismatch;   // percent of pixels
+  double max_time_ratio; // imp time / ref time, 0 to skip
+};
+
+struct Options {
+  size_t size;
+  int runs;
+  double deadline; // ms the imp gets per render, 0 for none
+  vector<size_t> rates;
+  vector<SampleMethod> methods;
+  string out_dir;
+  map<string, Threshold> thresholds;
+  vector<string> files;
+};
+
+static const char* method_name( SampleMethod method ) {
+  switch (method) {
+    case NEAREST:     return "nearest";
+    case BILINEAR:    return "bilinear";
+    case TRILINEAR:   return "trilinear";
+    case ANISOTROPIC: return "aniso";
+  }
+  return "?";
+}
+
+static void usage() {
+  msg("Usage: drawsvg_regress [options] <svg files or directories>");
+  msg("  --size N             render target width and height (512)");
+  msg("  --rates 1,2,4        sample rates (1,2)");
+  msg("  --methods a,b        nearest, bilinear, trilinear, aniso (trilinear)");
+  msg("  --runs N             timed renders per case, median kept (3)");
+  msg("  --deadline MS        fail cases the imp cannot render in time");
+  msg("  --thresholds FILE    per test thresholds");
+  msg("  --out DIR            report and failure images (regress_out)");
+}
+
+// Input //
+
+static int collect_svgs( const string& path, vector<string>& files ) {
+
+  struct stat st;
+  if (stat(path.c_str(), &st) < 0) {
+    msg("File does not exist: " << path);
+    return -1;
+  }
+
+  if (!(st.st_mode & S_IFDIR)) {
+    files.push_back(path);
+    return 0;
+  }
+
+  DIR* dir = opendir(path.c_str());
+  if (!dir) {
+    msg("Could not open directory " << path);
+    return -1;
+  }
+
+  string pathname = path;
+  if (pathname.back() != '/') pathname.push_back('/');
+
+  vector<string> found;
+  struct dirent* ent;
+  while ((ent = readdir(dir)) != NULL) {
+    string filename = ent->d_name;
+    size_t dot = filename.find_last_of(".");
+    if (dot != string::npos && filename.substr(dot + 1) == "svg") {
+      found.push_back(pathname + filename);
+    }
+  }
+  closedir(dir);
+
+  sort(found.begin(), found.end());
+  files.insert(files.end(), found.begin(), found.end());
+  return 0;
+}
+
+static int load_thresholds( const char* path, map<string, Threshold>& out ) {
+  ifstream in(path);
+  if (!in) {
+    msg("Could not open thresholds file " << path);
+    return -1;
+  }
+
+  string line;
+  while (getline(in, line)) {
+    size_t hash = line.find('#');
+    if (hash != string::npos) line.erase(hash);
+
+    stringstream ss(line);
+    string name; Threshold t = { 0, 0, 0 };
+    if (!(ss >> name)) continue;
+    if (!(ss >> t.tolerance >> t.max_mismatch)) {
+      msg("Bad thresholds line: " << line);
+      return -1;
+    }
+    ss >> t.max_time_ratio;
+    out[name] = t;
+  }
+  return 0;
+}
+
+// thresholds of a test at a sample rate
+static Threshold find_threshold( map<string, Threshold>& thresholds,
+                                 const string& name, size_t rate ) {
+  map<string, Threshold>::iterator it;
+  it = thresholds.find(name + "@" + to_string(rate));
+  if (it != thresholds.end()) return it->second;
+  it = thresholds.find(name);
+  if (it != thresholds.end()) return it->second;
+  return thresholds["*"];
+}
+
+static void split_list( const string& text, vector<string>& out ) {
+  stringstream ss(text);
+  string item;
+  while (getline(ss, item, ',')) if (!item.empty()) out.push_back(item);
+}
+
+static int parse_options( int argc, char** argv, Options& options ) {
+
+  options.size = 512;
+  options.runs = 3;
+  options.deadline = 0;
+  options.out_dir = "regress_out";
+  Threshold strict = { 0, 0, 0 };
+  options.thresholds["*"] = strict;
+
+  vector<string> rates, methods;
+  for (int i = 1; i < argc; i++) {
+    string arg = argv[i];
+    bool has_value = i + 1 < argc;
+    if (arg == "--size" && has_value) {
+      options.size = atoi(argv[++i]);
+    } else if (arg == "--runs" && has_value) {
+      options.runs = max(1, atoi(argv[++i]));
+    } else if (arg == "--deadline" && has_value) {
+      options.deadline = atof(argv[++i]);
+    } else if (arg == "--rates" && has_value) {
+      split_list(argv[++i], rates);
+    } else if (arg == "--methods" && has_value) {
+      split_list(argv[++i], methods);
+    } else if (arg == "--thresholds" && has_value) {
+      if (load_thresholds(argv[++i], options.thresholds) < 0) return -1;
+    } else if (arg == "--out" && has_value) {
+      options.out_dir = argv[++i];
+    } else if (arg.compare(0, 2, "--") == 0) {
+      msg("Unknown option " << arg);
+      return -1;
+    } else if (collect_svgs(arg, options.files) < 0) {
+      return -1;
+    }
+  }
+
+  if (rates.empty()) { rates.push_back("1"); rates.push_back("2"); }
+  for (size_t i = 0; i < rates.size(); i++) {
+    int rate = atoi(rates[i].c_str());
+    if (rate < 1) { msg("Bad sample rate " << rates[i]); return -1; }
+    options.rates.push_back(rate);
+  }
+
+  if (methods.empty()) methods.push_back("trilinear");
+  for (size_t i = 0; i < methods.size(); i++) {
+    SampleMethod method;
+    if      (methods[i] == "nearest")   method = NEAREST;
+    else if (methods[i] == "bilinear")  method = BILINEAR;
+    else if (methods[i] == "trilinear") method = TRILINEAR;
+    else if (methods[i] == "aniso")     method = ANISOTROPIC;
+    else { msg("Bad sample method " << methods[i]); return -1; }
+    options.methods.push_back(method);
+  }
+
+  if (options.size == 0 || options.files.empty()) return -1;
+  return 0;
+}
+
+// Rendering //
+
+static void collect_images( vector<SVGElement*>& elements,
+                            vector<Image*>& images ) {
+  for (size_t i = 0; i < elements.size(); ++i) {
+    SVGElement* element = elements[i];
+    if (element->type == IMAGE) {
+      images.push_back(static_cast<Image*>(element));
+    } else if (element->type == GROUP) {
+      collect_images(static_cast<Group*>(element)->elements, images);
+    }
+  }
+}
+
+// Builds mips the way DrawSVG does: tiled shared textures for the imp and
+// row order private copies for the reference.
+static void prepare_textures( SVG& svg, Sampler2D& mip_sampler ) {
+  vector<Image*> images;
+  collect_images(svg.elements, images);
+
+  // shared textures are converted once per document
+  map<const Texture*, const Texture*> converted;
+  for (size_t i = 0; i < images.size(); ++i) {
+    Image* image = images[i];
+    Texture& tex = image->texture();
+    if (!tex.mips_valid && !tex.mipmap.empty()) {
+      mip_sampler.generate_mips(tex, 0);
+      tex.mips_valid = true;
+    }
+
+    if (image->shared_tex) {
+      const Texture*& copy = converted[image->shared_tex.get()];
+      image->make_private_copy(copy ? *copy : *image->shared_tex);
+      copy = &image->tex;
+    } else {
+      set_texel_layout(tex, TEXELS_LINEAR);
+    }
+  }
+}
+
+// Renders and returns the median time in milliseconds.
+static double render( SoftwareRenderer& renderer, SVG& svg, int runs ) {
+  vector<double> times;
+  for (int i = 0; i < runs; i++) {
+    chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+    renderer.draw_svg(svg);
+    chrono::steady_clock::time_point t1 = chrono::steady_clock::now();
+    times.push_back(chrono::duration<double, milli>(t1 - t0).count());
+  }
+  sort(times.begin(), times.end());
+  return times[times.size() / 2];
+}
+
+// Composites a target over opaque white.
+static void flatten( vector<unsigned char>& pixels, bool premultiplied ) {
+  for (size_t i = 0; i < pixels.size(); i += 4) {
+    int a = pixels[i + 3];
+    for (int k = 0; k < 3; k++) {
+      int c = premultiplied ? pixels[i + k] : (pixels[i + k] * a + 127) / 255;
+      pixels[i + k] = min(255, c + 255 - a);
+    }
+    pixels[i + 3] = 255;
+  }
+}
+
+static bool save_png( const string& path, size_t size,
+                      const vector<unsigned char>& pixels ) {
+  PNG png;
+  png.width = size;
+  png.height = size;
+  png.pixels = pixels;
+  return PNGParser::save(path.c_str(), png) >= 0;
+}
+
+static string test_name( const string& path ) {
+  size_t slash = path.find_last_of('/');
+  return slash == string::npos ? path : path.substr(slash + 1);
+}
+
+int main( int argc, char** argv ) {
+
+  Options options;
+  if (parse_options(argc, argv, options) < 0) {
+    usage();
+    return 2;
+  }
+
+  size_t size = options.size;
+  vector<unsigned char> imp_pixels(4 * size * size);
+  vector<unsigned char> ref_pixels(4 * size * size);
+  vector<unsigned char> diff_pixels(4 * size * size);
+  Matrix3x3 norm_to_screen = Matrix3x3::identity();
+  norm_to_screen(0,0) = size;
+  norm_to_screen(1,1) = size;
+
+  SoftwareRendererImp imp;
+  SoftwareRendererRef ref;
+  // samplers live for the whole run, Sampler2D has no destructor body
+  Sampler2DImp& sampler_imp = *new Sampler2DImp();
+  Sampler2DRef& sampler_ref = *new Sampler2DRef();
+  sampler_imp.set_layout(TEXELS_TILED);
+  imp.set_tex_sampler(&sampler_imp);
+  ref.set_tex_sampler(&sampler_ref);
+
+  mkdir(options.out_dir.c_str(), 0755);
+  string report_path = options.out_dir + "/report.csv";
+  ofstream report(report_path.c_str());
+  report << "svg,rate,method,imp_ms,ref_ms,mismatches,max_error,"
+            "mean_error,psnr,result\n";
+
+  fprintf(stderr, "%-24s %4s %-9s %9s %9s %9s %4s %6s %7s  %s\n",
+          "svg", "rate", "method", "imp ms", "ref ms", "mismatch",
+          "max", "mean", "psnr", "result");
+
+  int failures = 0, cases = 0;
+  for (size_t f = 0; f < options.files.size(); f++) {
+
+    string name = test_name(options.files[f]);
+    SVG* svg = new SVG();
+    if (SVGParser::load(options.files[f].c_str(), svg) < 0) {
+      msg("Failed to load " << options.files[f]);
+      delete svg;
+      failures++;
+      continue;
+    }
+    prepare_textures(*svg, sampler_imp);
+
+    // same view as DrawSVG::auto_adjust, each renderer with its viewport
+    ViewportImp viewport_imp;
+    ViewportRef viewport_ref;
+    float span = 1.2 * max(svg->width, svg->height) / 2;
+    viewport_imp.set_viewbox(svg->width / 2, svg->height / 2, span);
+    viewport_ref.set_viewbox(svg->width / 2, svg->height / 2, span);
+    imp.set_canvas_to_screen(norm_to_screen * viewport_imp.get_canvas_to_norm());
+    ref.set_canvas_to_screen(norm_to_screen * viewport_ref.get_canvas_to_norm());
+
+    for (size_t r = 0; r < options.rates.size(); r++) {
+      size_t rate = options.rates[r];
+      Threshold threshold = find_threshold(options.thresholds, name, rate);
+      imp.set_render_target(&imp_pixels[0], size, size);
+      ref.set_render_target(&ref_pixels[0], size, size);
+      imp.set_sample_rate(rate);
+      ref.set_sample_rate(rate);
+
+      for (size_t m = 0; m < options.methods.size(); m++) {
+        SampleMethod method = options.methods[m];
+        sampler_imp.set_sample_method(method);
+        sampler_ref.set_sample_method(method == ANISOTROPIC ? TRILINEAR : method);
+
+        // flatten wrote over what the imp drew last
+        imp.invalidate_target();
+
+        // the imp has to finish within the deadline
+        bool late = false;
+        if (options.deadline > 0) {
+          RenderJob job;
+          job.set_timeout(options.deadline);
+          late = imp.draw_svg(*svg, job) != RENDER_COMPLETE;
+        }
+
+        double imp_ms = render(imp, *svg, options.runs);
+        double ref_ms = render(ref, *svg, options.runs);
+        flatten(imp_pixels, imp.get_fixed_point());
+        flatten(ref_pixels, false);
+
+        DiffMetrics metrics;
+        diff_images(&ref_pixels[0], &imp_pixels[0], size, size,
+                    &diff_pixels[0], metrics, threshold.tolerance);
+
+        double mismatch = 100.0 * metrics.mismatches / (size * size);
+        bool pass = mismatch <= threshold.max_mismatch;
+        bool slow = threshold.max_time_ratio > 0 &&
+                    imp_ms > threshold.max_time_ratio * ref_ms;
+        const char* result = late ? "TIMEOUT" :
+                             !pass ? "FAIL" : (slow ? "SLOW" : "ok");
+        cases++;
+
+        fprintf(stderr, "%-24s %4zu %-9s %9.2f %9.2f %8.3f%% %4d %6.2f %7.2f  %s\n",
+                name.c_str(), rate, method_name(method), imp_ms, ref_ms,
+                mismatch, metrics.max_error, metrics.mean_error,
+                metrics.psnr, result);
+        report << name << "," << rate << "," << method_name(method) << ","
+               << imp_ms << "," << ref_ms << "," << metrics.mismatches << ","
+               << metrics.max_error << "," << metrics.mean_error << ","
+               << metrics.psnr << "," << result << "\n";
+
+        if (pass && !slow && !late) continue;
+        failures++;
+        if (!pass) {
+          string base = options.out_dir + "/" + name + "_" +
+                        to_string(rate) + "x_" + method_name(method);
+          save_png(base + "_imp.png", size, imp_pixels);
+          save_png(base + "_ref.png", size, ref_pixels);
+          save_png(base + "_diff.png", size, diff_pixels);
+        }
+      }
+    }
+
+    delete svg;
+  }
+
+  msg(cases - min(cases, failures) << " of " << cases << " cases passed, "
+      << "report in " << report_path);
+  return failures ? 1 : 0;
+}
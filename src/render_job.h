@@ -0,0 +1,92 @@
+#ifndef CMU462_RENDER_JOB_H
+#define CMU462_RENDER_JOB_H
+
+#include <stddef.h>
+#include <atomic>
+#include <chrono>
+
+namespace CMU462 {
+
+/**
+ * Cancellation flag shared between a render job and whoever may want to
+ * stop it. Safe to cancel from any thread.
+ */
+class CancelToken {
+ public:
+
+  CancelToken( ) : cancelled ( false ) { }
+
+  inline void cancel( void ) { cancelled.store(true, std::memory_order_relaxed); }
+  inline void reset( void ) { cancelled.store(false, std::memory_order_relaxed); }
+  inline bool is_cancelled( void ) const {
+    return cancelled.load(std::memory_order_relaxed);
+  }
+
+ private:
+
+  std::atomic<bool> cancelled;
+
+}; // class CancelToken
+
+/**
+ * How a render job ended.
+ */
+enum RenderStatus {
+  RENDER_COMPLETE,  // everything was drawn
+  RENDER_PARTIAL,   // the deadline passed, rows the resolve did not reach
+                    // are left from the previous frame when supersampling
+  RENDER_CANCELLED  // the token was cancelled, the target is undefined
+};
+
+/**
+ * What a render job got through before it ended.
+ */
+struct RenderStats {
+
+  RenderStats( ) : elements ( 0 ), resolved_rows ( 0 ), milliseconds ( 0 ) { }
+
+  // elements started, points and group children included
+  size_t elements;
+
+  // pixel rows resolved from the sample buffer
+  size_t resolved_rows;
+
+  // wall time of the job
+  double milliseconds;
+
+};
+
+/**
+ * One draw of a document. Jobs check the token and the deadline between
+ * elements and between tiles of large primitives, so they stop within
+ * a tile's worth of work.
+ */
+struct RenderJob {
+
+  typedef std::chrono::steady_clock clock;
+
+  RenderJob( ) : token ( NULL ), has_deadline ( false ),
+                 status ( RENDER_COMPLETE ) { }
+
+  // optional, not owned
+  const CancelToken* token;
+
+  // optional time after which the job stops drawing
+  bool has_deadline;
+  clock::time_point deadline;
+
+  inline void set_timeout( double milliseconds ) {
+    has_deadline = true;
+    deadline = clock::now() + std::chrono::duration_cast<clock::duration>(
+                 std::chrono::duration<double, std::milli>(milliseconds));
+  }
+
+  // results
+  RenderStatus status;
+  RenderStats stats;
+
+};
+
+} // namespace CMU462
+
+#endif // CMU462_RENDER_JOB_H
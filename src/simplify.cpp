@@ -0,0 +1,123 @@
+#include "simplify.h"
+
+#include <math.h>
+#include <algorithm>
+
+using namespace std;
+
+namespace CMU462 {
+
+// levels are this many times finer than the one before
+static const float kLODStep = 4;
+
+// the coarsest level simplifies by the path extent over this
+static const float kLODCoarsest = 64;
+
+// no level finer than this fraction of the path's points is stored
+static const float kLODMaxKept = 0.75f;
+
+// distance from p to the segment ab
+static double segment_distance( const Vector2D& p,
+                                const Vector2D& a, const Vector2D& b ) {
+  Vector2D ab = b - a, ap = p - a;
+  double len2 = dot(ab, ab);
+  double t = len2 > 0 ? dot(ap, ab) / len2 : 0;
+  t = min(1.0, max(0.0, t));
+  return (ap - t * ab).norm();
+}
+
+void path_significance( const vector<Vector2D>& points, bool closed,
+                        vector<float>& significance ) {
+
+  size_t n = points.size();
+  significance.assign(n, 0);
+  if (n == 0) return;
+
+  struct Span { size_t i, j; float cap; };
+  vector<Span> stack;
+
+  // a closed path is split at the point farthest from the first one, and
+  // index n stands for the first point again
+  size_t last = n - 1;
+  significance[0] = INFINITY;
+  if (closed && n > 2) {
+    double far = 0;
+    for (size_t k = 1; k < n; k++) {
+      double d = (points[k] - points[0]).norm();
+      if (d > far) { far = d; last = k; }
+    }
+    Span tail = { last, n, INFINITY };
+    stack.push_back(tail);
+  }
+  significance[last] = INFINITY;
+  Span head = { 0, last, INFINITY };
+  stack.push_back(head);
+
+  // a point is as significant as its distance when it splits a span, but
+  // never more than the point that split the span it is in
+  while (!stack.empty()) {
+    Span s = stack.back(); stack.pop_back();
+    if (s.j - s.i < 2) continue;
+
+    const Vector2D& a = points[s.i];
+    const Vector2D& b = points[s.j % n];
+    size_t split = s.i + 1;
+    double far = -1;
+    for (size_t k = s.i + 1; k < s.j; k++) {
+      double d = segment_distance(points[k], a, b);
+      if (d > far) { far = d; split = k; }
+    }
+
+    float cap = min((float) far, s.cap);
+    significance[split] = cap;
+    Span left = { s.i, split, cap }, right = { split, s.j, cap };
+    stack.push_back(left);
+    stack.push_back(right);
+  }
+}
+
+void build_path_lod( const vector<Vector2D>& points, bool closed,
+                     PathLOD& lod ) {
+
+  lod = PathLOD();
+  if (points.empty()) return;
+
+  lod.min = lod.max = points[0];
+  for (size_t i = 1; i < points.size(); i++) {
+    lod.min.x = min(lod.min.x, points[i].x);
+    lod.min.y = min(lod.min.y, points[i].y);
+    lod.max.x = max(lod.max.x, points[i].x);
+    lod.max.y = max(lod.max.y, points[i].y);
+  }
+  if (points.size() < kLODMinPoints) return;
+
+  vector<float> significance;
+  path_significance(points, closed, significance);
+
+  // coarsest first, until a level would keep most of the points
+  double extent = max(lod.max.x - lod.min.x, lod.max.y - lod.min.y);
+  size_t min_points = closed ? 3 : 2;
+  size_t max_points = (size_t) (kLODMaxKept * points.size());
+  for (float tolerance = extent / kLODCoarsest;
+       tolerance > extent * 1e-6f; tolerance /= kLODStep) {
+
+    vector<Vector2D> level;
+    for (size_t i = 0; i < points.size(); i++) {
+      if (significance[i] > tolerance) level.push_back(points[i]);
+    }
+    if (level.size() > max_points) break;
+    if (level.size() < min_points) continue;
+
+    // the same points as the level before, which is then good to here
+    if (!lod.points.empty() && lod.points.back().size() == level.size()) {
+      lod.tolerance.back() = tolerance;
+      continue;
+    }
+
+    lod.tolerance.push_back(tolerance);
+    lod.points.push_back(vector<Vector2D>());
+    lod.points.back().swap(level);
+  }
+}
+
+} // namespace CMU462
@@ -0,0 +1,23 @@
+#ifndef CMU462_SIMPLIFY_H
+#define CMU462_SIMPLIFY_H
+
+#include "svg.h"
+
+namespace CMU462 {
+
+// paths with fewer points are only given bounds, not simplified levels
+const size_t kLODMinPoints = 64;
+
+// Douglas-Peucker significance of every point of a path: the largest
+// tolerance at which simplifying still keeps it. Ends (and for closed
+// paths the point farthest from the first one) are always kept.
+void path_significance( const std::vector<Vector2D>& points, bool closed,
+                        std::vector<float>& significance );
+
+// fills the bounds and simplified levels of a path
+void build_path_lod( const std::vector<Vector2D>& points, bool closed,
+                     PathLOD& lod );
+
+} // namespace CMU462
+
+#endif // CMU462_SIMPLIFY_H
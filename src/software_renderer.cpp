@@ -6,13 +6,21 @@
 #include <algorithm>
 #include <assert.h>
 #include <math.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "triangulation.h"
 #include "texture.h"
+#include "srgb.h"
 
 using namespace std;
 
+#ifndef DRAWSVG_NO_DEBUG
 #define ENABLE_DEBUG
+#endif
 #ifdef ENABLE_DEBUG
 #define DEBUG_CODE(CODEFRAGMENT) CODEFRAGMENT;
 #else
@@ -22,8 +30,370 @@ using namespace std;
 
 namespace CMU462 {
 // Implements SoftwareRenderer //
-  unsigned char* small_target;
-  int doneSampleRate = 0;
+
+// Fixed point color //
+
+// Colors are packed once per primitive to premultiplied RGBA8, r in the
+// low byte. All blending after that is integer math and bit exact.
+
+// x * a / 255, rounded
+static inline int mul_div255( int x, int a ) {
+  int t = x * a + 128;
+  return (t + (t >> 8)) >> 8;
+}
+
+static inline int to_unorm8( float f ) {
+  return f <= 0 ? 0 : (f >= 1 ? 255 : (int) (f * 255 + 0.5f));
+}
+
+static inline void store_rgba( unsigned char* dst, uint32_t rgba ) {
+  dst[0] = rgba; dst[1] = rgba >> 8; dst[2] = rgba >> 16; dst[3] = rgba >> 24;
+}
+
+// premultiplied src over premultiplied dst
+static inline void blend_over( unsigned char* dst, uint32_t src ) {
+  int a = src >> 24;
+  if (a == 0xff) {
+    dst[0] = src; dst[1] = src >> 8; dst[2] = src >> 16; dst[3] = 0xff;
+    return;
+  }
+  int inv = 0xff - a;
+  dst[0] = ((src      ) & 0xff) + mul_div255(dst[0], inv);
+  dst[1] = ((src >>  8) & 0xff) + mul_div255(dst[1], inv);
+  dst[2] = ((src >> 16) & 0xff) + mul_div255(dst[2], inv);
+  dst[3] = a + mul_div255(dst[3], inv);
+}
+
+// fills the size x size samples of one pixel
+static inline void plot_block( unsigned char* p, size_t pitch, int size,
+                               bool blend, uint32_t rgba ) {
+  for (int j = 0; j < size; j++, p += pitch) {
+    for (int i = 0; i < 4 * size; i += 4) {
+      if (blend) blend_over(p + i, rgba); else store_rgba(p + i, rgba);
+    }
+  }
+}
+
+// straight alpha src texels over premultiplied dst
+static void blend_span_over( unsigned char* dst, const unsigned char* src,
+                             size_t count ) {
+  for (size_t i = 0; i < count; i++, dst += 4, src += 4) {
+    int a = src[3];
+    if (a == 0xff) { memcpy(dst, src, 4); continue; }
+    if (a == 0) continue;
+    int inv = 0xff - a;
+    dst[0] = mul_div255(src[0], a) + mul_div255(dst[0], inv);
+    dst[1] = mul_div255(src[1], a) + mul_div255(dst[1], inv);
+    dst[2] = mul_div255(src[2], a) + mul_div255(dst[2], inv);
+    dst[3] = a + mul_div255(dst[3], inv);
+  }
+}
+
+// premultiplied RGBA8, rounded
+static uint32_t premultiply( const Color& color ) {
+  uint32_t a = to_unorm8(color.a);
+  uint32_t r = mul_div255(to_unorm8(color.r), a);
+  uint32_t g = mul_div255(to_unorm8(color.g), a);
+  uint32_t b = mul_div255(to_unorm8(color.b), a);
+  return r | (g << 8) | (b << 16) | (a << 24);
+}
+
+// straight RGBA8, rounded
+static uint32_t straight( const Color& color ) {
+  return (uint32_t) to_unorm8(color.r)       | (uint32_t) to_unorm8(color.g) << 8 |
+         (uint32_t) to_unorm8(color.b) << 16 | (uint32_t) to_unorm8(color.a) << 24;
+}
+
+// Linear light //
+
+// Supersamples are premultiplied linear RGBA16, r in the low word. Colors
+// stay packed as straight sRGB8 and are converted when they reach a sample.
+
+// x / 65535, rounded, for x up to 65535 * 65535
+static inline uint32_t div65535( uint32_t x ) {
+  x += 32768;
+  return (x + (x >> 16)) >> 16;
+}
+
+// premultiplied linear RGBA16 of straight sRGB8 r, g, b and alpha a
+static inline uint64_t to_linear( const SRGBTables& srgb,
+                                  int r, int g, int b, int a ) {
+  if (a == 0xff) {
+    return (uint64_t) srgb.decode[r] | (uint64_t) srgb.decode[g] << 16 |
+           (uint64_t) srgb.decode[b] << 32 | 0xffffull << 48;
+  }
+  uint32_t a16 = a * 257;
+  uint64_t lr = div65535(srgb.decode[r] * a16);
+  uint64_t lg = div65535(srgb.decode[g] * a16);
+  uint64_t lb = div65535(srgb.decode[b] * a16);
+  return lr | lg << 16 | lb << 32 | (uint64_t) a16 << 48;
+}
+
+static inline void store_rgba16( unsigned char* dst, uint64_t rgba ) {
+  memcpy(dst, &rgba, 8);
+}
+
+#ifdef __SSE2__
+// x * m / 65535 per 16 bit lane, rounded: (t + (t >> 16)) >> 16 with
+// t = x * m + 32768, from the high and low words of the product
+static inline __m128i mul_div65535_epu16( __m128i x, __m128i m ) {
+  const __m128i bias = _mm_set1_epi16((short) 0x8000);
+  __m128i lo = _mm_mullo_epi16(x, m), hi = _mm_mulhi_epu16(x, m);
+  __m128i t_hi = _mm_add_epi16(hi, _mm_srli_epi16(lo, 15));
+  __m128i t_lo = _mm_xor_si128(lo, bias);
+  __m128i carry = _mm_cmpgt_epi16(lo, _mm_xor_si128(_mm_add_epi16(t_lo, t_hi), bias));
+  return _mm_sub_epi16(t_hi, carry);
+}
+
+// x * m / 255 per 16 bit lane, rounded, both at most 255
+static inline __m128i mul_div255_epu16( __m128i x, __m128i m ) {
+  __m128i t = _mm_add_epi16(_mm_mullo_epi16(x, m), _mm_set1_epi16(128));
+  return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+
+// the alpha lane of each pixel in all four of its lanes
+static inline __m128i splat_alpha_epi16( __m128i x ) {
+  x = _mm_shufflelo_epi16(x, _MM_SHUFFLE(3, 3, 3, 3));
+  return _mm_shufflehi_epi16(x, _MM_SHUFFLE(3, 3, 3, 3));
+}
+#endif
+
+// premultiplied src over premultiplied dst
+static inline void blend_over16( unsigned char* p, uint64_t src ) {
+  uint32_t a = src >> 48;
+  if (a == 0xffff) { store_rgba16(p, src); return; }
+#ifdef __SSE2__
+  __m128i d = _mm_loadl_epi64((const __m128i*) p);
+  __m128i s = _mm_loadl_epi64((const __m128i*) &src);
+  d = mul_div65535_epu16(d, _mm_set1_epi16((short) (0xffff - a)));
+  _mm_storel_epi64((__m128i*) p, _mm_add_epi16(s, d));
+#else
+  uint16_t dst[4];
+  memcpy(dst, p, 8);
+  uint32_t inv = 0xffff - a;
+  dst[0] = ((src      ) & 0xffff) + div65535(dst[0] * inv);
+  dst[1] = ((src >> 16) & 0xffff) + div65535(dst[1] * inv);
+  dst[2] = ((src >> 32) & 0xffff) + div65535(dst[2] * inv);
+  dst[3] = a + div65535(dst[3] * inv);
+  memcpy(p, dst, 8);
+#endif
+}
+
+// blends the size x size samples of one pixel
+static inline void plot_block16( unsigned char* p, size_t pitch, int size,
+                                 uint64_t rgba ) {
+  for (int j = 0; j < size; j++, p += pitch) {
+    for (int i = 0; i < 8 * size; i += 8) blend_over16(p + i, rgba);
+  }
+}
+
+// straight alpha sRGB8 src texels over premultiplied linear dst
+static void blend_span_over16( unsigned char* dst, const unsigned char* src,
+                               size_t count ) {
+  const SRGBTables& srgb = SRGBTables::get();
+  for (size_t i = 0; i < count; i++, dst += 8, src += 4) {
+    if (src[3] == 0) continue;
+    blend_over16(dst, to_linear(srgb, src[0], src[1], src[2], src[3]));
+  }
+}
+
+// Linear light pixels //
+
+// At sample rate 1 there is nothing to resolve, and linear light blends
+// straight into the premultiplied sRGB8 pixels: each blend decodes the
+// pixel, blends in linear RGBA16 and encodes it again.
+
+// premultiplied linear RGBA16 to premultiplied sRGB8, as resolve does
+static inline void encode_pixel( const SRGBTables& srgb, unsigned char* dst,
+                                 uint64_t rgba ) {
+  uint32_t a = rgba >> 48;
+  if (a == 0) { memset(dst, 0, 4); return; }
+  uint32_t c[3] = { (uint32_t) (rgba & 0xffff), (uint32_t) ((rgba >> 16) & 0xffff),
+                    (uint32_t) ((rgba >> 32) & 0xffff) };
+
+  // opaque pixels need no unpremultiply
+  if (a == 0xffff) {
+    dst[0] = srgb.encode[c[0]]; dst[1] = srgb.encode[c[1]];
+    dst[2] = srgb.encode[c[2]]; dst[3] = 0xff;
+    return;
+  }
+  int a8 = div65535(a * 255);
+  if (a8 == 0) { memset(dst, 0, 4); return; }
+  float unpremultiply = 65535.f / a;
+  for (int k = 0; k < 3; k++) {
+    int u = min(0xffff, (int) (c[k] * unpremultiply + 0.5f));
+    dst[k] = mul_div255(srgb.encode[u], a8);
+  }
+  dst[3] = a8;
+}
+
+// premultiplied linear RGBA16 of a premultiplied sRGB8 pixel
+static inline uint64_t decode_pixel( const SRGBTables& srgb,
+                                     const unsigned char* p ) {
+  int a = p[3];
+  if (a == 0) return 0;
+  if (a == 0xff) return to_linear(srgb, p[0], p[1], p[2], a);
+  return to_linear(srgb, min(0xff, (p[0] * 0xff + a / 2) / a),
+                         min(0xff, (p[1] * 0xff + a / 2) / a),
+                         min(0xff, (p[2] * 0xff + a / 2) / a), a);
+}
+
+// premultiplied linear src over a premultiplied sRGB8 pixel
+static inline void blend_over_srgb8( const SRGBTables& srgb, unsigned char* p,
+                                     uint64_t src ) {
+  uint64_t d = decode_pixel(srgb, p);
+  blend_over16((unsigned char*) &d, src);
+  encode_pixel(srgb, p, d);
+}
+
+// A color packed by pack_color (straight sRGB8), and premultiplied linear
+// as rgba16, over a premultiplied sRGB8 pixel. Encoding a decoded byte
+// gives it back, so opaque colors are stored as they are.
+static inline void plot_srgb8( const SRGBTables& srgb, unsigned char* p,
+                               uint32_t rgba, uint64_t rgba16 ) {
+  if ((rgba >> 24) == 0xff) store_rgba(p, rgba);
+  else if (rgba >> 24) blend_over_srgb8(srgb, p, rgba16);
+}
+
+// straight alpha sRGB8 src texels over premultiplied sRGB8 dst
+static void blend_span_over_srgb8( unsigned char* dst, const unsigned char* src,
+                                   size_t count ) {
+  const SRGBTables& srgb = SRGBTables::get();
+  for (size_t i = 0; i < count; i++, dst += 4, src += 4) {
+    if (src[3] == 0xff) { memcpy(dst, src, 4); continue; }
+    if (src[3] == 0) continue;
+    blend_over_srgb8(srgb, dst, to_linear(srgb, src[0], src[1], src[2], src[3]));
+  }
+}
+
+void SoftwareRendererImp::convert_linear( uint32_t rgba ) {
+  linear_key = rgba;
+  linear_rgba = to_linear(SRGBTables::get(), rgba & 0xff, (rgba >> 8) & 0xff,
+                          (rgba >> 16) & 0xff, rgba >> 24);
+}
+
+// Averages the rate x rate samples of each of width pixels, whose first
+// sample row starts at row, and encodes them to premultiplied sRGB8
+static void resolve_row16( unsigned char* dst, const unsigned char* row,
+                           size_t pitch, size_t width, size_t rate ) {
+  const SRGBTables& srgb = SRGBTables::get();
+
+  // sums are divided by the sample count as a 32 bit fraction
+  size_t count = rate * rate;
+  uint64_t recip = ((1ull << 32) + count / 2) / count;
+
+  for (size_t n = 0; n < width; n++, dst += 4, row += 8 * rate) {
+    uint32_t sum[4];
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc = zero;
+    const unsigned char* src = row;
+    for (size_t y = 0; y < rate; y++, src += pitch) {
+      for (size_t x = 0; x < rate; x++) {
+        __m128i v = _mm_loadl_epi64((const __m128i*) (src + 8 * x));
+        acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(v, zero));
+      }
+    }
+    _mm_storeu_si128((__m128i*) sum, acc);
+#else
+    sum[0] = sum[1] = sum[2] = sum[3] = 0;
+    const unsigned char* src = row;
+    for (size_t y = 0; y < rate; y++, src += pitch) {
+      for (size_t x = 0; x < rate; x++) {
+        uint16_t s[4];
+        memcpy(s, src + 8 * x, 8);
+        sum[0] += s[0]; sum[1] += s[1]; sum[2] += s[2]; sum[3] += s[3];
+      }
+    }
+#endif
+
+    if (sum[3] == 0) { memset(dst, 0, 4); continue; }
+    if (count > 1) {
+      for (int k = 0; k < 4; k++) {
+        sum[k] = (sum[k] * recip + (1ull << 31)) >> 32;
+      }
+    }
+    encode_pixel(srgb, dst, (uint64_t) sum[0]       | (uint64_t) sum[1] << 16 |
+                            (uint64_t) sum[2] << 32 | (uint64_t) sum[3] << 48);
+  }
+}
+
+uint32_t SoftwareRendererImp::pack_color( const Color& color ) const {
+  if (linear) return straight(color);
+  if (fixed_point) return premultiply(color);
+
+  // float reference, straight alpha and truncated
+  return (uint32_t) (uint8_t) (color.r * 255)       |
+         (uint32_t) (uint8_t) (color.g * 255) <<  8 |
+         (uint32_t) (uint8_t) (color.b * 255) << 16 |
+         (uint32_t) (uint8_t) (color.a * 255) << 24;
+}
+
+void SoftwareRendererImp::fill_sample( int sx, int sy, uint32_t rgba ) {
+  unsigned char* p = &render_target[sample_bytes * (sx + sy * target_w)];
+  touch_rows(sy, sy + 1);
+  if (linear) {
+    if (supersample) blend_over16(p, linear_color(rgba));
+    else plot_srgb8(SRGBTables::get(), p, rgba, linear_color(rgba));
+    return;
+  }
+
+  // float reference - NOT doing alpha blending!
+  if (fixed_point) blend_over(p, rgba); else store_rgba(p, rgba);
+}
+
+void SoftwareRendererImp::fill_pixel( int x, int y, uint32_t rgba ) {
+  int sx = x, sy = y;
+  if (supersample) {
+    sx *= sample_rate;
+    sy *= sample_rate;
+  }
+
+  // check bounds
+  if ( sx < 0 || sx >= target_w ) return;
+  if ( sy < 0 || sy >= target_h ) return;
+
+  // Super sampling, draw sample_rate^2 points, instead of just 1
+  if (supersample) {
+    for (int i = sy; i < sy + sample_rate; i++) {
+      for (int j = sx; j < sx + sample_rate; j++) {
+        fill_sample(j, i, rgba);
+      }
+    }
+  } else {
+    fill_sample(sx, sy, rgba);
+  }
+}
+
+RenderStatus SoftwareRendererImp::draw_svg( SVG& svg, RenderJob& job ) {
+
+  RenderJob::clock::time_point start = RenderJob::clock::now();
+  job.status = RENDER_COMPLETE;
+  job.stats = RenderStats();
+
+  this->job = &job;
+  draw_svg(svg);
+  this->job = NULL;
+
+  job.stats.milliseconds = chrono::duration<double, milli>(
+                             RenderJob::clock::now() - start).count();
+  return job.status;
+}
+
+bool SoftwareRendererImp::resolve_row( size_t m ) {
+  if (((m - dirty_y0) & 31) == 31 && job_stopped()) return false;
+  job->stats.resolved_rows++;
+  return true;
+}
+
+bool SoftwareRendererImp::poll_job() {
+  if (job->token && job->token->is_cancelled()) {
+    job->status = RENDER_CANCELLED;
+  } else if (job->has_deadline && RenderJob::clock::now() >= job->deadline) {
+    job->status = RENDER_PARTIAL;
+  }
+  return job->status != RENDER_COMPLETE;
+}
 
 void SoftwareRendererImp::draw_svg( SVG& svg ) {
   
@@ -34,24 +404,46 @@ void SoftwareRendererImp::draw_svg( SVG& svg ) {
   transformation = canvas_to_screen;
 
   // draw all elements
-  for ( size_t i = 0; i < svg.elements.size(); ++i ) {
-    draw_element(svg.elements[i]);
+  draw_elements(svg.elements);
+
+  // a cancelled frame is left as is, and the next one starts over
+  if (job_cancelled()) {
+    job->status = RENDER_CANCELLED;
+    target_valid = false;
+    return;
   }
 
   // draw canvas outline
-  Vector2D a = transform(Vector2D(    0    ,     0    )); a.x--; a.y++;
-  Vector2D b = transform(Vector2D(svg.width,     0    )); b.x++; b.y++;
-  Vector2D c = transform(Vector2D(    0    ,svg.height)); c.x--; c.y--;
-  Vector2D d = transform(Vector2D(svg.width,svg.height)); d.x++; d.y--;
+  if (canvas_outline) {
+    Vec2f a = transform_point(Vector2D(    0    ,     0    )); a.x--; a.y++;
+    Vec2f b = transform_point(Vector2D(svg.width,     0    )); b.x++; b.y++;
+    Vec2f c = transform_point(Vector2D(    0    ,svg.height)); c.x--; c.y--;
+    Vec2f d = transform_point(Vector2D(svg.width,svg.height)); d.x++; d.y--;
+
+    rasterize_line(a.x, a.y, b.x, b.y, Color::Black);
+    rasterize_line(a.x, a.y, c.x, c.y, Color::Black);
+    rasterize_line(d.x, d.y, b.x, b.y, Color::Black);
+    rasterize_line(d.x, d.y, c.x, c.y, Color::Black);
+  }
 
-  rasterize_line(a.x, a.y, b.x, b.y, Color::Black);
-  rasterize_line(a.x, a.y, c.x, c.y, Color::Black);
-  rasterize_line(d.x, d.y, b.x, b.y, Color::Black);
-  rasterize_line(d.x, d.y, c.x, c.y, Color::Black);
+  // pixel rows cleared or drawn this frame, the only ones that changed
+  int size = supersample ? sample_rate : 1;
+  int y0 = min(cleared_y0, rows_y0), y1 = max(cleared_y1, rows_y1);
+  if (cleared_y0 >= cleared_y1) { y0 = rows_y0; y1 = rows_y1; }
+  if (y0 < y1) {
+    dirty_y0 = y0 / size;
+    dirty_y1 = (y1 + size - 1) / size;
+  } else {
+    dirty_y0 = dirty_y1 = 0;
+  }
 
   // resolve and send to render target
   // After finishing painting all elements
   resolve();
+
+  // an unfinished resolve leaves stale pixel rows
+  drawn_y0 = rows_y0; drawn_y1 = rows_y1;
+  target_valid = !job || job->status == RENDER_COMPLETE;
 }
 
 void SoftwareRendererImp::set_sample_rate( size_t sample_rate ) {
@@ -60,25 +452,7 @@ void SoftwareRendererImp::set_sample_rate( size_t sample_rate ) {
   // Task 3: 
   // You may want to modify this for supersampling support
   this->sample_rate = sample_rate;
-
-  printf("target_w=%lu target_h=%lu, \n", target_w, target_h);
-  if (sample_rate > 1) {
-    doneSampleRate = 1;
-    size_t big_w = target_w * sample_rate;
-    size_t big_h = target_h * sample_rate;
-    small_target = render_target;
-
-    printf("small_w=%lu small_h=%lu, \n", target_w, target_h);
-  
-    // Malloc big buffer
-    unsigned char* supersample_target = (unsigned char*)malloc(sizeof(char) *\
-                                        4 * big_w * big_h);
-    this->render_target = supersample_target;
-    this->target_w = big_w;
-    this->target_h = big_h;
-  } else {
-    doneSampleRate = 0;
-  }
+  bind_sample_buffer();
 }
 
 void SoftwareRendererImp::set_render_target( unsigned char* render_target,
@@ -87,9 +461,74 @@ void SoftwareRendererImp::set_render_target( unsigned char* render_target,
   // You may want to modify this for supersampling support
   DEBUG_CODE(printf("set_render_target\n"));
 
-  this->render_target = render_target;
-  this->target_w = width;
-  this->target_h = height;
+  this->pixel_target = render_target;
+  this->pixel_w = width;
+  this->pixel_h = height;
+  bind_sample_buffer();
+}
+
+void SoftwareRendererImp::bind_sample_buffer() {
+
+  // linear light supersamples into RGBA16 samples, and at rate 1 blends
+  // into the pixels through the sRGB tables
+  linear = linear_light && fixed_point;
+  supersample = sample_rate > 1;
+  sample_bytes = linear && supersample ? 8 : 4;
+  if (supersample) {
+    target_w = pixel_w * sample_rate;
+    target_h = pixel_h * sample_rate;
+
+    // the sample buffer only grows, resolve never frees it
+    if (linear) {
+      linear_buffer.resize(4 * target_w * target_h);
+      render_target = linear_buffer.empty() ? NULL :
+                      (unsigned char*) &linear_buffer[0];
+    } else {
+      sample_buffer.resize(4 * target_w * target_h);
+      render_target = sample_buffer.empty() ? NULL : &sample_buffer[0];
+    }
+  } else {
+    target_w = pixel_w;
+    target_h = pixel_h;
+    render_target = pixel_target;
+  }
+  target_valid = false;
+}
+
+void SoftwareRendererImp::transform_points( const Vector2D* points,
+                                            size_t count,
+                                            Vec2f* out ) const {
+
+  // SVG transformations are always affine, projective ones need the divide
+  if (Affine2f::is_affine(transformation)) {
+    CMU462::transform_points(Affine2f(transformation), points, count, out);
+    return;
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    Vector3D u = transformation * Vector3D(points[i].x, points[i].y, 1.0);
+    out[i] = Vec2f(u.x / u.z, u.y / u.z);
+  }
+}
+
+void SoftwareRendererImp::draw_elements( vector<SVGElement*>& elements ) {
+  size_t n = elements.size();
+  for ( size_t i = 0; i < n; ) {
+    if ( job_stopped() ) return;
+
+    if ( elements[i]->type != POINT ) {
+      draw_element(elements[i++]);
+      if ( job ) job->stats.elements++;
+      continue;
+    }
+
+    // scatter plots are long runs of points
+    size_t j = i + 1;
+    while ( j < n && elements[j]->type == POINT ) j++;
+    draw_points(&elements[i], j - i);
+    if ( job ) job->stats.elements += j - i;
+    i = j;
+  }
 }
 
 void SoftwareRendererImp::draw_element( SVGElement* element ) {
@@ -98,6 +537,7 @@ void SoftwareRendererImp::draw_element( SVGElement* element ) {
   // Task 4 (part 1):
   // Modify this to implement the transformation stack
 
+  Matrix3x3 parent = transformation;
   transformation= transformation * element->transform;
 
   switch(element->type) {
@@ -129,7 +569,8 @@ void SoftwareRendererImp::draw_element( SVGElement* element ) {
       break;
   }
 
-  transformation= transformation * element->transform.inv();
+  // restore instead of multiplying by the inverse
+  transformation = parent;
 }
 
 
@@ -138,30 +579,200 @@ void SoftwareRendererImp::draw_element( SVGElement* element ) {
 void SoftwareRendererImp::draw_point( Point& point ) {
   // DEBUG_CODE(printf("draw_point\n"));
 
-  Vector2D p = transform(point.position);
+  Vec2f p = transform_point(point.position);
   rasterize_point( p.x, p.y, point.style.fillColor );
 
 }
 
+static inline bool is_identity( const Matrix3x3& m ) {
+  return m(0,0) == 1 && m(0,1) == 0 && m(0,2) == 0 &&
+         m(1,0) == 0 && m(1,1) == 1 && m(1,2) == 0 &&
+         m(2,0) == 0 && m(2,1) == 0 && m(2,2) == 1;
+}
+
+// fills the size x size samples of one pixel with an opaque color
+static inline void splat_block( unsigned char* p, size_t pitch, int size,
+                                uint32_t rgba ) {
+#ifdef __SSE2__
+  __m128i v = _mm_set1_epi32((int) rgba);
+  for (int j = 0; j < size; j++, p += pitch) {
+    int i = 0;
+    for (; i + 4 <= size; i += 4) _mm_storeu_si128((__m128i*) (p + 4 * i), v);
+    for (; i + 2 <= size; i += 2) _mm_storel_epi64((__m128i*) (p + 4 * i), v);
+    if (i < size) store_rgba(p + 4 * i, rgba);
+  }
+#else
+  for (int j = 0; j < size; j++, p += pitch) {
+    for (int i = 0; i < size; i++) store_rgba(p + 4 * i, rgba);
+  }
+#endif
+}
+
+// the same for linear RGBA16 samples
+static inline void splat_block16( unsigned char* p, size_t pitch, int size,
+                                  uint64_t rgba ) {
+#ifdef __SSE2__
+  __m128i v = _mm_set1_epi64x((long long) rgba);
+  for (int j = 0; j < size; j++, p += pitch) {
+    int i = 0;
+    for (; i + 2 <= size; i += 2) _mm_storeu_si128((__m128i*) (p + 8 * i), v);
+    if (i < size) store_rgba16(p + 8 * i, rgba);
+  }
+#else
+  for (int j = 0; j < size; j++, p += pitch) {
+    for (int i = 0; i < size; i++) store_rgba16(p + 8 * i, rgba);
+  }
+#endif
+}
+
+void SoftwareRendererImp::draw_points( SVGElement* const* points,
+                                       size_t count ) {
+
+  if (!Affine2f::is_affine(transformation)) {
+    for (size_t i = 0; i < count; i++) draw_element(points[i]);
+    return;
+  }
+
+  // transform, round and cull into the point arrays
+  int size = supersample ? sample_rate : 1;
+  size_t pitch = sample_bytes * target_w;
+  int tiles_x = (pixel_w + 31) / 32;
+  Affine2f parent(transformation);
+
+  point_offset.resize(count);
+  point_rgba.resize(count);
+  point_tile.resize(count);
+  size_t n = 0;
+  for (size_t i = 0; i < count; i++) {
+    if ((i & 4095) == 4095 && job_stopped()) return;
+    const Point& point = static_cast<const Point&>(*points[i]);
+    uint32_t rgba = pack_color(point.style.fillColor);
+    if (fixed_point && !(rgba >> 24)) continue;
+
+    Vec2f q = Vec2f(point.position);
+    if (is_identity(point.transform)) {
+      q = parent * q;
+    } else {
+      q = Affine2f(transformation * point.transform) * q;
+    }
+
+    // halves round up everywhere, so that shifting the view by whole
+    // pixels shifts the points by as much
+    int x = (int) floorf(q.x + 0.5f), y = (int) floorf(q.y + 0.5f);
+    if (x < 0 || x >= (int) pixel_w || y < 0 || y >= (int) pixel_h) continue;
+    touch_rows(y * size, (y + 1) * size);
+
+    point_offset[n] = y * size * pitch + sample_bytes * x * size;
+    point_rgba[n] = rgba;
+    point_tile[n] = (y >> 5) * tiles_x + (x >> 5);
+    n++;
+  }
+
+  // Large batches into targets that do not fit in cache are binned by
+  // 32x32 pixel tile so that splats stay in cache. The counting sort is
+  // stable and points in different tiles never overlap, so the painter's
+  // order is kept.
+  bool binned = n >= (1 << 14) && pitch * target_h > (8u << 20);
+  if (binned) {
+    size_t tiles = tiles_x * ((pixel_h + 31) / 32);
+    tile_start.assign(tiles + 1, 0);
+    for (size_t i = 0; i < n; i++) tile_start[point_tile[i] + 1]++;
+    for (size_t t = 0; t < tiles; t++) tile_start[t + 1] += tile_start[t];
+    point_order.resize(n);
+    for (size_t i = 0; i < n; i++) point_order[tile_start[point_tile[i]]++] = i;
+  }
+
+  // splat
+  const SRGBTables& srgb = SRGBTables::get();
+  for (size_t k = 0; k < n; k++) {
+    if ((k & 4095) == 4095 && job_stopped()) return;
+    size_t i = binned ? point_order[k] : k;
+    uint32_t rgba = point_rgba[i];
+    unsigned char* p = render_target + point_offset[i];
+    if (linear && !supersample) {
+      plot_srgb8(srgb, p, rgba, linear_color(rgba));
+    } else if (linear) {
+      if ((rgba >> 24) == 0xff) {
+        splat_block16(p, pitch, size, linear_color(rgba));
+      } else {
+        plot_block16(p, pitch, size, linear_color(rgba));
+      }
+    } else if (!fixed_point || (rgba >> 24) == 0xff) {
+      splat_block(p, pitch, size, rgba);
+    } else {
+      plot_block(p, pitch, size, true, rgba);
+    }
+  }
+}
+
 void SoftwareRendererImp::draw_line( Line& line ) { 
   DEBUG_CODE(printf("draw_line\n"));
 
-  Vector2D p0 = transform(line.from);
-  Vector2D p1 = transform(line.to);
+  Vec2f p0 = transform_point(line.from);
+  Vec2f p1 = transform_point(line.to);
   rasterize_line( p0.x, p0.y, p1.x, p1.y, line.style.strokeColor );
 
 }
 
+// the largest deviation from a path its level of detail may add, in pixels
+static const float kLODPixels = 0.5f;
+
+const vector<Vector2D>* SoftwareRendererImp::path_points(
+    const vector<Vector2D>& points, const PathLOD& lod, const Color& stroke ) {
+
+  if (!(lod.min.x <= lod.max.x) || !Affine2f::is_affine(transformation)) {
+    return &points;
+  }
+
+  // screen bounds
+  Vector2D corners[4] = { lod.min, Vector2D(lod.max.x, lod.min.y),
+                          Vector2D(lod.min.x, lod.max.y), lod.max };
+  Vec2f p[4];
+  transform_points(corners, 4, p);
+  float x0 = min(min(p[0].x, p[1].x), min(p[2].x, p[3].x));
+  float x1 = max(max(p[0].x, p[1].x), max(p[2].x, p[3].x));
+  float y0 = min(min(p[0].y, p[1].y), min(p[2].y, p[3].y));
+  float y1 = max(max(p[0].y, p[1].y), max(p[2].y, p[3].y));
+
+  // strokes reach a pixel or two past the points
+  if (x1 < -2 || y1 < -2 || x0 > pixel_w + 2 || y0 > pixel_h + 2) return NULL;
+
+  // a stroke that small is a single pixel anyway, a fill covers next to
+  // no samples
+  if (x1 - x0 < 1 && y1 - y0 < 1) {
+    if (stroke.a != 0) rasterize_point(0.5f * (x0 + x1), 0.5f * (y0 + y1), stroke);
+    return NULL;
+  }
+
+  // a canvas unit is at most this many pixels long on screen
+  const Matrix3x3& m = transformation;
+  double scale = sqrt(m(0,0) * m(0,0) + m(0,1) * m(0,1) +
+                      m(1,0) * m(1,0) + m(1,1) * m(1,1));
+  double tolerance = kLODPixels / scale;
+  for (size_t k = 0; k < lod.tolerance.size(); k++) {
+    if (lod.tolerance[k] <= tolerance) return &lod.points[k];
+  }
+  return &points;
+}
+
 void SoftwareRendererImp::draw_polyline( Polyline& polyline ) {
   DEBUG_CODE(printf("draw_polyline\n"));
 
   Color c = polyline.style.strokeColor;
 
   if( c.a != 0 ) {
-    int nPoints = polyline.points.size();
+    const vector<Vector2D>* points =
+      path_points(polyline.points, polyline.lod, c);
+    if ( !points ) return;
+
+    int nPoints = points->size();
+    if ( nPoints < 2 ) return;
+
+    vertex_scratch.resize(nPoints);
+    transform_points(&(*points)[0], nPoints, &vertex_scratch[0]);
     for( int i = 0; i < nPoints - 1; i++ ) {
-      Vector2D p0 = transform(polyline.points[(i+0) % nPoints]);
-      Vector2D p1 = transform(polyline.points[(i+1) % nPoints]);
+      const Vec2f& p0 = vertex_scratch[i];
+      const Vec2f& p1 = vertex_scratch[i + 1];
       rasterize_line( p0.x, p0.y, p1.x, p1.y, c );
     }
   }
@@ -178,10 +789,12 @@ void SoftwareRendererImp::draw_rect( Rect& rect ) {
   float w = rect.dimension.x;
   float h = rect.dimension.y;
 
-  Vector2D p0 = transform(Vector2D(   x   ,   y   ));
-  Vector2D p1 = transform(Vector2D( x + w ,   y   ));
-  Vector2D p2 = transform(Vector2D(   x   , y + h ));
-  Vector2D p3 = transform(Vector2D( x + w , y + h ));
+  Vector2D corners[4] = { Vector2D(   x   ,   y   ), Vector2D( x + w ,   y   ),
+                          Vector2D(   x   , y + h ), Vector2D( x + w , y + h ) };
+  Vec2f p[4];
+  transform_points(corners, 4, p);
+  const Vec2f& p0 = p[0]; const Vec2f& p1 = p[1];
+  const Vec2f& p2 = p[2]; const Vec2f& p3 = p[3];
   
   // draw fill
   c = rect.style.fillColor;
@@ -206,19 +819,28 @@ void SoftwareRendererImp::draw_polygon( Polygon& polygon ) {
 
   Color c;
 
+  const vector<Vector2D>* points =
+    path_points(polygon.points, polygon.lod, polygon.style.strokeColor);
+  if( !points ) return;
+
   // draw fill
   c = polygon.style.fillColor;
   if( c.a != 0 ) {
 
-    // triangulate
-    vector<Vector2D> triangles;
-    triangulate( polygon, triangles );
+    // triangulate into the scratch lists
+    triangle_scratch.clear();
+    triangulate( *points, triangle_scratch );
+    size_t nVertices = triangle_scratch.size();
+    vertex_scratch.resize(nVertices);
+    if ( nVertices ) {
+      transform_points(&triangle_scratch[0], nVertices, &vertex_scratch[0]);
+    }
 
     // draw as triangles
-    for (size_t i = 0; i < triangles.size(); i += 3) {
-      Vector2D p0 = transform(triangles[i + 0]);
-      Vector2D p1 = transform(triangles[i + 1]);
-      Vector2D p2 = transform(triangles[i + 2]);
+    for (size_t i = 0; i + 2 < nVertices; i += 3) {
+      const Vec2f& p0 = vertex_scratch[i + 0];
+      const Vec2f& p1 = vertex_scratch[i + 1];
+      const Vec2f& p2 = vertex_scratch[i + 2];
       rasterize_triangle( p0.x, p0.y, p1.x, p1.y, p2.x, p2.y, c );
     }
   }
@@ -226,10 +848,14 @@ void SoftwareRendererImp::draw_polygon( Polygon& polygon ) {
   // draw outline
   c = polygon.style.strokeColor;
   if( c.a != 0 ) {
-    int nPoints = polygon.points.size();
+    int nPoints = points->size();
+    if ( nPoints == 0 ) return;
+
+    vertex_scratch.resize(nPoints);
+    transform_points(&(*points)[0], nPoints, &vertex_scratch[0]);
     for( int i = 0; i < nPoints; i++ ) {
-      Vector2D p0 = transform(polygon.points[(i+0) % nPoints]);
-      Vector2D p1 = transform(polygon.points[(i+1) % nPoints]);
+      const Vec2f& p0 = vertex_scratch[(i+0) % nPoints];
+      const Vec2f& p1 = vertex_scratch[(i+1) % nPoints];
       rasterize_line( p0.x, p0.y, p1.x, p1.y, c );
     }
   }
@@ -243,18 +869,201 @@ void SoftwareRendererImp::draw_ellipse( Ellipse& ellipse ) {
 
 void SoftwareRendererImp::draw_image( Image& image ) {
   DEBUG_CODE(printf("draw_image\n"));
-  Vector2D p0 = transform(image.position);
-  Vector2D p1 = transform(image.position + image.dimension);
+  Vec2f p0 = transform_point(image.position);
+  Vec2f p1 = transform_point(image.position + image.dimension);
+
+  rasterize_image( p0.x, p0.y, p1.x, p1.y, image.texture() );
+}
+
+// Layers //
+
+// premultiplied RGBA8 src scaled by opacity over premultiplied dst
+static void composite_row( unsigned char* dst, const unsigned char* src,
+                           size_t count, int opacity ) {
+  size_t i = 0;
+
+#ifdef __SSE2__
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i full = _mm_set1_epi16(0xff);
+  const __m128i op = _mm_set1_epi16((short) opacity);
+  for (; i + 4 <= count; i += 4) {
+    __m128i s = _mm_loadu_si128((const __m128i*) (src + 4 * i));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(s, zero)) == 0xffff) continue;
+    __m128i d = _mm_loadu_si128((const __m128i*) (dst + 4 * i));
+    __m128i out[2];
+    for (int half = 0; half < 2; half++) {
+      __m128i sh = half ? _mm_unpackhi_epi8(s, zero) : _mm_unpacklo_epi8(s, zero);
+      __m128i dh = half ? _mm_unpackhi_epi8(d, zero) : _mm_unpacklo_epi8(d, zero);
+      sh = mul_div255_epu16(sh, op);
+      dh = mul_div255_epu16(dh, _mm_sub_epi16(full, splat_alpha_epi16(sh)));
+      out[half] = _mm_add_epi16(sh, dh);
+    }
+    _mm_storeu_si128((__m128i*) (dst + 4 * i), _mm_packus_epi16(out[0], out[1]));
+  }
+#endif
+
+  for (; i < count; i++) {
+    const unsigned char* s = src + 4 * i;
+    unsigned char* d = dst + 4 * i;
+    if (s[3] == 0) continue;
+    int a = mul_div255(s[3], opacity), inv = 0xff - a;
+    d[0] = mul_div255(s[0], opacity) + mul_div255(d[0], inv);
+    d[1] = mul_div255(s[1], opacity) + mul_div255(d[1], inv);
+    d[2] = mul_div255(s[2], opacity) + mul_div255(d[2], inv);
+    d[3] = a + mul_div255(d[3], inv);
+  }
+}
+
+// the same for premultiplied linear RGBA16, opacity out of 65535
+static void composite_row16( unsigned char* dst, const unsigned char* src,
+                             size_t count, uint32_t opacity ) {
+  size_t i = 0;
+
+#ifdef __SSE2__
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i full = _mm_set1_epi16((short) 0xffff);
+  const __m128i op = _mm_set1_epi16((short) opacity);
+  for (; i + 2 <= count; i += 2) {
+    __m128i s = _mm_loadu_si128((const __m128i*) (src + 8 * i));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(s, zero)) == 0xffff) continue;
+    __m128i d = _mm_loadu_si128((const __m128i*) (dst + 8 * i));
+    s = mul_div65535_epu16(s, op);
+    d = mul_div65535_epu16(d, _mm_xor_si128(splat_alpha_epi16(s), full));
+    _mm_storeu_si128((__m128i*) (dst + 8 * i), _mm_add_epi16(s, d));
+  }
+#endif
+
+  for (; i < count; i++) {
+    uint16_t s[4];
+    memcpy(s, src + 8 * i, 8);
+    if (s[3] == 0) continue;
+    uint64_t rgba = 0;
+    for (int k = 0; k < 4; k++) {
+      rgba |= (uint64_t) div65535(s[k] * opacity) << (16 * k);
+    }
+    blend_over16(dst + 8 * i, rgba);
+  }
+}
 
-  rasterize_image( p0.x, p0.y, p1.x, p1.y, image.tex );
+// the same for premultiplied sRGB8 blended in linear light
+static void composite_row_srgb8( unsigned char* dst, const unsigned char* src,
+                                 size_t count, uint32_t opacity ) {
+  const SRGBTables& srgb = SRGBTables::get();
+  for (size_t i = 0; i < count; i++, dst += 4, src += 4) {
+    if (src[3] == 0) continue;
+    uint64_t s = decode_pixel(srgb, src), rgba = 0;
+    for (int k = 0; k < 4; k++) {
+      rgba |= (uint64_t) div65535(((s >> (16 * k)) & 0xffff) * opacity) << (16 * k);
+    }
+    blend_over_srgb8(srgb, dst, rgba);
+  }
+}
+
+// float reference, straight alpha and not blended: drawn texels of the
+// layer replace the target with their alpha scaled
+static void composite_row_straight( unsigned char* dst,
+                                    const unsigned char* src,
+                                    size_t count, int opacity ) {
+  for (size_t i = 0; i < count; i++, dst += 4, src += 4) {
+    if (src[3] == 0) continue;
+    dst[0] = src[0]; dst[1] = src[1]; dst[2] = src[2];
+    dst[3] = mul_div255(src[3], opacity);
+  }
+}
+
+void SoftwareRendererImp::composite_layer( unsigned char* layer, size_t w,
+                                           size_t y0, size_t y1,
+                                           size_t x, size_t y,
+                                           float opacity ) {
+  size_t pitch = sample_bytes * w;
+  int opacity8 = to_unorm8(opacity);
+  uint32_t opacity16 = (uint32_t) (opacity * 0xffff + 0.5f);
+  for (size_t j = y0; j < y1; j++) {
+    unsigned char* src = layer + j * pitch;
+    unsigned char* dst = render_target + sample_bytes * ((y + j) * target_w + x);
+    if (linear && !supersample) {
+      composite_row_srgb8(dst, src, w, opacity16);
+    } else if (linear) {
+      composite_row16(dst, src, w, opacity16);
+    } else if (fixed_point) {
+      composite_row(dst, src, w, opacity8);
+    } else {
+      composite_row_straight(dst, src, w, opacity8);
+    }
+    memset(src, 0, pitch);
+  }
 }
 
 void SoftwareRendererImp::draw_group( Group& group ) {
   DEBUG_CODE(printf("draw_group\n"));
-  for ( size_t i = 0; i < group.elements.size(); ++i ) {
-    draw_element(group.elements[i]);
-  }
 
+  // without opacity the elements draw straight into the target
+  if (!(group.opacity < 1)) {
+    draw_elements(group.elements);
+    return;
+  }
+  if (!(group.opacity > 0)) return;
+  if (!(group.min.x <= group.max.x && group.min.y <= group.max.y)) return;
+
+  // The layer covers the screen bounds of the group, padded for points,
+  // lines and antialiasing and clipped to the target, in whole pixels so
+  // that samples line up with the target's
+  const float kLayerPad = 2;
+  float bx0 = 0, by0 = 0, bx1 = pixel_w, by1 = pixel_h;
+  if (Affine2f::is_affine(transformation)) {
+    Vector2D corners[4] = { group.min, Vector2D(group.max.x, group.min.y),
+                            Vector2D(group.min.x, group.max.y), group.max };
+    Vec2f p[4];
+    transform_points(corners, 4, p);
+    bx0 = min(min(p[0].x, p[1].x), min(p[2].x, p[3].x)) - kLayerPad;
+    by0 = min(min(p[0].y, p[1].y), min(p[2].y, p[3].y)) - kLayerPad;
+    bx1 = max(max(p[0].x, p[1].x), max(p[2].x, p[3].x)) + kLayerPad;
+    by1 = max(max(p[0].y, p[1].y), max(p[2].y, p[3].y)) + kLayerPad;
+  }
+  int x0 = (int) max(0.f, floorf(bx0)), x1 = (int) min((float) pixel_w, ceilf(bx1));
+  int y0 = (int) max(0.f, floorf(by0)), y1 = (int) min((float) pixel_h, ceilf(by1));
+  if (x0 >= x1 || y0 >= y1) return;
+
+  // a clear layer from the pool, nested groups take the next one
+  int size = supersample ? sample_rate : 1;
+  size_t lw = (x1 - x0) * size, lh = (y1 - y0) * size;
+  size_t depth = layer_depth;
+  if (depth == layers.size()) layers.push_back(vector<unsigned char>());
+  if (layers[depth].size() < sample_bytes * lw * lh) {
+    layers[depth].resize(sample_bytes * lw * lh);
+  }
+  unsigned char* layer = &layers[depth][0];
+
+  // draw into the layer as if it were the target at (x0, y0)
+  unsigned char* target = render_target;
+  size_t tw = target_w, th = target_h, pw = pixel_w, ph = pixel_h;
+  int ry0 = rows_y0, ry1 = rows_y1;
+  Matrix3x3 parent = transformation;
+
+  Matrix3x3 shift = Matrix3x3::identity();
+  shift(0,2) = -x0; shift(1,2) = -y0;
+  transformation = shift * transformation;
+  render_target = layer;
+  target_w = lw; target_h = lh;
+  pixel_w = x1 - x0; pixel_h = y1 - y0;
+  rows_y0 = lh; rows_y1 = 0;
+
+  layer_depth++;
+  draw_elements(group.elements);
+  layer_depth--;
+
+  int ly0 = max(rows_y0, 0), ly1 = min(rows_y1, (int) lh);
+  transformation = parent;
+  render_target = target;
+  target_w = tw; target_h = th;
+  pixel_w = pw; pixel_h = ph;
+  rows_y0 = ry0; rows_y1 = ry1;
+
+  // only rows something was drawn into are composited, and cleared
+  if (ly0 < ly1) {
+    composite_layer(layer, lw, ly0, ly1, x0 * size, y0 * size, group.opacity);
+    touch_rows(y0 * size + ly0, y0 * size + ly1);
+  }
 }
 
 // Rasterization //
@@ -266,55 +1075,65 @@ void SoftwareRendererImp::rasterize_point( float x, float y, Color color ) {
   //DEBUG_CODE(printf("rasterize_point\n"));
 
   // fill in the nearest pixel
-  int sx = (int) round(x);
-  int sy = (int) round(y);
-  
-  if (doneSampleRate == 1) {
-    sx *= sample_rate;
-    sy *= sample_rate;
-  }
-
-  // check bounds
-  if ( sx < 0 || sx >= target_w ) return;
-  if ( sy < 0 || sy >= target_h ) return;
-
-  // fill sample - NOT doing alpha blending!
-  // Super sampling, draw sample_rate^2 points, instead of just 1
-  if (doneSampleRate == 1) {
-    int i, j;
-    for (i = sy; i < sy + sample_rate; i++) {
-      for (j = sx; j < sx + sample_rate; j++) {
-        render_target[4 * (j + i * target_w)    ] = (uint8_t) (color.r * 255);
-        render_target[4 * (j + i * target_w) + 1] = (uint8_t) (color.g * 255);
-        render_target[4 * (j + i * target_w) + 2] = (uint8_t) (color.b * 255);
-        render_target[4 * (j + i * target_w) + 3] = (uint8_t) (color.a * 255);
-      }
-    }
-  } else {
-    render_target[4 * (sx + sy * target_w)    ] = (uint8_t) (color.r * 255);
-    render_target[4 * (sx + sy * target_w) + 1] = (uint8_t) (color.g * 255);
-    render_target[4 * (sx + sy * target_w) + 2] = (uint8_t) (color.b * 255);
-    render_target[4 * (sx + sy * target_w) + 3] = (uint8_t) (color.a * 255);
-  }
+  fill_pixel((int) floor(x + 0.5f), (int) floor(y + 0.5f), pack_color(color));
 }
 
 void SoftwareRendererImp::rasterize_point_1( float x, float y, Color color ) {
   //DEBUG_CODE(printf("rasterize_point_1\n"));
   
-  // fill in the nearest pixel
-  int sx = (int) round(x);
-  int sy = (int) round(y);
+  // fill in the nearest sample
+  int sx = (int) floor(x + 0.5f);
+  int sy = (int) floor(y + 0.5f);
 
   // check bounds
   if ( sx < 0 || sx >= target_w ) return;
   if ( sy < 0 || sy >= target_h ) return;
 
-  // fill sample - NOT doing alpha blending!
-  // Super sampling, draw sample_rate^2 points, instead of ju
-  render_target[4 * (sx + sy * target_w)    ] = (uint8_t) (color.r * 255);
-  render_target[4 * (sx + sy * target_w) + 1] = (uint8_t) (color.g * 255);
-  render_target[4 * (sx + sy * target_w) + 2] = (uint8_t) (color.b * 255);
-  render_target[4 * (sx + sy * target_w) + 3] = (uint8_t) (color.a * 255);
+  fill_sample(sx, sy, pack_color(color));
+}
+
+// Lines //
+
+enum { CLIP_LEFT = 1, CLIP_RIGHT = 2, CLIP_BOTTOM = 4, CLIP_TOP = 8 };
+
+static inline int outcode( float x, float y, float xmax, float ymax ) {
+  int code = 0;
+  if (x < 0) code |= CLIP_LEFT; else if (x > xmax) code |= CLIP_RIGHT;
+  if (y < 0) code |= CLIP_BOTTOM; else if (y > ymax) code |= CLIP_TOP;
+  return code;
+}
+
+// Cohen-Sutherland clipping to [0, xmax] x [0, ymax], false if the line
+// misses the rectangle
+static bool clip_line( float& x0, float& y0, float& x1, float& y1,
+                       float xmax, float ymax ) {
+  int code0 = outcode(x0, y0, xmax, ymax);
+  int code1 = outcode(x1, y1, xmax, ymax);
+
+  // every pass moves an endpoint onto an edge, so four passes suffice
+  for (int pass = 0; pass < 4; pass++) {
+    if (!(code0 | code1)) return true;
+    if (code0 & code1) return false;
+
+    int code = code0 ? code0 : code1;
+    float x, y;
+    if (code & CLIP_TOP) {
+      x = x0 + (x1 - x0) * (ymax - y0) / (y1 - y0); y = ymax;
+    } else if (code & CLIP_BOTTOM) {
+      x = x0 + (x1 - x0) * (0 - y0) / (y1 - y0); y = 0;
+    } else if (code & CLIP_RIGHT) {
+      y = y0 + (y1 - y0) * (xmax - x0) / (x1 - x0); x = xmax;
+    } else {
+      y = y0 + (y1 - y0) * (0 - x0) / (x1 - x0); x = 0;
+    }
+
+    if (code == code0) {
+      x0 = x; y0 = y; code0 = outcode(x0, y0, xmax, ymax);
+    } else {
+      x1 = x; y1 = y; code1 = outcode(x1, y1, xmax, ymax);
+    }
+  }
+  return !(code0 & code1);
 }
 
 void SoftwareRendererImp::rasterize_line( float x0, float y0,
@@ -324,71 +1143,129 @@ void SoftwareRendererImp::rasterize_line( float x0, float y0,
   // Implement line rasterization
   DEBUG_CODE(printf("rasterize_line\n"));
 
-  // The implementation algorithm is Bresenham Line-drawing Algorithm
-  // It is referenced from
-  // http://www.cs.helsinki.fi/group/goa/mallinnus/lines/bresenh.html
-
-  // Fill in the nearest pixel
-  float sx0 = floor(x0);
-  float sy0 = floor(y0);
-  float sx1 = floor(x1);
-  float sy1 = floor(y1);
-
-  // Check bounds
-  if ( sx0 < 0.0 || sx0 >= target_w ) return;
-  if ( sy0 < 0.0 || sy0 >= target_h ) return;
-  if ( sx1 < 0.0 || sx1 >= target_w ) return;
-  if ( sy1 < 0.0 || sy1 >= target_h ) return;
-  
-  float stepX, stepY;
-  float x, y;
-  float epsilon;
+  if (!pixel_w || !pixel_h) return;
+  if (!(isfinite(x0) && isfinite(y0) && isfinite(x1) && isfinite(y1))) return;
 
-  if (sx1 >= sx0)
-    stepX = 1.0;
-  else
-    stepX = -1.0;
-  
-  if (sy1 >= sy0)
-    stepY = 1.0;
-  else
-    stepY = -1.0;
-
-  float slope = (sy1 - sy0) / (sx1 - sx0);
-
-  x = sx0;
-  y = sy0;
-
-  // Plot (x0, y0)
-  rasterize_point(sx0, sy0, color);
-
-  // Draw the line
-  if (abs(slope) > 1.0) {
-    slope = 1 / slope;
-    epsilon = x0 - sx0;
+  if (antialias_lines) {
+    rasterize_line_wu(x0, y0, x1, y1,
+                      linear ? straight(color) : premultiply(color));
+    return;
+  }
 
-    for(; y * stepY < sy1 * stepY; y += stepY) {
-      if ((epsilon + slope) * stepX >= 0.5) {
-        x += stepX;
-        epsilon += stepY * slope - stepX;
-        rasterize_point(x, y + stepY, color);
+  // The pixels are those of Bresenham's line between the floored
+  // endpoints, whatever part of it is inside the target, so a line drawn
+  // across several targets (tiles) lines up. Clipping only picks the
+  // steps to take, and the first one is found in closed form. The pixels
+  // are within two of the line, so it is clipped to a target grown by two.
+  const float kMargin = 2;
+  float cx0 = x0 + kMargin, cy0 = y0 + kMargin;
+  float cx1 = x1 + kMargin, cy1 = y1 + kMargin;
+  if (!clip_line(cx0, cy0, cx1, cy1, pixel_w - 1 + 2 * kMargin,
+                 pixel_h - 1 + 2 * kMargin)) return;
+  cx0 -= kMargin; cy0 -= kMargin; cx1 -= kMargin; cy1 -= kMargin;
+  const float kExact = 1 << 28;
+  if (max(max(fabsf(x0), fabsf(y0)), max(fabsf(x1), fabsf(y1))) >= kExact) {
+    // too far out for exact steps, draw the clipped line instead
+    x0 = cx0; y0 = cy0; x1 = cx1; y1 = cy1;
+  }
+  int64_t ix0 = (int64_t) floor(x0), iy0 = (int64_t) floor(y0);
+  int64_t ix1 = (int64_t) floor(x1), iy1 = (int64_t) floor(y1);
+
+  int64_t dx = ix1 - ix0, dy = iy1 - iy0;
+  int sx = dx >= 0 ? 1 : -1, sy = dy >= 0 ? 1 : -1;
+  dx = dx * sx; dy = dy * sy;
+
+  // every step moves one pixel along the major axis, the minor one at
+  // step k is (2 k minor + major) / (2 major) rounded down
+  bool x_major = dx >= dy;
+  int64_t major = x_major ? dx : dy, minor = x_major ? dy : dx;
+  int64_t ka = (int64_t) floor(x_major ? cx0 : cy0) - (x_major ? ix0 : iy0);
+  int64_t kb = (int64_t) floor(x_major ? cx1 : cy1) - (x_major ? ix0 : iy0);
+  ka *= x_major ? sx : sy; kb *= x_major ? sx : sy;
+  int64_t k0 = max<int64_t>(0, min(ka, kb) - 1);
+  int64_t k1 = min<int64_t>(major, max(ka, kb) + 1);
+  int64_t m = major ? (2 * k0 * minor + major) / (2 * major) : 0;
+  int64_t x = x_major ? k0 : m, y = x_major ? m : k0;
+
+  // integer Bresenham over pixels, err = dx - dy - x dy + y dx
+  int size = supersample ? sample_rate : 1;
+  size_t pitch = sample_bytes * target_w;
+  int64_t err = dx - dy - x * dy + y * dx;
+  uint32_t rgba = pack_color(color);
+  for (int64_t k = k0; ; k++) {
+    int64_t px = ix0 + sx * x, py = iy0 + sy * y;
+    if (px >= 0 && px < (int64_t) pixel_w && py >= 0 && py < (int64_t) pixel_h) {
+      touch_rows(py * size, (py + 1) * size);
+      unsigned char* p = render_target + py * size * pitch + sample_bytes * px * size;
+      if (linear && !supersample) {
+        plot_srgb8(SRGBTables::get(), p, rgba, linear_color(rgba));
+      } else if (linear) {
+        plot_block16(p, pitch, size, linear_color(rgba));
       } else {
-        rasterize_point(x, y + stepY, color);
-        epsilon += stepY * slope;
+        plot_block(p, pitch, size, fixed_point, rgba);
       }
     }
-  } else {
-    epsilon = y0 - sy0;
+    if (k >= k1) break;
+    int64_t e2 = 2 * err;
+    if (e2 >= -dy) { err -= dy; x++; }
+    if (e2 <= dx) { err += dx; y++; }
+  }
+}
 
-    for (; x * stepX < sx1 * stepX; x += stepX){
-      if ((epsilon + slope) * stepY >= 0.5) {
-        y += stepY;
-        epsilon += stepX * slope - stepY;
-        rasterize_point(x + stepX, y, color);
-      } else {
-        rasterize_point(x + stepX, y, color);
-        epsilon += stepX * slope;
+void SoftwareRendererImp::rasterize_line_wu( float x0, float y0,
+                                             float x1, float y1,
+                                             uint32_t rgba ) {
+
+  // pixel i covers [i, i + 1), shift so that its center is at i, and clip
+  // a pixel outside the target so that edge pixels keep their coverage
+  x0 += 0.5f; y0 += 0.5f; x1 += 0.5f; y1 += 0.5f;
+  if (!clip_line(x0, y0, x1, y1, pixel_w + 1, pixel_h + 1)) return;
+  x0 -= 1; y0 -= 1; x1 -= 1; y1 -= 1;
+
+  bool steep = fabsf(y1 - y0) > fabsf(x1 - x0);
+  if (steep) { swap(x0, y0); swap(x1, y1); }
+  if (x0 > x1) { swap(x0, x1); swap(y0, y1); }
+  float gradient = x1 > x0 ? (y1 - y0) / (x1 - x0) : 0;
+
+  int size = supersample ? sample_rate : 1;
+  size_t pitch = sample_bytes * target_w;
+  int w = steep ? pixel_h : pixel_w;
+  int h = steep ? pixel_w : pixel_h;
+
+  int xs = max((int) floor(x0 + 0.5f), 0);
+  int xe = min((int) floor(x1 + 0.5f), w - 1);
+  for (int x = xs; x <= xe; x++) {
+
+    // coverage along the major axis is the overlap with the line
+    float span = min(x + 0.5f, x1) - max(x - 0.5f, x0);
+    if (x0 == x1) span = 1;
+    float y = y0 + gradient * (x - x0);
+    int iy = (int) floor(y);
+    float f = y - iy;
+
+    int c[2] = { (int) (span * (1 - f) * 255 + 0.5f),
+                 (int) (span * f * 255 + 0.5f) };
+    for (int k = 0; k < 2; k++) {
+      int yy = iy + k;
+      if (yy < 0 || yy >= h || c[k] <= 0) continue;
+      int a = min(c[k], 255);
+      int px = steep ? yy : x, py = steep ? x : yy;
+      touch_rows(py * size, (py + 1) * size);
+      unsigned char* p = render_target + py * size * pitch + sample_bytes * px * size;
+
+      // coverage scales alpha, and the color too when premultiplied
+      if (linear) {
+        uint32_t scaled = (rgba & 0xffffff) |
+                          (uint32_t) mul_div255(rgba >> 24, a) << 24;
+        if (supersample) plot_block16(p, pitch, size, linear_color(scaled));
+        else plot_srgb8(SRGBTables::get(), p, scaled, linear_color(scaled));
+        continue;
       }
+      uint32_t scaled = mul_div255( rgba        & 0xff, a)        |
+                        mul_div255((rgba >>  8) & 0xff, a) <<  8  |
+                        mul_div255((rgba >> 16) & 0xff, a) << 16  |
+                        (uint32_t) mul_div255(rgba >> 24, a) << 24;
+      plot_block(p, pitch, size, true, scaled);
     }
   }
 }
@@ -439,19 +1316,19 @@ void SoftwareRendererImp::rasterize_triangle( float x0, float y0,
 
   // Get the small rectangular's four vertexs
 
-  x0 = round(x0);
-  x1 = round(x1);
-  x2 = round(x2);
-  y0 = round(y0);
-  y1 = round(y1);
-  y2 = round(y2);
+  x0 = floor(x0 + 0.5f);
+  x1 = floor(x1 + 0.5f);
+  x2 = floor(x2 + 0.5f);
+  y0 = floor(y0 + 0.5f);
+  y1 = floor(y1 + 0.5f);
+  y2 = floor(y2 + 0.5f);
 
   float minX = getMin(x0, x1, x2);
   float maxX = getMax(x0, x1, x2);
   float minY = getMin(y0, y1, y2);
   float maxY = getMax(y0, y1, y2);
 
-  if (doneSampleRate == 1) {
+  if (supersample) {
     minX *= sample_rate;
     maxX *= sample_rate;
     minY *= sample_rate;
@@ -464,11 +1341,22 @@ void SoftwareRendererImp::rasterize_triangle( float x0, float y0,
     y2 *= sample_rate;
   }
 
+  // samples outside the render target are never filled
+  minX = max(minX, 0.f); maxX = min(maxX, (float) target_w);
+  minY = max(minY, 0.f); maxY = min(maxY, (float) target_h);
+
+  // pack the color once for the whole triangle
+  uint32_t rgba = pack_color(color);
+
   // Assume P(x, y)
   float x, y;
   float P_AB, C_AB, P_BC, A_BC, P_AC, B_AC;
 
   for (x = minX; x < maxX; x++) {
+
+    // stop a job between strips of 32 sample columns
+    if (((int) (x - minX) & 31) == 31 && job_stopped()) return;
+
     for (y = minY; y < maxY; y++) {
       P_AB = (x - x1) * (y0 - y1) - (y - y1) * (x0 - x1);   //P - AB
       C_AB = (x2 - x1) * (y0 - y1) - (y2 - y1) * (x0 - x1); //C - AB
@@ -481,10 +1369,10 @@ void SoftwareRendererImp::rasterize_triangle( float x0, float y0,
 
       // Whether the point is in the triangle or not
       if ((P_AB * C_AB >= 0.0) && (P_BC * A_BC >= 0.0) && (P_AC * B_AC >= 0.0)) {
-        if (doneSampleRate == 0)
-          rasterize_point(x, y, color);
+        if (!supersample)
+          fill_pixel(x, y, rgba);
         else
-          rasterize_point_1(x, y, color);
+          fill_sample(x, y, rgba);
       }
     }
   }
@@ -493,88 +1381,70 @@ void SoftwareRendererImp::rasterize_triangle( float x0, float y0,
 void SoftwareRendererImp::rasterize_image( float x0, float y0,
                                            float x1, float y1,
                                            Texture& tex ) {
-  // Task ?: 
-  // Implement image rasterization
   DEBUG_CODE(printf("rasterize_image\n"));
 
-  x0 = floor(x0);
-  y0 = floor(y0);
-  x1 = floor(x1);
-  y1 = floor(y1);
-
-  // printf("x0=%f, y0=%f, x1=%f, y1=%f\n", x0, y0, x1, y1);
-  // (426, 106) -> (1493, 1173)
-
-  int level;
-  int tex_width = tex.width;  // test7 -> 256
-  int tex_height = tex.height;// test7 -> 256
-  float canvas_width = x1 - x0;
-  float canvas_height = y1 - y0;
-  int scale_u, scale_v;
-  //printf("tex_width=%d, tex_height=%d, screen_width=%d, screen_height=%d\n", tex_width, tex_height, screen_width, screen_height);
-  
-  float x, y, u, v, u_scale, v_scale, l, d;
-  int d_near;
-  float log2 = log(2);
-  Color color;
-
-  for (y = y0 + 0.5; y < y1; y ++) {
-    v = (y - y0) / canvas_height;
-    v_scale = tex_height / canvas_height;
-    //printf("texture_v=%f\n", texture_v);
-    for (x = x0 + 0.5; x < x1; x ++) {
-      u = (x - x0) / canvas_width;
-      u_scale = tex_width / canvas_width;
-
-      if (u_scale > v_scale)
-        l = u_scale;
-      else
-        l = v_scale;
-      /*
-      if (l <= 1) {
-        color = sampler->sample_bilinear(tex, u, v, 0);
-        // color = sampler->sample_nearest(tex, u, v, 0);
-        // printf("c0=%u, c1=%u, c2=%u, c3=%u\n", color.r, color.g, color.b, color.a);
-      } else {
-        d = log(l) / log2;
-        d_near = (int)round(d);
-        color = sampler->sample_bilinear(tex, u, v, d_near);
-        // color = sampler->sample_nearest(tex, u, v, d_near);
-        // printf("c0=%u, c1=%u, c2=%u, c3=%u\n", color.r, color.g, color.b, color.a);
-      }
-      */
-
-      
-      color = sampler->sample_trilinear(tex, u, v, u_scale, v_scale);
-        
-      if (doneSampleRate == 0)
-        rasterize_point(x, y, color);
-      else
-        rasterize_point_1(x, y, color);
-      }
+  if (tex.mipmap.empty() || x0 == x1 || y0 == y1) return;
+
+  // work directly in render target samples
+  if (supersample) {
+    x0 *= sample_rate; y0 *= sample_rate;
+    x1 *= sample_rate; y1 *= sample_rate;
+  }
+
+  // samples whose centers fall inside the image, clipped to the target
+  int sx0 = max(0, (int) ceil(min(x0, x1) - 0.5f));
+  int sy0 = max(0, (int) ceil(min(y0, y1) - 0.5f));
+  int sx1 = min((int) target_w, (int) ceil(max(x0, x1) - 0.5f));
+  int sy1 = min((int) target_h, (int) ceil(max(y0, y1) - 0.5f));
+  if (sx0 >= sx1 || sy0 >= sy1) return;
+  touch_rows(sy0, sy1);
+
+  // uv steps per sample are constant over the image. Images are drawn
+  // axis aligned between two corners, as by the reference, so the
+  // footprint is too and anisotropy is only ever along u or v.
+  float du = 1.f / (x1 - x0);
+  float dv = 1.f / (y1 - y0);
+  float u0 = (sx0 + 0.5f - x0) * du;
+  size_t count = sx1 - sx0;
+
+  // The imp sampler fills whole spans from any layout. Other samplers go
+  // texel by texel and only know row order texels; the layout is chosen
+  // when the mips are built, textures may be shared by concurrent draws
+  // and are never converted here.
+  Sampler2DImp* span_sampler = dynamic_cast<Sampler2DImp*>(sampler);
+  if (!span_sampler && tex.layout != TEXELS_LINEAR) return;
+
+  // the fixed point pipeline blends texels over the target, the float
+  // reference pipeline overwrites it
+  if (fixed_point) span_buffer.resize(4 * count);
+
+  for (int sy = sy0; sy < sy1; sy++) {
+    if (((sy - sy0) & 31) == 31 && job_stopped()) return;
+    float v = (sy + 0.5f - y0) * dv;
+    unsigned char* dst = &render_target[sample_bytes * (sy * target_w + sx0)];
+    unsigned char* out = fixed_point ? &span_buffer[0] : dst;
+
+    if (span_sampler) {
+      span_sampler->sample_span(tex, u0, v, du, 0, 0, dv, count, out);
+      if (linear && !supersample) blend_span_over_srgb8(dst, out, count);
+      else if (linear) blend_span_over16(dst, out, count);
+      else if (fixed_point) blend_span_over(dst, out, count);
+      continue;
     }
-    // printf("l=%f\n",l);
-  printf("x0=%f, y0=%f, x1=%f, y1=%f\n", x0, y0, x1, y1);
-  //printf("level=%lu\n", tex.mipmap.size());    tex.mipmap.size()
 
-  /*
-  int level;
-  float x, y, u, v;
-  // Different layers
-  for (level = 0; level < tex.mipmap.size(); level++) {
-    for (y = y0; y < y1; y += tex.height) {
-      for (x = x0; x < x1 ; x += tex.width) {
-        for (v = 0; v < tex.height; v++) {
-          for (u = 0; u < tex.width; u++) {
-            if (doneSampleRate == 0)
-              rasterize_point(x, y, color_nearest(tex, u, v, level));
-            else
-              rasterize_point_1(x, y, color_nearest(tex, u, v, level));
-          }
-        }
-      }
+    float u = u0;
+    for (size_t i = 0; i < count; i++, u += du, out += 4) {
+      Color c = sampler->sample_trilinear(tex, u, v, fabsf(du) * tex.width,
+                                                     fabsf(dv) * tex.height);
+      out[0] = (uint8_t) (c.r * 255);
+      out[1] = (uint8_t) (c.g * 255);
+      out[2] = (uint8_t) (c.b * 255);
+      out[3] = (uint8_t) (c.a * 255);
     }
-  }*/
+    if (linear && !supersample) blend_span_over_srgb8(dst, &span_buffer[0], count);
+    else if (linear) blend_span_over16(dst, &span_buffer[0], count);
+    else if (fixed_point) blend_span_over(dst, &span_buffer[0], count);
+  }
 }
 
 // resolve samples to render target
@@ -585,40 +1455,67 @@ void SoftwareRendererImp::resolve() {
   // You may also need to modify other functions marked with "Task 3".
   DEBUG_CODE(printf("resolve\n"));
 
-  if (doneSampleRate == 0) {
-    DEBUG_CODE(printf("doneSampleRate = 0\n"));
+  if (!supersample) {
+    DEBUG_CODE(printf("supersample = 0\n"));
     DEBUG_CODE(printf("finish resolve\n"));
     return;
   }
-  DEBUG_CODE(printf("doneSampleRate = 1\n"));
+  DEBUG_CODE(printf("supersample = 1\n"));
 
+  // only the rows that changed this frame
   size_t small_w = target_w / sample_rate;
-  size_t small_h = target_h / sample_rate;
   size_t i, j, m, n, k, x, y, temp;
 
-  for (m = 0, i = 0; i < target_h; i += sample_rate, m++) {
-    for (n = 0, j = 0; j < target_w; j += sample_rate, n++) {
-      //printf("i=%lu, j=%lu, m=%lu, n=%lu\n", i, j, m, n);
-      // Compute the average
-      for (k = 0; k < 4; k++) {
-        temp = 0;
+  // average in linear light, then encode to premultiplied sRGB8
+  if (linear) {
+    size_t pitch = 8 * target_w;
+    for (m = dirty_y0; m < dirty_y1; m++) {
+      if (job && !resolve_row(m)) return;
+      resolve_row16(&pixel_target[4 * m * small_w],
+                    render_target + m * sample_rate * pitch, pitch,
+                    small_w, sample_rate);
+    }
+  } else if (fixed_point) {
+    // integer box filter, rounded to nearest
+    size_t count = sample_rate * sample_rate;
+    for (m = dirty_y0; m < dirty_y1; m++) {
+      if (job && !resolve_row(m)) return;
+      unsigned char* dst = &pixel_target[4 * m * small_w];
+      for (n = 0; n < small_w; n++, dst += 4) {
+        uint32_t sum[4] = { 0, 0, 0, 0 };
         for (y = 0; y < sample_rate; y++) {
-          for (x = 0; x < sample_rate; x++) {
-            temp += render_target[4 * ((i + y) * target_w + (j + x)) + k];
+          const unsigned char* src =
+            &render_target[4 * ((m * sample_rate + y) * target_w + n * sample_rate)];
+          for (x = 0; x < sample_rate; x++, src += 4) {
+            sum[0] += src[0]; sum[1] += src[1];
+            sum[2] += src[2]; sum[3] += src[3];
           }
         }
-        temp = temp / sample_rate / sample_rate;
-        small_target[4 * (m * small_w + n) + k] = (uint8_t) temp;
-      }     
+        for (k = 0; k < 4; k++) dst[k] = (sum[k] + count / 2) / count;
+      }
+    }
+  } else {
+    // float reference, truncating
+    for (m = dirty_y0, i = dirty_y0 * sample_rate; m < dirty_y1;
+         i += sample_rate, m++) {
+      if (job && !resolve_row(m)) return;
+      for (n = 0, j = 0; j < target_w; j += sample_rate, n++) {
+        //printf("i=%lu, j=%lu, m=%lu, n=%lu\n", i, j, m, n);
+        // Compute the average
+        for (k = 0; k < 4; k++) {
+          temp = 0;
+          for (y = 0; y < sample_rate; y++) {
+            for (x = 0; x < sample_rate; x++) {
+              temp += render_target[4 * ((i + y) * target_w + (j + x)) + k];
+            }
+          }
+          temp = temp / sample_rate / sample_rate;
+          pixel_target[4 * (m * small_w + n) + k] = (uint8_t) temp;
+        }     
+      }
     }
   }
-  // Change the target back to the smaller one
-
-  free(render_target);
-  this->render_target = small_target;
-  this->target_w = small_w;
-  this->target_h = small_h;
-
+  // the sample buffer stays bound for the next frame
   DEBUG_CODE(printf("finish resolve\n"));
   return;
 }
@@ -629,11 +1526,15 @@ void SoftwareRendererImp::clear_target() {
   // Clear the supersample_target
   DEBUG_CODE(printf("clear_target\n"));
 
-  int i = 0;
-  int num = 4 * target_w * target_h;
-  for (; i < num; i++) {
-    render_target[i] = 0;
+  // rows not drawn by the last frame are still clear
+  cleared_y0 = target_valid ? drawn_y0 : 0;
+  cleared_y1 = target_valid ? drawn_y1 : target_h;
+  if (render_target && cleared_y0 < cleared_y1) {
+    size_t pitch = sample_bytes * target_w;
+    memset(render_target + cleared_y0 * pitch, 0,
+           (cleared_y1 - cleared_y0) * pitch);
   }
+  rows_y0 = target_h; rows_y1 = 0;
   return;
 }
 } // namespace CMU462
@@ -2,10 +2,13 @@
 #define CMU462_SOFTWARE_RENDERER_H
 
 #include <stdio.h>
+#include <stdint.h>
 #include <vector>
 
 #include "CMU462.h"
 #include "texture.h"
+#include "affine2f.h"
+#include "render_job.h"
 #include "svg_renderer.h"
 
 namespace CMU462 { // CMU462
@@ -66,11 +69,23 @@ class SoftwareRenderer : public SVGRenderer {
 class SoftwareRendererImp : public SoftwareRenderer {
  public:
 
-  SoftwareRendererImp( ) : SoftwareRenderer( ) { }
+  SoftwareRendererImp( ) : SoftwareRenderer( ), fixed_point ( true ),
+    pixel_target ( NULL ), pixel_w ( 0 ), pixel_h ( 0 ),
+    supersample ( false ), linear_light ( false ), linear ( false ),
+    sample_bytes ( 4 ), linear_key ( 0 ), linear_rgba ( 0 ),
+    canvas_outline ( true ), layer_depth ( 0 ),
+    antialias_lines ( false ), target_valid ( false ),
+    rows_y0 ( 0 ), rows_y1 ( 0 ), drawn_y0 ( 0 ), drawn_y1 ( 0 ),
+    cleared_y0 ( 0 ), cleared_y1 ( 0 ), dirty_y0 ( 0 ), dirty_y1 ( 0 ),
+    job ( NULL ) { }
 
   // draw an svg input to render target
   void draw_svg( SVG& svg );
 
+  // draw an svg as a job that can be cancelled or run out of time, the
+  // status is also left in the job along with its stats
+  RenderStatus draw_svg( SVG& svg, RenderJob& job );
+
   // set sample rate
   void set_sample_rate( size_t sample_rate );
   
@@ -79,13 +94,169 @@ class SoftwareRendererImp : public SoftwareRenderer {
                           size_t width, size_t height );
   void clear_target( void );
 
+  // choose between the fixed point pipeline (premultiplied RGBA8 colors,
+  // integer blending and resolve) and the float reference pipeline
+  inline void set_fixed_point( bool enabled ) {
+    fixed_point = enabled; bind_sample_buffer();
+  }
+  inline bool get_fixed_point( void ) const { return fixed_point; }
+
+  // Blend and resolve in linear light on the fixed point pipeline: samples
+  // are premultiplied linear RGBA16 and pixels are encoded back to sRGB by
+  // resolve. At sample rate 1 pixels are decoded, blended and encoded
+  // again in place. Off by default.
+  inline void set_linear_light( bool enabled ) {
+    linear_light = enabled; bind_sample_buffer();
+  }
+  inline bool get_linear_light( void ) const { return linear_light; }
+
+  // draw lines with Xiaolin Wu's antialiasing, always blended
+  inline void set_line_antialiasing( bool enabled ) { antialias_lines = enabled; }
+  inline bool get_line_antialiasing( void ) const { return antialias_lines; }
+
+  // draw the outline around the canvas, on by default, off for exports
+  inline void set_canvas_outline( bool enabled ) { canvas_outline = enabled; }
+
+  // Rows of the render target changed by the last draw_svg, [y0, y1).
+  // Only rows drawn in the last two frames are cleared and resolved, so
+  // whoever else writes into the render target must invalidate it.
+  inline void get_dirty_rows( size_t& y0, size_t& y1 ) const {
+    y0 = dirty_y0; y1 = dirty_y1;
+  }
+  inline void invalidate_target( void ) { target_valid = false; }
+
+  // rows the last draw_svg drew into, the rest of the target is clear
+  inline void get_drawn_rows( size_t& y0, size_t& y1 ) const {
+    size_t size = sample_rate > 1 ? sample_rate : 1;
+    y0 = y1 = 0;
+    if (drawn_y0 < drawn_y1) {
+      y0 = drawn_y0 / size; y1 = (drawn_y1 + size - 1) / size;
+    }
+  }
+
  private:
 
+  // use the fixed point pipeline
+  bool fixed_point;
+
+  // straight alpha texels of an image span before blending
+  std::vector<unsigned char> span_buffer;
+
+  // pixel buffer given by set_render_target, while supersampling the
+  // render target is the sample buffer and resolve writes to this
+  unsigned char* pixel_target;
+  size_t pixel_w; size_t pixel_h;
+
+  // drawing into the sample buffer, kept per renderer so that renderers
+  // on different threads do not share state
+  bool supersample;
+
+  // linear light as asked for, and as used (only in fixed point)
+  bool linear_light;
+  bool linear;
+
+  // bytes per sample of the render target, 8 for linear RGBA16 samples
+  size_t sample_bytes;
+
+  // linear sample buffer, and the last packed color converted for it
+  std::vector<uint16_t> linear_buffer;
+  uint32_t linear_key;
+  uint64_t linear_rgba;
+
+  // premultiplied linear RGBA16 of a color packed by pack_color
+  inline uint64_t linear_color( uint32_t rgba ) {
+    if (rgba != linear_key) convert_linear(rgba);
+    return linear_rgba;
+  }
+  void convert_linear( uint32_t rgba );
+
+  // draw the black outline around the canvas
+  bool canvas_outline;
+
+  // Offscreen layers of groups with opacity, one per nesting depth. They
+  // only grow, and are cleared after use rather than before, so drawing
+  // a group takes no allocation and no clear of rows it never touched.
+  std::vector<std::vector<unsigned char> > layers;
+  size_t layer_depth;
+
+  // composites rows [y0, y1) of a layer w samples wide, whose top left
+  // sample is at (x, y) of the render target, then clears them
+  void composite_layer( unsigned char* layer, size_t w, size_t y0, size_t y1,
+                        size_t x, size_t y, float opacity );
+
+  // Scratch buffers, kept across frames so that drawing does not touch
+  // the heap once their capacity has grown to fit the document
+  std::vector<unsigned char> sample_buffer;
+  std::vector<Vector2D> triangle_scratch;
+  std::vector<Vec2f> vertex_scratch;
+
+  // points render_target at the pixel or sample buffer for the sample rate
+  void bind_sample_buffer( void );
+
+  // antialias lines
+  bool antialias_lines;
+
+  // Xiaolin Wu line, rgba is packed by pack_color
+  void rasterize_line_wu( float x0, float y0, float x1, float y1,
+                          uint32_t rgba );
+
+  // Dirty rows: the render target only holds what the last frame drew,
+  // in sample rows [drawn_y0, drawn_y1), unless something else wrote it
+  bool target_valid;
+  int rows_y0, rows_y1;
+  int drawn_y0, drawn_y1;
+  int cleared_y0, cleared_y1;
+  size_t dirty_y0, dirty_y1;
+
+  // sample rows [y0, y1) are drawn this frame
+  inline void touch_rows( int y0, int y1 ) {
+    if (y0 < rows_y0) rows_y0 = y0;
+    if (y1 > rows_y1) rows_y1 = y1;
+  }
+
+  // job being drawn, NULL outside of draw_svg with a job
+  RenderJob* job;
+
+  // true once the job is cancelled or past its deadline
+  inline bool job_stopped( void ) {
+    if (!job) return false;
+    return job->status != RENDER_COMPLETE || poll_job();
+  }
+  inline bool job_cancelled( void ) const {
+    return job && (job->status == RENDER_CANCELLED ||
+                   (job->token && job->token->is_cancelled()));
+  }
+  bool poll_job( void );
+
+  // counts a resolved row of a job, false if the job has stopped
+  bool resolve_row( size_t m );
+
+  // Point batches in structure of arrays form: sample offset into the
+  // render target and packed color per point, plus the tile binning
+  std::vector<size_t> point_offset;
+  std::vector<uint32_t> point_rgba;
+  std::vector<uint32_t> point_tile;
+  std::vector<uint32_t> point_order;
+  std::vector<uint32_t> tile_start;
+
+  // transforms a batch of points to screen space
+  void transform_points( const Vector2D* points, size_t count,
+                         Vec2f* out ) const;
+  inline Vec2f transform_point( const Vector2D& p ) const {
+    Vec2f q; transform_points(&p, 1, &q); return q;
+  }
+
   // Primitive Drawing //
 
+  // Draws a list of SVG elements in order, runs of points as one batch
+  void draw_elements( std::vector<SVGElement*>& elements );
+
   // Draws an SVG element
   void draw_element( SVGElement* element );
 
+  // Draws consecutive points
+  void draw_points( SVGElement* const* points, size_t count );
+
   // Draws a point
   void draw_point( Point& p );
 
@@ -110,6 +281,14 @@ class SoftwareRendererImp : public SoftwareRenderer {
   // Draw a group
   void draw_group( Group& group );
 
+  // Points to draw a path with at the current scale: the coarsest level of
+  // detail within half a pixel. NULL when the path is off the target, or
+  // smaller than a pixel, and then drawn as a point of the stroke color
+  // when it has one.
+  const std::vector<Vector2D>* path_points( const std::vector<Vector2D>& points,
+                                            const PathLOD& lod,
+                                            const Color& stroke );
+
   // Rasterization //
 
   // rasterize a point in small render_target
@@ -118,6 +297,16 @@ class SoftwareRendererImp : public SoftwareRenderer {
   // rasterize a point in big render_target
   void rasterize_point_1( float x, float y, Color color );
 
+  // fill the samples of pixel (x, y), rgba is color packed by pack_color
+  void fill_pixel( int x, int y, uint32_t rgba );
+
+  // fill sample (sx, sy) of the render target
+  void fill_sample( int sx, int sy, uint32_t rgba );
+
+  // RGBA8 of a color, premultiplied on the fixed point pipeline (straight
+  // in linear light) and straight (truncated) on the float one
+  uint32_t pack_color( const Color& color ) const;
+
   // rasterize a line
   void rasterize_line( float x0, float y0,
                        float x1, float y1,
@@ -0,0 +1,29 @@
+#include "srgb.h"
+
+#include <math.h>
+
+namespace CMU462 {
+
+static double srgb_to_linear( double c ) {
+  return c <= 0.04045 ? c / 12.92 : pow((c + 0.055) / 1.055, 2.4);
+}
+
+static double linear_to_srgb( double c ) {
+  return c <= 0.0031308 ? c * 12.92 : 1.055 * pow(c, 1 / 2.4) - 0.055;
+}
+
+SRGBTables::SRGBTables() {
+  for (int i = 0; i < 256; i++) {
+    decode[i] = (uint16_t) (srgb_to_linear(i / 255.0) * 65535 + 0.5);
+  }
+  for (int i = 0; i < 65536; i++) {
+    encode[i] = (uint8_t) (linear_to_srgb(i / 65535.0) * 255 + 0.5);
+  }
+}
+
+const SRGBTables& SRGBTables::get() {
+  static const SRGBTables tables;
+  return tables;
+}
+
+} // namespace CMU462
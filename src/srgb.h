@@ -0,0 +1,30 @@
+#ifndef CMU462_SRGB_H
+#define CMU462_SRGB_H
+
+#include <stdint.h>
+
+namespace CMU462 {
+
+/**
+ * Lookup tables for the sRGB transfer function, between 8 bit encoded
+ * values and 16 bit linear ones (0 to 65535). Built on first use.
+ */
+struct SRGBTables {
+
+  // encoded byte to linear
+  uint16_t decode[256];
+
+  // linear to encoded byte, rounded to nearest
+  uint8_t encode[65536];
+
+  static const SRGBTables& get();
+
+ private:
+
+  SRGBTables();
+
+};
+
+} // namespace CMU462
+
+#endif // CMU462_SRGB_H
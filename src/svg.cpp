@@ -1,8 +1,11 @@
 #include "svg.h"
 #include "png.h"
-#include "base64.h"
+#include "base64_decode.h"
+#include "texture_cache.h"
+#include "simplify.h"
 
 #include <string>
+#include <string.h>
 #include <fstream>
 #include <sstream>
 #include <iostream>
@@ -24,6 +27,24 @@ SVG::~SVG() {
   for (size_t i = 0; i < elements.size(); i++) {
     delete elements[i];
   } elements.clear();
+
+  // textures only this document used may now be dropped
+  TextureCache::instance().evict();
+}
+
+// Image //
+
+void Image::make_private_copy( const Texture& source ) {
+  drop_private_copy();
+  tex = source;
+  set_texel_layout(tex, TEXELS_LINEAR);
+  TextureCache::instance().add_private_bytes(TextureCache::texture_bytes(tex));
+}
+
+void Image::drop_private_copy() {
+  if (!shared_tex || tex.mipmap.empty()) return;
+  TextureCache::instance().remove_private_bytes(TextureCache::texture_bytes(tex));
+  std::vector<MipLevel>().swap(tex.mipmap);
 }
 
 // Parser //
@@ -311,6 +332,8 @@ void SVGParser::parsePolyline( XMLElement* xml, Polyline* polyline ) {
   while( points >> x >> c >> y ) {
      polyline->points.push_back( Vector2D( x, y ) );
   }
+
+  build_path_lod( polyline->points, false, polyline->lod );
 }
 
 void SVGParser::parseRect( XMLElement* xml, Rect* rect ) {
@@ -330,6 +353,8 @@ void SVGParser::parsePolygon( XMLElement* xml, Polygon* polygon ) {
   while( points >> x >> c >> y ) {
      polygon->points.push_back( Vector2D( x, y ) );
   }
+
+  build_path_lod( polygon->points, true, polygon->lod );
 }
 
 void SVGParser::parseEllipse( XMLElement* xml, Ellipse* ellipse ) {
@@ -350,30 +375,106 @@ void SVGParser::parseImage( XMLElement* xml, Image* image ) {
   const char* data = xml->Attribute( "xlink:href" );
   while (*data != ',') data++; data++;
   
-  // decode base64 encoded data
-  string encoded = data;
-  encoded.erase(remove(encoded.begin(), encoded.end(), ' ' ), encoded.end());
-  encoded.erase(remove(encoded.begin(), encoded.end(), '\t'), encoded.end());
-  encoded.erase(remove(encoded.begin(), encoded.end(), '\n'), encoded.end());
-  string decoded = base64_decode(encoded);
+  size_t length = strlen(data);
+
+  // images embedding the same payload share one decoded texture
+  TextureCache& cache = TextureCache::instance();
+  TextureCache::Key key = TextureCache::make_key(data, length);
+  image->shared_tex = cache.find(key, data);
+  if (image->shared_tex) return;
 
-  // load decoded data into buffer
-  const unsigned char* buffer = (unsigned char*) decoded.c_str(); 
-  size_t size = decoded.size();
+  // decode base64 encoded data straight into the png decoder input,
+  // whitespace is skipped by the decoder
+  vector<unsigned char> decoded;
+  base64_decode_into(decoded, data, length);
 
   // load into png
-  PNG png; PNGParser::load(buffer, size, png);
+  PNG png; PNGParser::load(decoded.empty() ? NULL : &decoded[0], decoded.size(), png);
   
-  // create bitmap texture from png (mip level 0)
+  // create bitmap texture from png (mip level 0), taking over its pixels
   MipLevel mip_start;
   mip_start.width  = png.width;
   mip_start.height = png.height;
-  mip_start.texels = png.pixels;
+  mip_start.texels = std::move(png.pixels);
+
+  // add to svg and the cache
+  shared_ptr<Texture> tex = make_shared<Texture>();
+  tex->width  = mip_start.width;
+  tex->height = mip_start.height;
+  tex->mipmap.push_back(std::move(mip_start));
+  image->shared_tex = tex;
+  cache.insert(key, data, tex);
+}
 
-  // add to svg
-  image->tex.width  = mip_start.width;
-  image->tex.height = mip_start.height;
-  image->tex.mipmap.push_back(mip_start);
+// grows [min, max] by p under m
+static void grow_bounds( Vector2D& min, Vector2D& max,
+                         const Matrix3x3& m, double x, double y ) {
+  Vector3D u = m * Vector3D(x, y, 1);
+  Vector2D p(u.x / u.z, u.y / u.z);
+  min.x = std::min(min.x, p.x); min.y = std::min(min.y, p.y);
+  max.x = std::max(max.x, p.x); max.y = std::max(max.y, p.y);
+}
+
+static void grow_bounds( Vector2D& min, Vector2D& max, const Matrix3x3& m,
+                         const Vector2D& p, const Vector2D& q ) {
+  if (!(p.x <= q.x && p.y <= q.y)) return;
+  grow_bounds(min, max, m, p.x, p.y); grow_bounds(min, max, m, q.x, p.y);
+  grow_bounds(min, max, m, p.x, q.y); grow_bounds(min, max, m, q.x, q.y);
+}
+
+// grows [min, max] by the bounds of an element in its parent's space
+static void element_bounds( const SVGElement* element,
+                            Vector2D& min, Vector2D& max ) {
+
+  const Matrix3x3& m = element->transform;
+  switch (element->type) {
+    case POINT: {
+      const Vector2D& p = static_cast<const Point*>(element)->position;
+      grow_bounds(min, max, m, p, p);
+      break;
+    }
+    case LINE: {
+      const Line* line = static_cast<const Line*>(element);
+      grow_bounds(min, max, m, line->from.x, line->from.y);
+      grow_bounds(min, max, m, line->to.x, line->to.y);
+      break;
+    }
+    case POLYLINE: {
+      const PathLOD& lod = static_cast<const Polyline*>(element)->lod;
+      grow_bounds(min, max, m, lod.min, lod.max);
+      break;
+    }
+    case POLYGON: {
+      const PathLOD& lod = static_cast<const Polygon*>(element)->lod;
+      grow_bounds(min, max, m, lod.min, lod.max);
+      break;
+    }
+    case RECT: {
+      const Rect* rect = static_cast<const Rect*>(element);
+      grow_bounds(min, max, m, rect->position,
+                  rect->position + rect->dimension);
+      break;
+    }
+    case ELLIPSE: {
+      const Ellipse* ellipse = static_cast<const Ellipse*>(element);
+      grow_bounds(min, max, m, ellipse->center - ellipse->radius,
+                  ellipse->center + ellipse->radius);
+      break;
+    }
+    case IMAGE: {
+      const Image* image = static_cast<const Image*>(element);
+      grow_bounds(min, max, m, image->position,
+                  image->position + image->dimension);
+      break;
+    }
+    case GROUP: {
+      const Group* group = static_cast<const Group*>(element);
+      grow_bounds(min, max, m, group->min, group->max);
+      break;
+    }
+    default:
+      break;
+  }
 }
 
 void SVGParser::parseGroup( XMLElement* xml, Group* group ) {
@@ -457,6 +558,14 @@ void SVGParser::parseGroup( XMLElement* xml, Group* group ) {
     }    
     elem = elem->NextSiblingElement();
   }
+
+  // opacity applies to the group as a whole, over the bounds of its elements
+  if ( xml->QueryFloatAttribute( "opacity", &group->opacity ) == XML_SUCCESS ) {
+    group->opacity = std::max( 0.f, std::min( 1.f, group->opacity ) );
+  }
+  for (size_t i = 0; i < group->elements.size(); i++) {
+    element_bounds(group->elements[i], group->min, group->max);
+  }
 }
 
 } // namespace CMU462
@@ -2,6 +2,8 @@
 #define CMU462_SVG_H
 
 #include <map>
+#include <math.h>
+#include <memory>
 #include <vector>
 
 #include "color.h"
@@ -53,9 +55,16 @@ struct SVGElement {
 
 struct Group : SVGElement {
 
-  Group() : SVGElement  ( GROUP ) { }
+  Group() : SVGElement  ( GROUP ), opacity ( 1 ),
+    min ( INFINITY, INFINITY ), max ( -INFINITY, -INFINITY ) { }
   std::vector<SVGElement*> elements;
 
+  // group opacity, below 1 the group is drawn as one layer
+  float opacity;
+
+  // bounds of the elements in group space, empty when min > max
+  Vector2D min, max;
+
   ~Group();
 
 };
@@ -75,11 +84,30 @@ struct Line : SVGElement {
 
 };
 
+/**
+ * Bounds and Douglas-Peucker simplifications of a path, for drawing it
+ * zoomed out. Level k keeps the points whose removal would move the path
+ * by more than tolerance[k] canvas units, coarsest level first. Only long
+ * paths have levels.
+ */
+struct PathLOD {
+
+  PathLOD() : min ( INFINITY, INFINITY ), max ( -INFINITY, -INFINITY ) { }
+
+  Vector2D min, max;
+  std::vector<float> tolerance;
+  std::vector<std::vector<Vector2D> > points;
+
+};
+
 struct Polyline : SVGElement {
 
   Polyline() : SVGElement  ( POLYLINE ) { }
   std::vector<Vector2D> points;
 
+  // built by the parser, kept after the fields the reference reads
+  PathLOD lod;
+
 };
 
 struct Rect : SVGElement {
@@ -95,6 +123,9 @@ struct Polygon : SVGElement {
   Polygon() : SVGElement  ( POLYGON ) { }
   std::vector<Vector2D> points;
 
+  // built by the parser, kept after the fields the reference reads
+  PathLOD lod;
+
 };
 
 struct Ellipse : SVGElement {
@@ -108,9 +139,25 @@ struct Ellipse : SVGElement {
 struct Image : SVGElement {
 
   Image() : SVGElement  ( IMAGE ) { }
+  ~Image() { drop_private_copy(); }
   Vector2D position;
   Vector2D dimension;
+
+  // private copy of the texture, only filled while a renderer that reads
+  // it directly (reference, hardware) is in use. Those renderers are
+  // prebuilt against this layout, so every image needs its own copy; the
+  // copies are counted against the texture cache budget.
   Texture tex;
+
+  // decoded texture, shared with every image embedding the same payload
+  std::shared_ptr<Texture> shared_tex;
+
+  Texture& texture() { return shared_tex ? *shared_tex : tex; }
+
+  // fills tex with a row order copy of source, a copy of shared_tex
+  // (pass another image's private copy to skip the layout conversion)
+  void make_private_copy( const Texture& source );
+  void drop_private_copy();
   
 };
 
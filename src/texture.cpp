@@ -1,11 +1,21 @@
 #include "texture.h"
+#include "block_compression.h"
+#include "srgb.h"
 
 #include <assert.h>
 #include <iostream>
 #include <algorithm>
 #include <math.h>
+#include <string.h>
+#include <stdint.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#ifndef DRAWSVG_NO_DEBUG
 #define ENABLE_DEBUG
+#endif
 #ifdef ENABLE_DEBUG
 #define DEBUG_CODE(CODEFRAGMENT) CODEFRAGMENT;
 #else
@@ -32,180 +42,651 @@ inline void float_to_uint8( unsigned char* dst, float src[4] ) {
   dst_uint8[3] = (uint8_t) ( 255.f * max( 0.0f, min( 1.0f, src[3])));
 }
 
-void Sampler2DImp::generate_mips(Texture& tex, int startLevel) {
+// Source taps of one output texel along one axis when halving n texels.
+// Even sizes average pairs. Odd sizes use the three tap polyphase box
+// filter so every source texel contributes the same total weight.
+struct MipTaps {
+  int first, count, denom;
+  int weight[3];
+};
+
+static inline MipTaps mip_taps( int n, int x ) {
+  MipTaps t;
+  if (n == 1) {
+    t.first = 0; t.count = 1; t.denom = 1;
+    t.weight[0] = 1;
+  } else if (n % 2 == 0) {
+    t.first = 2 * x; t.count = 2; t.denom = 2;
+    t.weight[0] = t.weight[1] = 1;
+  } else {
+    int k = n / 2;
+    t.first = 2 * x; t.count = 3; t.denom = n;
+    t.weight[0] = k - x; t.weight[1] = k; t.weight[2] = x + 1;
+  }
+  return t;
+}
+
+// 2x2 box filter of one output row, both source dimensions even
+static void downsample_row_even( unsigned char* dst,
+                                 const unsigned char* row0,
+                                 const unsigned char* row1, int width ) {
+  int x = 0;
+
+#if defined(__SSE2__)
+  const __m128i zero  = _mm_setzero_si128();
+  const __m128i round = _mm_set1_epi16(2);
+  for (; x + 4 <= width; x += 4) {
+    __m128i out[2];
+    for (int half = 0; half < 2; half++) {
+
+      // four source texels from each row, widened to 16 bits
+      __m128i a = _mm_loadu_si128((const __m128i*) (row0 + 32 * (x / 4) + 16 * half));
+      __m128i b = _mm_loadu_si128((const __m128i*) (row1 + 32 * (x / 4) + 16 * half));
+      __m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero));
+      __m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero));
+
+      // add horizontal neighbours: texel pairs (0,1) and (2,3)
+      lo = _mm_add_epi16(lo, _mm_srli_si128(lo, 8));
+      hi = _mm_add_epi16(hi, _mm_srli_si128(hi, 8));
+      out[half] = _mm_srli_epi16(_mm_add_epi16(_mm_unpacklo_epi64(lo, hi), round), 2);
+    }
+    _mm_storeu_si128((__m128i*) (dst + 4 * x), _mm_packus_epi16(out[0], out[1]));
+  }
+#endif
+
+  for (; x < width; x++) {
+    const unsigned char* a = row0 + 8 * x;
+    const unsigned char* b = row1 + 8 * x;
+    for (int c = 0; c < 4; c++) {
+      dst[4 * x + c] = (a[c] + a[c + 4] + b[c] + b[c + 4] + 2) >> 2;
+    }
+  }
+}
 
-  // This function is run, when set_viewbox function runs
+// weighted box filter of one output row, any source dimensions
+static void downsample_row( unsigned char* dst, const MipLevel& src,
+                            int width, int y ) {
+  int src_width = src.width;
+  MipTaps ty = mip_taps(src.height, y);
+  for (int x = 0; x < width; x++) {
+    MipTaps tx = mip_taps(src_width, x);
+    int sum[4] = { 0, 0, 0, 0 };
+    for (int j = 0; j < ty.count; j++) {
+      const unsigned char* row = &src.texels[4 * (ty.first + j) * src_width];
+      for (int i = 0; i < tx.count; i++) {
+        int w = ty.weight[j] * tx.weight[i];
+        const unsigned char* p = row + 4 * (tx.first + i);
+        sum[0] += w * p[0]; sum[1] += w * p[1];
+        sum[2] += w * p[2]; sum[3] += w * p[3];
+      }
+    }
+    int denom = ty.denom * tx.denom;
+    for (int c = 0; c < 4; c++) {
+      dst[4 * x + c] = (sum[c] + denom / 2) / denom;
+    }
+  }
+}
 
-  // NOTE(sky): 
-  // The starter code allocates the mip levels and generates a level 
-  // map simply fills each level with a color that differs from its
-  // neighbours'. The reference solution uses trilinear filtering
-  // and it will only work when you have mipmaps.
+// the same in linear light: color is decoded before filtering and
+// encoded after, alpha is filtered as is
+static void downsample_row_linear( unsigned char* dst, const MipLevel& src,
+                                   int width, int y ) {
+  const SRGBTables& srgb = SRGBTables::get();
+  int src_width = src.width;
+  MipTaps ty = mip_taps(src.height, y);
+  for (int x = 0; x < width; x++) {
+    MipTaps tx = mip_taps(src_width, x);
+    uint64_t sum[4] = { 0, 0, 0, 0 };
+    for (int j = 0; j < ty.count; j++) {
+      const unsigned char* row = &src.texels[4 * (ty.first + j) * src_width];
+      for (int i = 0; i < tx.count; i++) {
+        uint64_t w = (uint64_t) ty.weight[j] * tx.weight[i];
+        const unsigned char* p = row + 4 * (tx.first + i);
+        sum[0] += w * srgb.decode[p[0]]; sum[1] += w * srgb.decode[p[1]];
+        sum[2] += w * srgb.decode[p[2]]; sum[3] += w * p[3];
+      }
+    }
+    uint64_t denom = (uint64_t) ty.denom * tx.denom;
+    for (int c = 0; c < 3; c++) {
+      dst[4 * x + c] = srgb.encode[(sum[c] + denom / 2) / denom];
+    }
+    dst[4 * x + 3] = (sum[3] + denom / 2) / denom;
+  }
+}
+
+void Sampler2DImp::generate_mips(Texture& tex, int startLevel) {
 
-  // Task 6: Implement this
-  DEBUG_CODE(printf("\n\n\n\ngenerate_mips\n\n\n\n"));
   // check start level
-  if ( startLevel >= tex.mipmap.size() ) {
+  if ( startLevel < 0 || startLevel >= (int) tex.mipmap.size() ) {
     std::cerr << "Invalid start level"; 
+    return;
   }
 
+  // levels are filtered in row order
+  set_texel_layout(tex, TEXELS_LINEAR);
+
   // allocate sublevels
   int baseWidth  = tex.mipmap[startLevel].width;
   int baseHeight = tex.mipmap[startLevel].height;
   int numSubLevels = (int)(log2f( (float)max(baseWidth, baseHeight)));
 
-  numSubLevels = min(numSubLevels, kMaxMipLevels - startLevel - 1); // 8
+  numSubLevels = min(numSubLevels, kMaxMipLevels - startLevel - 1);
 
   tex.mipmap.resize(startLevel + numSubLevels + 1);
 
   int width  = baseWidth;
   int height = baseHeight;
 
-  // Setup the width and height for each level
+  // each level halves the previous one, odd sizes round down
   for (int i = 1; i <= numSubLevels; i++) {
 
     MipLevel& level = tex.mipmap[startLevel + i];
 
-    // handle odd size texture by rounding down
-    width  = max( 1, width  / 2); assert(width  > 0);
-    height = max( 1, height / 2); assert(height > 0);
+    width  = max( 1, width  / 2);
+    height = max( 1, height / 2);
 
     level.width = width;
     level.height = height;
-    level.texels = vector<unsigned char>(4 * width * height);
+    level.texels.resize(4 * width * height);
 
   }
 
-  // Generate mipmap
-  int x, y, level, c, temp;
+  // filter level by level, rows of a level in parallel
+  for (int i = startLevel + 1; i <= startLevel + numSubLevels; i++) {
+
+    const MipLevel& src = tex.mipmap[i - 1];
+    MipLevel& dst = tex.mipmap[i];
+    int w = dst.width;
+    int h = dst.height;
+    bool even = src.width % 2 == 0 && src.height % 2 == 0;
+
+    #pragma omp parallel for schedule(static) if (w * h >= 16384)
+    for (int y = 0; y < h; y++) {
+      unsigned char* out = &dst.texels[4 * y * w];
+      if (linear_mips) {
+        downsample_row_linear(out, src, w, y);
+      } else if (even) {
+        const unsigned char* row0 = &src.texels[4 * (2 * y) * src.width];
+        downsample_row_even(out, row0, row0 + 4 * src.width, w);
+      } else {
+        downsample_row(out, src, w, y);
+      }
+    }
+  }
 
-  for (level = 1; level <= numSubLevels; level++) {
-    MipLevel& prev_mip = tex.mipmap[level - 1];
-    MipLevel& cur_mip = tex.mipmap[level];
-    int prev_width = prev_mip.width;
-    int cur_width = cur_mip.width;
+  set_texel_layout(tex, layout);
+  if (compress_threshold && (size_t) (baseWidth * baseHeight) >= compress_threshold) {
+    compress_texture(tex);
+  }
+  tex.mips_valid = true;
+}
 
-    for (y = 0; y < cur_mip.height; y++) {
-      for (x = 0; x < cur_mip.width; x++) {
-        int y1 = y * 2;
-        int y2 = y * 2 + 1;
-        int x1 = x * 2;
-        int x2 = x * 2 + 1;
+// Texel layouts //
+
+// Texel addressing per layout: row(y) sets up a row once, at(row, x) then
+// points at the RGBA8 texel (x, y). Pointers from at() stay valid while
+// the 2x2 neighbourhood of texels around them is being read.
+
+struct LinearTexels {
+  typedef const unsigned char* Row;
+  const unsigned char* base; int pitch;
+  LinearTexels( const MipLevel& m ) : base ( m.texels.data() ),
+                                      pitch ( 4 * m.width ) { }
+  inline Row row( int y ) const { return base + y * pitch; }
+  inline const unsigned char* at( Row r, int x ) const { return r + 4 * x; }
+};
+
+// 4x4 blocks of texels, one 64 byte cache line each, blocks in row order
+struct TiledTexels {
+  typedef const unsigned char* Row;
+  const unsigned char* base; int pitch;
+  TiledTexels( const MipLevel& m ) : base ( m.texels.data() ),
+                                     pitch ( 64 * ((m.width + 3) / 4) ) { }
+  inline Row row( int y ) const {
+    return base + (y >> 2) * pitch + ((y & 3) << 4);
+  }
+  inline const unsigned char* at( Row r, int x ) const {
+    return r + ((x >> 2) << 6) + ((x & 3) << 2);
+  }
+};
+
+// Compressed 4x4 blocks, decoded on demand into a small direct mapped
+// cache. Neighbouring blocks map to different slots, so a bilinear
+// footprint never evicts its own taps.
+template <int BlockBytes, void (*Decode)( const unsigned char*, unsigned char* )>
+struct BlockTexels {
+  typedef int Row;
+  const unsigned char* base; int blocks_per_row;
+  int tag[16];
+  unsigned char cache[16][64];
+  BlockTexels( const MipLevel& m ) : base ( m.texels.data() ),
+                                     blocks_per_row ( (m.width + 3) / 4 ) {
+    for (int i = 0; i < 16; i++) tag[i] = -1;
+  }
+  inline Row row( int y ) const { return y; }
+  inline const unsigned char* at( Row y, int x ) {
+    int bx = x >> 2, by = y >> 2;
+    int slot = (bx & 3) | ((by & 3) << 2);
+    int index = by * blocks_per_row + bx;
+    if (tag[slot] != index) {
+      Decode(base + index * BlockBytes, cache[slot]);
+      tag[slot] = index;
+    }
+    return cache[slot] + (((y & 3) << 4) | ((x & 3) << 2));
+  }
+};
+
+typedef BlockTexels<kBC1BlockBytes, decode_bc1_block> BC1Texels;
+typedef BlockTexels<kBC3BlockBytes, decode_bc3_block> BC3Texels;
+
+// Calls Kernel<Texels>::run(args...) with the addressing of the layout.
+#define DISPATCH_TEXELS( layout, kernel, args )             \
+  switch (layout) {                                         \
+    case TEXELS_LINEAR: kernel<LinearTexels> args; break;   \
+    case TEXELS_TILED:  kernel<TiledTexels>  args; break;   \
+    case TEXELS_BC1:    kernel<BC1Texels>    args; break;   \
+    case TEXELS_BC3:    kernel<BC3Texels>    args; break;   \
+  }
 
-        for (c = 0; c < 4; c++) {
-          temp  = (int) prev_mip.texels[4 * (y1 * prev_width + x1) + c];
-          temp += (int) prev_mip.texels[4 * (y1 * prev_width + x2) + c];
-          temp += (int) prev_mip.texels[4 * (y2 * prev_width + x1) + c];
-          temp += (int) prev_mip.texels[4 * (y2 * prev_width + x2) + c];
-          
-          temp /= 4;
+template <typename Texels>
+static void linearize_level( const MipLevel& m, vector<unsigned char>& out ) {
+  int w = m.width, h = m.height;
+  Texels texels(m);
+  out.resize(4 * w * h);
+  for (int y = 0; y < h; y++) {
+    typename Texels::Row r = texels.row(y);
+    for (int x = 0; x < w; x++) memcpy(&out[4 * (y * w + x)], texels.at(r, x), 4);
+  }
+}
 
-          cur_mip.texels[4 * (y * cur_width + x) + c] = temp;
+// row order texels to one of the block layouts, edge blocks are padded
+// by repeating the last row and column
+static void blockify_level( const MipLevel& m, TexelLayout layout,
+                            vector<unsigned char>& out ) {
+  int w = m.width, h = m.height;
+  int bw = (w + 3) / 4, bh = (h + 3) / 4;
+  int block_bytes = layout == TEXELS_BC1 ? kBC1BlockBytes :
+                    layout == TEXELS_BC3 ? kBC3BlockBytes : 64;
+  out.resize(bw * bh * block_bytes);
+
+  #pragma omp parallel for schedule(static) if (bw * bh >= 4096)
+  for (int by = 0; by < bh; by++) {
+    unsigned char block[64];
+    for (int bx = 0; bx < bw; bx++) {
+      for (int j = 0; j < 4; j++) {
+        int y = min(4 * by + j, h - 1);
+        for (int i = 0; i < 4; i++) {
+          int x = min(4 * bx + i, w - 1);
+          memcpy(block + 16 * j + 4 * i, &m.texels[4 * (y * w + x)], 4);
         }
       }
+      unsigned char* dst = &out[(by * bw + bx) * block_bytes];
+      switch (layout) {
+        case TEXELS_BC1: encode_bc1_block(block, dst); break;
+        case TEXELS_BC3: encode_bc3_block(block, dst); break;
+        default:         memcpy(dst, block, 64);       break;
+      }
     }
   }
 }
 
-inline Color getColor(unsigned char* colorStart) {
+static void convert_level( MipLevel& m, TexelLayout from, TexelLayout to ) {
+  if (from == to || m.texels.empty()) return;
 
-  float tempColor[4];
-  uint8_to_float(tempColor, colorStart);
-  return Color(tempColor[0], tempColor[1], tempColor[2], tempColor[3]);
+  vector<unsigned char> texels;
+  if (from != TEXELS_LINEAR) {
+    DISPATCH_TEXELS(from, linearize_level, (m, texels));
+    m.texels.swap(texels);
+  }
+  if (to != TEXELS_LINEAR) {
+    blockify_level(m, to, texels);
+    m.texels.swap(texels);
+  }
 }
 
-Color Sampler2DImp::sample_nearest(Texture& tex, 
-                                   float u, float v, 
-                                   int level) {
+void set_texel_layout( Texture& tex, TexelLayout layout ) {
+  if (tex.layout == layout) return;
+  for (size_t i = 0; i < tex.mipmap.size(); i++) {
+    convert_level(tex.mipmap[i], tex.layout, layout);
+  }
+  tex.layout = layout;
+}
 
-  // Task 5: Implement nearest neighbour interpolation
-  // DEBUG_CODE(printf("sample_nearest\n"));
+void compress_texture( Texture& tex ) {
+  if (tex.layout == TEXELS_BC1 || tex.layout == TEXELS_BC3) return;
 
-  if (u < 0 || u > 1 || v < 0 || v > 1)
-    return Color(1,0,1,1);
+  // BC1 keeps no alpha, so only fully opaque textures may use it
+  set_texel_layout(tex, TEXELS_LINEAR);
+  bool opaque = true;
+  for (size_t i = 0; i < tex.mipmap.size() && opaque; i++) {
+    const vector<unsigned char>& texels = tex.mipmap[i].texels;
+    for (size_t k = 3; k < texels.size(); k += 4) {
+      if (texels[k] != 255) { opaque = false; break; }
+    }
+  }
+  set_texel_layout(tex, opaque ? TEXELS_BC1 : TEXELS_BC3);
+}
 
-  int width = tex.mipmap[level].width;
-  int height = tex.mipmap[level].height;
+// Sampling kernels //
 
-  //printf("u=%f, v=%f\n", u, v);
+// u, v are normalized, texel centers sit at (i + 0.5) / size and lookups
+// clamp to the edge
 
-  int int_u = round(u * width);
-  int int_v = round(v * height);
+template <typename Texels>
+static inline void texel_nearest( const MipLevel& m, float u, float v,
+                                  float out[4] ) {
+  int w = m.width, h = m.height;
+  int x = min(max((int) floorf(u * w), 0), w - 1);
+  int y = min(max((int) floorf(v * h), 0), h - 1);
+  Texels texels(m);
+  const unsigned char* p = texels.at(texels.row(y), x);
+  out[0] = p[0]; out[1] = p[1]; out[2] = p[2]; out[3] = p[3];
+}
 
-  // printf("int_u=%d, int_v=%d, level=%d\n", int_u, int_v, level);
+template <typename Texels>
+static inline void texel_bilinear( const MipLevel& m, float u, float v,
+                                   float out[4] ) {
+  int w = m.width, h = m.height;
+  float tu = u * w - 0.5f, tv = v * h - 0.5f;
+  float fu = floorf(tu), fv = floorf(tv);
+  float s = tu - fu, t = tv - fv;
+  int x0 = (int) fu, y0 = (int) fv;
+  int x1 = min(max(x0 + 1, 0), w - 1); x0 = min(max(x0, 0), w - 1);
+  int y1 = min(max(y0 + 1, 0), h - 1); y0 = min(max(y0, 0), h - 1);
+
+  Texels texels(m);
+  typename Texels::Row r0 = texels.row(y0), r1 = texels.row(y1);
+  const unsigned char* a = texels.at(r0, x0); const unsigned char* b = texels.at(r0, x1);
+  const unsigned char* c = texels.at(r1, x0); const unsigned char* d = texels.at(r1, x1);
+  for (int k = 0; k < 4; k++) {
+    float top = a[k] + s * (b[k] - a[k]);
+    float bot = c[k] + s * (d[k] - c[k]);
+    out[k] = top + t * (bot - top);
+  }
+}
 
-  Color color = getColor(&tex.mipmap[level].texels[4 * (width * int_u + int_v)]);
+static inline void texel_nearest( const Texture& tex, int level,
+                                  float u, float v, float out[4] ) {
+  DISPATCH_TEXELS(tex.layout, texel_nearest, (tex.mipmap[level], u, v, out));
+}
 
-  return color;
+static inline void texel_bilinear( const Texture& tex, int level,
+                                   float u, float v, float out[4] ) {
+  DISPATCH_TEXELS(tex.layout, texel_bilinear, (tex.mipmap[level], u, v, out));
 }
 
-Color Sampler2DImp::sample_bilinear(Texture& tex, 
-                                    float u, float v, 
-                                    int level) {
-  // Task 5: Implement bilinear filtering
-  // DEBUG_CODE(printf("sample_bilinear\n"));
+// level and blend weight of a level of detail (log2 texels per pixel)
+static inline void lod_levels( const Texture& tex, float lod,
+                               int& level, float& weight ) {
+  int last = (int) tex.mipmap.size() - 1;
+  if (!(lod > 0)) { level = 0; weight = 0; return; }
+  if (lod >= last) { level = last; weight = 0; return; }
+  level = (int) lod;
+  weight = lod - level;
+}
+
+static inline Color to_color( const float c[4] ) {
+  return Color(c[0] / 255.f, c[1] / 255.f, c[2] / 255.f, c[3] / 255.f);
+}
+
+// Span kernels //
 
-  if (u < 0 || u > 1 || v < 0 || v > 1)
-    return Color(1,0,1,1);
+// Spans step through texel space in 16.16 fixed point and filter with 8 bit
+// weights, so a span costs no float math per texel and gives the same bytes
+// on every compiler.
 
-  int width = tex.mipmap[level].width;
-  int height = tex.mipmap[level].height;
+static const int kFracBits = 16;
 
-  //printf("u=%f, v=%f\n", u, v);
+static inline int64_t to_fixed( float x ) {
+  return (int64_t) floor((double) x * (1 << kFracBits));
+}
 
-  int u_down = floor(u * width);
-  int v_down = floor(v * height);
-  int u_up = u_down + 1;
-  int v_up = v_down + 1;
+static inline int clamp_index( int64_t i, int size ) {
+  return (int) (i < 0 ? 0 : (i >= size ? size - 1 : i));
+}
+
+// bilinear blend of texels a b (top row) and c d (bottom row), weights in
+// 1/256ths
+static inline void blend_bilinear( unsigned char* dst,
+                                   const unsigned char* a, const unsigned char* b,
+                                   const unsigned char* c, const unsigned char* d,
+                                   int s, int t ) {
+#if defined(__SSE2__)
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i half = _mm_set1_epi16(128);
+  int32_t ta, tb, tc, td;
+  memcpy(&ta, a, 4); memcpy(&tb, b, 4); memcpy(&tc, c, 4); memcpy(&td, d, 4);
+
+  // left texels of both rows in one register, right texels in another
+  __m128i left  = _mm_unpacklo_epi8(_mm_unpacklo_epi32(_mm_cvtsi32_si128(ta),
+                                                       _mm_cvtsi32_si128(tc)), zero);
+  __m128i right = _mm_unpacklo_epi8(_mm_unpacklo_epi32(_mm_cvtsi32_si128(tb),
+                                                       _mm_cvtsi32_si128(td)), zero);
+  __m128i rows = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(
+                   _mm_mullo_epi16(left,  _mm_set1_epi16(256 - s)),
+                   _mm_mullo_epi16(right, _mm_set1_epi16(s))), half), 8);
+
+  __m128i top = rows, bot = _mm_srli_si128(rows, 8);
+  __m128i px = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(
+                 _mm_mullo_epi16(top, _mm_set1_epi16(256 - t)),
+                 _mm_mullo_epi16(bot, _mm_set1_epi16(t))), half), 8);
+  int32_t out = _mm_cvtsi128_si32(_mm_packus_epi16(px, zero));
+  memcpy(dst, &out, 4);
+#else
+  for (int k = 0; k < 4; k++) {
+    int top = (a[k] * (256 - s) + b[k] * s + 128) >> 8;
+    int bot = (c[k] * (256 - s) + d[k] * s + 128) >> 8;
+    dst[k] = (top * (256 - t) + bot * t + 128) >> 8;
+  }
+#endif
+}
+
+template <typename Texels>
+static void span_nearest( const MipLevel& m, float u, float v,
+                          float du, float dv, size_t count,
+                          unsigned char* out ) {
+  int w = m.width, h = m.height;
+  int64_t fu = to_fixed(u * w), fdu = to_fixed(du * w);
+  int64_t fv = to_fixed(v * h), fdv = to_fixed(dv * h);
+  Texels texels(m);
+  for (size_t i = 0; i < count; i++, fu += fdu, fv += fdv, out += 4) {
+    int x = clamp_index(fu >> kFracBits, w);
+    int y = clamp_index(fv >> kFracBits, h);
+    memcpy(out, texels.at(texels.row(y), x), 4);
+  }
+}
+
+template <typename Texels>
+static void span_bilinear( const MipLevel& m, float u, float v,
+                           float du, float dv, size_t count,
+                           unsigned char* out ) {
+  int w = m.width, h = m.height;
+  int64_t fu = to_fixed(u * w - 0.5f), fdu = to_fixed(du * w);
+  int64_t fv = to_fixed(v * h - 0.5f), fdv = to_fixed(dv * h);
+  Texels texels(m);
+
+  // horizontal spans (dv == 0) set up their rows once
+  typename Texels::Row r0 = texels.row(0), r1 = r0; int t = 0;
+  for (size_t i = 0; i < count; i++, fu += fdu, fv += fdv, out += 4) {
+    if (i == 0 || fdv != 0) {
+      int64_t y = fv >> kFracBits;
+      r0 = texels.row(clamp_index(y, h));
+      r1 = texels.row(clamp_index(y + 1, h));
+      t = (int) (fv >> (kFracBits - 8)) & 0xff;
+    }
+    int64_t x = fu >> kFracBits;
+    int x0 = clamp_index(x, w), x1 = clamp_index(x + 1, w);
+    int s = (int) (fu >> (kFracBits - 8)) & 0xff;
+    const unsigned char* a = texels.at(r0, x0); const unsigned char* b = texels.at(r0, x1);
+    const unsigned char* c = texels.at(r1, x0); const unsigned char* d = texels.at(r1, x1);
+    blend_bilinear(out, a, b, c, d, s, t);
+  }
+}
 
-  //printf("u_down=%f, v_down=%f, u_up=%f, v_up=%f\n", u_down, v_down, u_up, v_up);
+static void span_bilinear( const Texture& tex, int level,
+                           float u, float v, float du, float dv,
+                           size_t count, unsigned char* out ) {
+  DISPATCH_TEXELS(tex.layout, span_bilinear,
+                  (tex.mipmap[level], u, v, du, dv, count, out));
+}
 
-  Color c00 = getColor(&tex.mipmap[level].texels[4 * (width * v_down + u_down)]);
-  Color c10 = getColor(&tex.mipmap[level].texels[4 * (width * v_down + u_up)]);
-  Color c01 = getColor(&tex.mipmap[level].texels[4 * (width * v_up + u_down)]);
-  Color c11 = getColor(&tex.mipmap[level].texels[4 * (width * v_up + u_up)]);
+// dst = dst + (src - dst) * weight / 256, per byte
+static void blend_span( unsigned char* dst, const unsigned char* src,
+                        int weight, size_t count ) {
+  size_t n = 4 * count, i = 0;
+#if defined(__SSE2__)
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i half = _mm_set1_epi16(128);
+  const __m128i wa = _mm_set1_epi16(256 - weight);
+  const __m128i wb = _mm_set1_epi16(weight);
+  for (; i + 16 <= n; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i*) (dst + i));
+    __m128i b = _mm_loadu_si128((const __m128i*) (src + i));
+    __m128i lo = _mm_add_epi16(_mm_add_epi16(
+                   _mm_mullo_epi16(_mm_unpacklo_epi8(a, zero), wa),
+                   _mm_mullo_epi16(_mm_unpacklo_epi8(b, zero), wb)), half);
+    __m128i hi = _mm_add_epi16(_mm_add_epi16(
+                   _mm_mullo_epi16(_mm_unpackhi_epi8(a, zero), wa),
+                   _mm_mullo_epi16(_mm_unpackhi_epi8(b, zero), wb)), half);
+    _mm_storeu_si128((__m128i*) (dst + i),
+                     _mm_packus_epi16(_mm_srli_epi16(lo, 8), _mm_srli_epi16(hi, 8)));
+  }
+#endif
+  for (; i < n; i++) {
+    dst[i] = (dst[i] * (256 - weight) + src[i] * weight + 128) >> 8;
+  }
+}
 
-  Color cp1 = c00 * (v_up - v) + c01 * (v - v_down);
-  Color cp2 = c10 * (v_up - v) + c11 * (v - v_down);
+static void span_trilinear( const Texture& tex, int level, float weight,
+                            float u, float v, float du, float dv,
+                            size_t count, unsigned char* out ) {
+  int w = (int) (weight * 256 + 0.5f);
+  if (w == 0)   { span_bilinear(tex, level, u, v, du, dv, count, out); return; }
+  if (w == 256) { span_bilinear(tex, level + 1, u, v, du, dv, count, out); return; }
+
+  // the coarser level goes through a small stack buffer in chunks
+  const size_t kChunk = 64;
+  unsigned char coarse[4 * kChunk];
+  span_bilinear(tex, level, u, v, du, dv, count, out);
+  for (size_t i = 0; i < count; i += kChunk) {
+    size_t n = min(kChunk, count - i);
+    span_bilinear(tex, level + 1, u + i * du, v + i * dv, du, dv, n, coarse);
+    blend_span(out + 4 * i, coarse, w, n);
+  }
+}
 
-  Color cp = cp1 * (u_up - u) + cp2 * (u - u_down);
+void Sampler2D::sample_bilinear_span( Texture& tex,
+                                      float u0, float du, float v0, float dv,
+                                      size_t count, unsigned char* out,
+                                      int level ) {
+  if (level < 0 || level >= (int) tex.mipmap.size()) return;
+  if (tex.mipmap[level].texels.empty()) return;
+  span_bilinear(tex, level, u0, v0, du, dv, count, out);
+}
 
-  return Color(cp.r, cp.g, cp.b, cp.a);
+Color Sampler2DImp::sample_nearest(Texture& tex, 
+                                   float u, float v, 
+                                   int level) {
+  float c[4];
+  texel_nearest(tex, level, u, v, c);
+  return to_color(c);
+}
 
+Color Sampler2DImp::sample_bilinear(Texture& tex, 
+                                    float u, float v, 
+                                    int level) {
+  float c[4];
+  texel_bilinear(tex, level, u, v, c);
+  return to_color(c);
 }
 
 Color Sampler2DImp::sample_trilinear(Texture& tex, 
                                      float u, float v, 
                                      float u_scale, float v_scale) {
-  // Task 6: Implement trilinear filtering
-  // DEBUG_CODE(printf("sample_bilinear\n"));
-
-  Color cp;
-  float l, d;
-  float log2 = log(2);
-
-  if (u_scale > v_scale)
-    l = u_scale;
-  else
-    l = v_scale;
-
-  if (l <= 1) {
-    // color = sampler->sample_bilinear(tex, u, v, 0);
-    cp = sample_nearest(tex, u, v, 0);
-    // printf("c0=%u, c1=%u, c2=%u, c3=%u\n", color.r, color.g, color.b, color.a);
-  } else {
-    d = log(l) / log2;
-    int d_up = ceil(d);
-    int d_down = d_up - 1;
-    
-    Color c_down = sample_bilinear(tex, u, v, d_down);
-    Color c_up   = sample_bilinear(tex, u, v, d_up);
+  int level; float weight;
+  lod_levels(tex, log2f(max(u_scale, v_scale)), level, weight);
+
+  float a[4];
+  texel_bilinear(tex, level, u, v, a);
+  if (weight > 0) {
+    float b[4];
+    texel_bilinear(tex, level + 1, u, v, b);
+    for (int c = 0; c < 4; c++) a[c] += weight * (b[c] - a[c]);
+  }
+  return to_color(a);
+}
 
-    cp = c_down * (d_up - d) + c_up * (d - d_down);
+// Averages probes trilinear spans spread along (au, av) around the span
+// center line, each probe spanning the whole footprint / probes.
+static void span_anisotropic( const Texture& tex, int level, float weight,
+                              int probes, float au, float av,
+                              float u, float v, float du, float dv,
+                              size_t count, unsigned char* out ) {
+  const size_t kChunk = 64;
+  unsigned char probe[4 * kChunk];
+  uint16_t sum[4 * kChunk];
+
+  for (size_t i = 0; i < count; i += kChunk) {
+    size_t n = min(kChunk, count - i);
+    memset(sum, 0, sizeof(sum));
+    for (int k = 0; k < probes; k++) {
+      float offset = (k + 0.5f) / probes - 0.5f;
+      span_trilinear(tex, level, weight,
+                     u + i * du + offset * au, v + i * dv + offset * av,
+                     du, dv, n, probe);
+      for (size_t c = 0; c < 4 * n; c++) sum[c] += probe[c];
+    }
+    for (size_t c = 0; c < 4 * n; c++) {
+      out[4 * i + c] = (sum[c] + probes / 2) / probes;
+    }
   }
-  // printf("l=%f\n",l);
+}
 
-  return cp;
+void Sampler2DImp::sample_span( Texture& tex, float u, float v,
+                                float dudx, float dvdx,
+                                float dudy, float dvdy,
+                                size_t count, unsigned char* out ) {
+
+  if (tex.mipmap.empty() || tex.mipmap[0].texels.empty()) return;
+
+  // footprint axes of a pixel in texels
+  float lx = hypotf(dudx * tex.width, dvdx * tex.height);
+  float ly = hypotf(dudy * tex.width, dvdy * tex.height);
+
+  // the level is resolved once for the whole span
+  int level; float weight;
+  switch (method) {
+    case NEAREST:
+      DISPATCH_TEXELS(tex.layout, span_nearest,
+                      (tex.mipmap[0], u, v, dudx, dvdx, count, out));
+      break;
+    case BILINEAR:
+      sample_bilinear_span(tex, u, dudx, v, dvdx, count, out, 0);
+      break;
+    case TRILINEAR:
+      lod_levels(tex, log2f(max(lx, ly)), level, weight);
+      span_trilinear(tex, level, weight, u, v, dudx, dvdx, count, out);
+      break;
+    case ANISOTROPIC: {
+
+      // probes along the major axis, each filtered at the minor axis
+      // width (as far as the probe budget allows)
+      float major = max(lx, ly), minor = min(lx, ly);
+      int probes = minor > 0 ? (int) ceilf(major / minor) : kMaxAnisotropy;
+      probes = min(max(probes, 1), kMaxAnisotropy);
+      lod_levels(tex, log2f(major / probes), level, weight);
+      if (probes == 1) {
+        span_trilinear(tex, level, weight, u, v, dudx, dvdx, count, out);
+      } else if (lx >= ly) {
+        span_anisotropic(tex, level, weight, probes, dudx, dvdx,
+                         u, v, dudx, dvdx, count, out);
+      } else {
+        span_anisotropic(tex, level, weight, probes, dudy, dvdy,
+                         u, v, dudx, dvdx, count, out);
+      }
+      break;
+    }
+  }
 }
 
 } // namespace CMU462
@@ -10,21 +10,49 @@ static const int kMaxMipLevels = 14;
 typedef enum SampleMethod{
   NEAREST,
   BILINEAR,
-  TRILINEAR
+  TRILINEAR,
+  ANISOTROPIC
 } SampleMethod;
 
+// Most trilinear probes an anisotropic lookup takes along its major axis.
+static const int kMaxAnisotropy = 16;
+
+// Order of texels within each mip level. Tiled levels store 4x4 blocks of
+// texels (one cache line each) in row order, padded to whole blocks, so
+// filter taps of rotated or minified lookups mostly share cache lines.
+// The BC layouts store the same blocks compressed: BC1 in 8 bytes without
+// alpha, BC3 in 16 bytes with interpolated alpha.
+typedef enum TexelLayout {
+  TEXELS_LINEAR,
+  TEXELS_TILED,
+  TEXELS_BC1,
+  TEXELS_BC3
+} TexelLayout;
+
 struct MipLevel {
   size_t width; 
   size_t height;
   std::vector<unsigned char> texels;
 };
 
+class Sampler2D;
+
 struct Texture {
   size_t width;
   size_t height;
   std::vector<MipLevel> mipmap;
+  bool mips_valid = false; // mip chain built from level 0, no need to rebuild
+  TexelLayout layout = TEXELS_LINEAR; // layout of every level
+  const Sampler2D* mips_by = nullptr; // sampler that built the chain, if known
 };
 
+// Converts all levels of a texture to the given layout. Converting to a
+// BC layout is lossy.
+void set_texel_layout( Texture& tex, TexelLayout layout );
+
+// Block compresses all levels, BC1 when fully opaque and BC3 otherwise.
+void compress_texture( Texture& tex );
+
 class Sampler2D {
  public:
 
@@ -49,6 +77,18 @@ class Sampler2D {
   inline SampleMethod get_sample_method() const {
     return method;
   }
+
+  inline void set_sample_method( SampleMethod method ) {
+    this->method = method;
+  }
+
+  // Batch bilinear sampling of one mip level: count texels along a span
+  // starting at (u0, v0) and stepping by (du, dv), written to out as RGBA8.
+  // Uses 8 bit fixed point weights, so results match across samplers.
+  void sample_bilinear_span(Texture& tex,
+                            float u0, float du, float v0, float dv,
+                            size_t count, unsigned char* out,
+                            int level = 0);
  
  protected:
 
@@ -59,7 +99,26 @@ class Sampler2D {
 class Sampler2DImp : public Sampler2D {
  public:
 
-  Sampler2DImp( SampleMethod method = TRILINEAR ) : Sampler2D ( method ) { }
+  Sampler2DImp( SampleMethod method = TRILINEAR ) :
+    Sampler2D ( method ), layout ( TEXELS_LINEAR ),
+    compress_threshold ( 0 ), linear_mips ( false ) { }
+
+  // layout textures are converted to once their mips are generated
+  inline void set_layout( TexelLayout layout ) {
+    this->layout = layout;
+  }
+  inline TexelLayout get_layout( void ) const { return layout; }
+
+  // textures with at least this many texels in level 0 are block
+  // compressed once their mips are generated, 0 disables compression
+  inline void set_compression_threshold( size_t texels ) {
+    compress_threshold = texels;
+  }
+
+  // filter mip levels in linear light instead of on the sRGB values, for
+  // textures whose mips are generated after this is set
+  inline void set_linear_mips( bool enabled ) { linear_mips = enabled; }
+  inline bool get_linear_mips( void ) const { return linear_mips; }
   
   void generate_mips( Texture& tex, int startLevel );
 
@@ -74,6 +133,22 @@ class Sampler2DImp : public Sampler2D {
   Color sample_trilinear(Texture& tex, 
                          float u, float v, 
                          float u_scale, float v_scale);
+
+  // Samples count texels along a span starting at (u, v) and stepping by
+  // (dudx, dvdx) per pixel, writing RGBA8 to out. (dudy, dvdy) is the uv
+  // step to the next row; with the step along the span it gives the pixel
+  // footprint, from which the level of detail (and for anisotropic
+  // sampling the probe count and direction) is derived once per span.
+  // Any footprint is handled, the renderer only passes axis aligned ones.
+  void sample_span(Texture& tex, float u, float v,
+                   float dudx, float dvdx, float dudy, float dvdy,
+                   size_t count, unsigned char* out);
+
+ private:
+
+  TexelLayout layout;
+  size_t compress_threshold;
+  bool linear_mips;
   
 }; // class sampler2DImp
 
@@ -0,0 +1,131 @@
+#include "texture_cache.h"
+
+#include <string.h>
+#include <vector>
+#include <algorithm>
+
+using namespace std;
+
+namespace CMU462 {
+
+TextureCache& TextureCache::instance() {
+  static TextureCache cache;
+  return cache;
+}
+
+static inline uint64_t mix( uint64_t h, uint64_t v ) {
+  h ^= v * 0x9e3779b97f4a7c15ull;
+  h ^= h >> 29;
+  return h * 0xbf58476d1ce4e5b9ull;
+}
+
+TextureCache::Key TextureCache::make_key( const char* payload, size_t length ) {
+
+  // eight bytes at a time, the tail zero padded
+  uint64_t h = 0xcbf29ce484222325ull ^ length;
+  size_t i = 0;
+  for (; i + 8 <= length; i += 8) {
+    uint64_t v; memcpy(&v, payload + i, 8);
+    h = mix(h, v);
+  }
+  if (i < length) {
+    uint64_t v = 0; memcpy(&v, payload + i, length - i);
+    h = mix(h, v);
+  }
+
+  Key key = { h ^ (h >> 32), length };
+  return key;
+}
+
+shared_ptr<Texture> TextureCache::find( const Key& key, const char* payload ) {
+  lock_guard<mutex> guard(lock);
+  map<Key, Entry>::iterator it = entries.find(key);
+  if (it == entries.end()) return shared_ptr<Texture>();
+
+  // the key only hashes the payload, a collision is a miss
+  if (it->second.payload.compare(0, string::npos, payload, key.length)) {
+    return shared_ptr<Texture>();
+  }
+  it->second.last_use = ++tick;
+  return it->second.tex;
+}
+
+void TextureCache::insert( const Key& key, const char* payload,
+                           const shared_ptr<Texture>& tex ) {
+  lock_guard<mutex> guard(lock);
+  Entry& entry = entries[key];
+  entry.tex = tex;
+  entry.payload.assign(payload, key.length);
+  entry.last_use = ++tick;
+  evict_locked();
+}
+
+void TextureCache::set_budget( size_t bytes ) {
+  lock_guard<mutex> guard(lock);
+  budget = bytes;
+  evict_locked();
+}
+
+size_t TextureCache::memory_usage() {
+  lock_guard<mutex> guard(lock);
+  size_t total = 0;
+  map<Key, Entry>::iterator it;
+  for (it = entries.begin(); it != entries.end(); ++it) {
+    total += texture_bytes(*it->second.tex) + it->second.payload.size();
+  }
+  return total;
+}
+
+size_t TextureCache::private_usage() {
+  lock_guard<mutex> guard(lock);
+  return private_bytes;
+}
+
+void TextureCache::add_private_bytes( size_t bytes ) {
+  lock_guard<mutex> guard(lock);
+  private_bytes += bytes;
+  evict_locked();
+}
+
+void TextureCache::remove_private_bytes( size_t bytes ) {
+  lock_guard<mutex> guard(lock);
+  private_bytes -= min(bytes, private_bytes);
+}
+
+void TextureCache::evict() {
+  lock_guard<mutex> guard(lock);
+  evict_locked();
+}
+
+size_t TextureCache::texture_bytes( const Texture& tex ) {
+  size_t total = 0;
+  for (size_t i = 0; i < tex.mipmap.size(); i++) {
+    total += tex.mipmap[i].texels.size();
+  }
+  return total;
+}
+
+void TextureCache::evict_locked() {
+
+  // mip chains grow after insertion, so sizes are taken now
+  size_t total = private_bytes;
+  vector<pair<uint64_t, Key> > unused;
+  map<Key, Entry>::iterator it;
+  for (it = entries.begin(); it != entries.end(); ++it) {
+    total += texture_bytes(*it->second.tex) + it->second.payload.size();
+    if (it->second.tex.use_count() == 1) {
+      unused.push_back(make_pair(it->second.last_use, it->first));
+    }
+  }
+  if (total <= budget) return;
+
+  // only textures no image refers to free memory when dropped
+  sort(unused.begin(), unused.end());
+  for (size_t i = 0; i < unused.size() && total > budget; i++) {
+    it = entries.find(unused[i].second);
+    total -= texture_bytes(*it->second.tex) + it->second.payload.size();
+    entries.erase(it);
+  }
+}
+
+} // namespace CMU462
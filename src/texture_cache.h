@@ -0,0 +1,90 @@
+#ifndef CMU462_TEXTURE_CACHE_H
+#define CMU462_TEXTURE_CACHE_H
+
+#include <map>
+#include <mutex>
+#include <memory>
+#include <string>
+#include <stdint.h>
+
+#include "texture.h"
+
+namespace CMU462 {
+
+/**
+ * Process wide cache of decoded textures, keyed by a hash of the encoded
+ * image payload. Images that embed the same payload (in one document or
+ * across tabs) share one texture and its mip chain by reference. Entries
+ * keep the payload, so different payloads whose keys collide never share.
+ *
+ * Entries still referenced by an image are never dropped. Entries only
+ * held by the cache are kept for reuse until the memory used by all
+ * cached texels and payloads exceeds the budget, then dropped least
+ * recently used first. Private copies images keep for the reference and
+ * hardware renderers count against the same budget.
+ */
+class TextureCache {
+ public:
+
+  struct Key {
+    uint64_t hash;
+    size_t length;
+    bool operator<( const Key& k ) const {
+      return hash < k.hash || (hash == k.hash && length < k.length);
+    }
+  };
+
+  static TextureCache& instance();
+
+  static Key make_key( const char* payload, size_t length );
+
+  // cached texture of the payload the key was made from, or an empty
+  // pointer on a miss
+  std::shared_ptr<Texture> find( const Key& key, const char* payload );
+
+  // adds the texture decoded from the payload and evicts down to the
+  // budget, replacing an entry whose payload collided
+  void insert( const Key& key, const char* payload,
+               const std::shared_ptr<Texture>& tex );
+
+  // memory budget in bytes for cached textures and their payloads
+  void set_budget( size_t bytes );
+  size_t get_budget() const { return budget; }
+
+  // bytes of texels (all mip levels) and payloads held by the cache
+  size_t memory_usage();
+
+  // bytes of private texture copies held by images
+  size_t private_usage();
+  void add_private_bytes( size_t bytes );
+  void remove_private_bytes( size_t bytes );
+
+  // bytes of texels in all levels of a texture
+  static size_t texture_bytes( const Texture& tex );
+
+  // drops unreferenced textures until the cache is within budget
+  void evict();
+
+ private:
+
+  TextureCache() : budget ( 256u << 20 ), private_bytes ( 0 ), tick ( 0 ) { }
+
+  struct Entry {
+    std::shared_ptr<Texture> tex;
+    std::string payload;
+    uint64_t last_use;
+  };
+
+  void evict_locked();
+
+  std::mutex lock;
+  std::map<Key, Entry> entries;
+  size_t budget;
+  size_t private_bytes;
+  uint64_t tick;
+
+}; // class TextureCache
+
+} // namespace CMU462
+
+#endif // CMU462_TEXTURE_CACHE_H
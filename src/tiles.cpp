@@ -0,0 +1,601 @@
+#include "CMU462.h"
+#include "svg.h"
+#include "png.h"
+#include "texture.h"
+#include "software_renderer.h"
+
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+
+using namespace std;
+using namespace CMU462;
+
+#define msg(s) cerr << "[DrawSVG Tiles] " << s << endl;
+
+/**
+ * Headless tile pyramid export. Every level of the pyramid is cut into
+ * square tiles that are rendered in parallel (OpenMP, OMP_NUM_THREADS
+ * threads) by the software renderer and written as PNGs as soon as they
+ * are done.
+ *
+ * Top level elements are binned into the tiles their bounds overlap, so
+ * a tile only draws what can touch it. Tiles nothing overlaps are not
+ * rendered, tiles covered by an opaque rectangle drawn last only draw
+ * that rectangle, and tiles that come out a single color are encoded once
+ * per color and size and then reused.
+ *
+ * Layouts:
+ *
+ *   dzi  DeepZoom, <name>.dzi and <name>_files/<level>/<col>_<row>.png.
+ *        The deepest level is the canvas at --scale pixels per unit,
+ *        every level above halves it down to a single pixel.
+ *   xyz  <name>/<z>/<x>/<y>.png, zoom 0 fits the canvas in one tile and
+ *        every zoom doubles it until the canvas is drawn at --scale.
+ */
+
+struct Options {
+  size_t tile;
+  float scale;
+  size_t rate;
+  bool xyz;
+  bool linear;
+  string out_dir;
+  vector<string> files;
+};
+
+static void usage() {
+  msg("Usage: drawsvg_tiles [options] <svg files>");
+  msg("  --tile N             tile width and height in pixels (256)");
+  msg("  --scale S            pixels per canvas unit at the deepest level (1)");
+  msg("  --rate N             sample rate (1)");
+  msg("  --layout dzi|xyz     directory layout (dzi)");
+  msg("  --linear             blend and filter mips in linear light");
+  msg("  --out DIR            output directory (tiles_out)");
+  msg("Set OMP_NUM_THREADS to choose the number of render threads.");
+}
+
+static int parse_options( int argc, char** argv, Options& options ) {
+
+  options.tile = 256;
+  options.scale = 1;
+  options.rate = 1;
+  options.xyz = false;
+  options.linear = false;
+  options.out_dir = "tiles_out";
+
+  for (int i = 1; i < argc; i++) {
+    string arg = argv[i];
+    bool has_value = i + 1 < argc;
+    if (arg == "--tile" && has_value) {
+      options.tile = atoi(argv[++i]);
+    } else if (arg == "--scale" && has_value) {
+      options.scale = atof(argv[++i]);
+    } else if (arg == "--rate" && has_value) {
+      options.rate = atoi(argv[++i]);
+    } else if (arg == "--layout" && has_value) {
+      string layout = argv[++i];
+      if (layout != "dzi" && layout != "xyz") {
+        msg("Bad layout " << layout);
+        return -1;
+      }
+      options.xyz = layout == "xyz";
+    } else if (arg == "--linear") {
+      options.linear = true;
+    } else if (arg == "--out" && has_value) {
+      options.out_dir = argv[++i];
+    } else if (arg.compare(0, 2, "--") == 0) {
+      msg("Unknown option " << arg);
+      return -1;
+    } else {
+      options.files.push_back(arg);
+    }
+  }
+
+  if (options.tile == 0 || options.rate == 0 || !(options.scale > 0)) {
+    return -1;
+  }
+  return options.files.empty() ? -1 : 0;
+}
+
+// Pyramid //
+
+struct Level {
+  size_t index;
+  double scale;          // pixels per canvas unit
+  size_t width, height;  // pixels
+  size_t cols, rows;     // tiles
+};
+
+static void build_levels( const SVG& svg, const Options& options,
+                          vector<Level>& levels ) {
+
+  double w = max(1.0, ceil((double) svg.width  * options.scale));
+  double h = max(1.0, ceil((double) svg.height * options.scale));
+  double extent = max(w, h);
+
+  // levels until the canvas is drawn at full scale
+  size_t depth = 0;
+  if (options.xyz) {
+    while ((double) (options.tile << depth) < extent) depth++;
+  } else {
+    while ((double) (1ull << depth) < extent) depth++;
+  }
+
+  for (size_t l = 0; l <= depth; l++) {
+    Level level;
+    level.index = l;
+    if (options.xyz) {
+      // square world, the canvas fit in its top left corner
+      level.width = level.height = options.tile << l;
+      level.scale = level.width / max(svg.width, svg.height);
+    } else {
+      double f = (double) (1ull << (depth - l));
+      level.width  = (size_t) ceil(w / f);
+      level.height = (size_t) ceil(h / f);
+      level.scale  = options.scale / f;
+    }
+    level.cols = (level.width  + options.tile - 1) / options.tile;
+    level.rows = (level.height + options.tile - 1) / options.tile;
+    levels.push_back(level);
+  }
+}
+
+// Culling //
+
+struct Bounds {
+  float x0, y0, x1, y1;
+  Bounds() : x0 ( INFINITY ), y0 ( INFINITY ),
+             x1 ( -INFINITY ), y1 ( -INFINITY ) { }
+  bool empty() const { return !(x0 <= x1 && y0 <= y1); }
+};
+
+static void grow( Bounds& b, const Matrix3x3& m, double x, double y ) {
+  Vector3D u = m * Vector3D(x, y, 1);
+  float px = u.x / u.z, py = u.y / u.z;
+  b.x0 = min(b.x0, px); b.y0 = min(b.y0, py);
+  b.x1 = max(b.x1, px); b.y1 = max(b.y1, py);
+}
+
+static void grow_box( Bounds& b, const Matrix3x3& m,
+                      const Vector2D& p, const Vector2D& q ) {
+  grow(b, m, p.x, p.y); grow(b, m, q.x, p.y);
+  grow(b, m, p.x, q.y); grow(b, m, q.x, q.y);
+}
+
+// canvas space bounds of an element and its children
+static void element_bounds( const SVGElement* element,
+                            const Matrix3x3& parent, Bounds& b ) {
+
+  Matrix3x3 m = parent * element->transform;
+  switch (element->type) {
+    case POINT: {
+      const Vector2D& p = static_cast<const Point*>(element)->position;
+      grow(b, m, p.x, p.y);
+      break;
+    }
+    case LINE: {
+      const Line* line = static_cast<const Line*>(element);
+      grow(b, m, line->from.x, line->from.y);
+      grow(b, m, line->to.x, line->to.y);
+      break;
+    }
+    case POLYLINE: {
+      const vector<Vector2D>& points =
+        static_cast<const Polyline*>(element)->points;
+      for (size_t i = 0; i < points.size(); i++) {
+        grow(b, m, points[i].x, points[i].y);
+      }
+      break;
+    }
+    case POLYGON: {
+      const vector<Vector2D>& points =
+        static_cast<const Polygon*>(element)->points;
+      for (size_t i = 0; i < points.size(); i++) {
+        grow(b, m, points[i].x, points[i].y);
+      }
+      break;
+    }
+    case RECT: {
+      const Rect* rect = static_cast<const Rect*>(element);
+      grow_box(b, m, rect->position, rect->position + rect->dimension);
+      break;
+    }
+    case ELLIPSE: {
+      const Ellipse* ellipse = static_cast<const Ellipse*>(element);
+      grow_box(b, m, ellipse->center - ellipse->radius,
+                     ellipse->center + ellipse->radius);
+      break;
+    }
+    case IMAGE: {
+      const Image* image = static_cast<const Image*>(element);
+      grow_box(b, m, image->position, image->position + image->dimension);
+      break;
+    }
+    case GROUP: {
+      const vector<SVGElement*>& elements =
+        static_cast<const Group*>(element)->elements;
+      for (size_t i = 0; i < elements.size(); i++) {
+        element_bounds(elements[i], m, b);
+      }
+      break;
+    }
+    default:
+      break;
+  }
+}
+
+// pixels around the bounds strokes, points and antialiasing may reach
+static const float kCullPad = 2;
+
+// an opaque axis aligned rectangle that hides everything below it
+static bool is_opaque_rect( const SVGElement* element ) {
+  const Matrix3x3& m = element->transform;
+  return element->type == RECT && element->style.fillColor.a == 1 &&
+         m(0,1) == 0 && m(1,0) == 0 && m(2,0) == 0 && m(2,1) == 0;
+}
+
+// Deduplication //
+
+// tiles with the same key are identical
+struct TileKey {
+  enum Kind { FILL, UNIFORM } kind;
+  uint32_t color;
+  size_t width, height;
+  bool operator<( const TileKey& k ) const {
+    if (kind != k.kind) return kind < k.kind;
+    if (color != k.color) return color < k.color;
+    if (width != k.width) return width < k.width;
+    return height < k.height;
+  }
+};
+
+typedef shared_ptr<const vector<unsigned char> > Encoded;
+
+class TileCache {
+ public:
+
+  Encoded find( const TileKey& key ) {
+    lock_guard<mutex> guard(lock);
+    map<TileKey, Encoded>::iterator it = tiles.find(key);
+    return it == tiles.end() ? Encoded() : it->second;
+  }
+
+  void insert( const TileKey& key, const Encoded& png ) {
+    lock_guard<mutex> guard(lock);
+    tiles.insert(make_pair(key, png));
+  }
+
+ private:
+
+  mutex lock;
+  map<TileKey, Encoded> tiles;
+
+};
+
+// rounded and clamped, as the fixed point renderer packs colors, so that
+// fills with the same key draw the same pixels
+static uint32_t unorm8( float f ) {
+  return f <= 0 ? 0 : (f >= 1 ? 255 : (uint32_t) (f * 255 + 0.5f));
+}
+
+static uint32_t pack_fill( const Color& c ) {
+  return unorm8(c.r) | unorm8(c.g) << 8 | unorm8(c.b) << 16;
+}
+
+// the color of every pixel, false if they differ
+static bool uniform_color( const unsigned char* pixels, size_t count,
+                           uint32_t& color ) {
+  const uint32_t* p = (const uint32_t*) pixels;
+  color = p[0];
+  for (size_t i = 1; i < count; i++) if (p[i] != color) return false;
+  return true;
+}
+
+// PNG stores straight alpha
+static void unpremultiply( unsigned char* pixels, size_t count ) {
+  for (size_t i = 0; i < count; i++, pixels += 4) {
+    int a = pixels[3];
+    if (a == 0 || a == 255) continue;
+    for (int k = 0; k < 3; k++) {
+      pixels[k] = min(255, (pixels[k] * 255 + a / 2) / a);
+    }
+  }
+}
+
+// Output //
+
+static string test_name( const string& path ) {
+  size_t slash = path.find_last_of('/');
+  string name = slash == string::npos ? path : path.substr(slash + 1);
+  size_t dot = name.find_last_of('.');
+  return dot == string::npos ? name : name.substr(0, dot);
+}
+
+static bool write_file( const string& path, const vector<unsigned char>& data ) {
+  ofstream out(path.c_str(), ios::binary);
+  out.write((const char*) &data[0], data.size());
+  return (bool) out;
+}
+
+static string tile_path( const string& base, const Level& level,
+                         size_t col, size_t row, bool xyz ) {
+  if (xyz) {
+    return base + "/" + to_string(level.index) + "/" + to_string(col) +
+           "/" + to_string(row) + ".png";
+  }
+  return base + "/" + to_string(level.index) + "/" + to_string(col) +
+         "_" + to_string(row) + ".png";
+}
+
+static void make_level_dirs( const string& base, const Level& level,
+                             bool xyz ) {
+  string dir = base + "/" + to_string(level.index);
+  mkdir(dir.c_str(), 0755);
+  if (!xyz) return;
+  for (size_t col = 0; col < level.cols; col++) {
+    mkdir((dir + "/" + to_string(col)).c_str(), 0755);
+  }
+}
+
+static bool write_dzi( const string& path, const Options& options,
+                       const Level& deepest ) {
+  ofstream out(path.c_str());
+  out << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+      << "<Image xmlns=\"http://schemas.microsoft.com/deepzoom/2008\" "
+      << "TileSize=\"" << options.tile << "\" Overlap=\"0\" Format=\"png\">\n"
+      << "  <Size Width=\"" << deepest.width << "\" Height=\""
+      << deepest.height << "\"/>\n"
+      << "</Image>\n";
+  return (bool) out;
+}
+
+// Export //
+
+struct ExportStats {
+  size_t tiles, rendered, encoded, failed;
+};
+
+static void export_level( SVG& svg, const vector<Bounds>& bounds,
+                          const Level& level, const Options& options,
+                          Sampler2D* sampler, const string& base,
+                          TileCache& cache, ExportStats& stats ) {
+
+  size_t tile = options.tile;
+  float pad = kCullPad;
+
+  // bin the top level elements into the tiles they can touch, in order
+  vector<vector<uint32_t> > bins(level.cols * level.rows);
+  for (size_t i = 0; i < bounds.size(); i++) {
+    const Bounds& b = bounds[i];
+    if (b.empty()) continue;
+    float x0 = b.x0 * level.scale - pad, x1 = b.x1 * level.scale + pad;
+    float y0 = b.y0 * level.scale - pad, y1 = b.y1 * level.scale + pad;
+    if (x1 < 0 || y1 < 0 || x0 >= level.width || y0 >= level.height) continue;
+    size_t c0 = (size_t) max(0.f, x0) / tile;
+    size_t r0 = (size_t) max(0.f, y0) / tile;
+    size_t c1 = min(level.cols - 1, (size_t) x1 / tile);
+    size_t r1 = min(level.rows - 1, (size_t) y1 / tile);
+    for (size_t r = r0; r <= r1; r++) {
+      for (size_t c = c0; c <= c1; c++) {
+        bins[r * level.cols + c].push_back(i);
+      }
+    }
+  }
+
+  size_t count = bins.size();
+  size_t rendered = 0, encoded = 0, failed = 0;
+
+  #pragma omp parallel reduction(+:rendered,encoded,failed)
+  {
+    // one renderer per thread, the tile document borrows the elements
+    SoftwareRendererImp imp;
+    imp.set_tex_sampler(sampler);
+    imp.set_canvas_outline(false);
+    imp.set_sample_rate(options.rate);
+    imp.set_linear_light(options.linear);
+    SVG tile_svg;
+    tile_svg.width = svg.width;
+    tile_svg.height = svg.height;
+    vector<unsigned char> pixels(4 * tile * tile);
+    vector<unsigned char> png_data;
+
+    #pragma omp for schedule(dynamic)
+    for (size_t t = 0; t < count; t++) {
+      size_t col = t % level.cols, row = t / level.cols;
+      size_t x0 = col * tile, y0 = row * tile;
+      size_t tw = min(tile, level.width - x0);
+      size_t th = min(tile, level.height - y0);
+      const vector<uint32_t>& bin = bins[t];
+      string path = tile_path(base, level, col, row, options.xyz);
+
+      // an opaque rectangle over the whole tile hides everything below
+      size_t first = 0;
+      bool filled = false;
+      for (size_t i = bin.size(); i-- > 0; ) {
+        const SVGElement* element = svg.elements[bin[i]];
+        const Bounds& b = bounds[bin[i]];
+        if (is_opaque_rect(element) &&
+            b.x0 * level.scale <= x0 - pad &&
+            b.y0 * level.scale <= y0 - pad &&
+            b.x1 * level.scale >= x0 + tw + pad &&
+            b.y1 * level.scale >= y0 + th + pad) {
+          first = i;
+          filled = i + 1 == bin.size();
+          break;
+        }
+      }
+
+      TileKey key = { TileKey::UNIFORM, 0, tw, th };
+      if (filled) {
+        key.kind = TileKey::FILL;
+        key.color = pack_fill(svg.elements[bin.back()]->style.fillColor);
+      }
+      if (filled || bin.empty()) {
+        Encoded png = cache.find(key);
+        if (png) {
+          if (!write_file(path, *png)) failed++;
+          continue;
+        }
+      }
+
+      // draw what is left after culling
+      tile_svg.elements.clear();
+      for (size_t i = first; i < bin.size(); i++) {
+        tile_svg.elements.push_back(svg.elements[bin[i]]);
+      }
+
+      size_t n = tw * th;
+      if (bin.empty()) {
+        fill(pixels.begin(), pixels.begin() + 4 * n, 0);
+      } else {
+        Matrix3x3 canvas_to_screen = Matrix3x3::identity();
+        canvas_to_screen(0,0) = level.scale;
+        canvas_to_screen(1,1) = level.scale;
+        canvas_to_screen(0,2) = -(double) x0;
+        canvas_to_screen(1,2) = -(double) y0;
+        imp.set_render_target(&pixels[0], tw, th);
+        imp.set_canvas_to_screen(canvas_to_screen);
+        imp.draw_svg(tile_svg);
+        rendered++;
+      }
+
+      // single color tiles are encoded once
+      uint32_t color;
+      bool uniform = uniform_color(&pixels[0], n, color);
+      TileKey uniform_key = { TileKey::UNIFORM, color, tw, th };
+      if (uniform && !bin.empty()) {
+        Encoded png = cache.find(uniform_key);
+        if (png) {
+          if (filled) cache.insert(key, png);
+          if (!write_file(path, *png)) failed++;
+          continue;
+        }
+      }
+
+      if (imp.get_fixed_point()) unpremultiply(&pixels[0], n);
+      PNG png;
+      png.width = tw;
+      png.height = th;
+      png.pixels.assign(pixels.begin(), pixels.begin() + 4 * n);
+      png_data.clear();
+      if (PNGParser::encode(png_data, png) < 0 || !write_file(path, png_data)) {
+        failed++;
+        continue;
+      }
+      encoded++;
+
+      if (uniform) {
+        Encoded shared = make_shared<const vector<unsigned char> >(png_data);
+        cache.insert(uniform_key, shared);
+        if (filled) cache.insert(key, shared);
+      }
+    }
+
+    // the elements belong to the document
+    tile_svg.elements.clear();
+  }
+
+  stats.tiles += count;
+  stats.rendered += rendered;
+  stats.encoded += encoded;
+  stats.failed += failed;
+}
+
+static void collect_images( vector<SVGElement*>& elements,
+                            vector<Image*>& images ) {
+  for (size_t i = 0; i < elements.size(); ++i) {
+    SVGElement* element = elements[i];
+    if (element->type == IMAGE) {
+      images.push_back(static_cast<Image*>(element));
+    } else if (element->type == GROUP) {
+      collect_images(static_cast<Group*>(element)->elements, images);
+    }
+  }
+}
+
+int main( int argc, char** argv ) {
+
+  Options options;
+  if (parse_options(argc, argv, options) < 0) {
+    usage();
+    return 2;
+  }
+
+  // shared by all render threads, Sampler2D has no destructor body
+  Sampler2DImp& sampler = *new Sampler2DImp();
+  sampler.set_layout(TEXELS_TILED);
+  sampler.set_linear_mips(options.linear);
+
+  mkdir(options.out_dir.c_str(), 0755);
+
+  int failures = 0;
+  for (size_t f = 0; f < options.files.size(); f++) {
+
+    SVG* svg = new SVG();
+    if (SVGParser::load(options.files[f].c_str(), svg) < 0) {
+      msg("Failed to load " << options.files[f]);
+      delete svg;
+      failures++;
+      continue;
+    }
+    chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+
+    // mips are built up front, the render threads only read textures
+    vector<Image*> images;
+    collect_images(svg->elements, images);
+    for (size_t i = 0; i < images.size(); i++) {
+      Texture& tex = images[i]->texture();
+      if (tex.mips_valid || tex.mipmap.empty()) continue;
+      sampler.generate_mips(tex, 0);
+      tex.mips_valid = true;
+    }
+
+    vector<Bounds> bounds(svg->elements.size());
+    for (size_t i = 0; i < bounds.size(); i++) {
+      element_bounds(svg->elements[i], Matrix3x3::identity(), bounds[i]);
+    }
+
+    vector<Level> levels;
+    build_levels(*svg, options, levels);
+
+    string name = test_name(options.files[f]);
+    string base = options.out_dir + "/" + name + (options.xyz ? "" : "_files");
+    mkdir(base.c_str(), 0755);
+    if (!options.xyz &&
+        !write_dzi(options.out_dir + "/" + name + ".dzi", options,
+                   levels.back())) {
+      msg("Could not write " << name << ".dzi");
+      failures++;
+    }
+
+    TileCache cache;
+    ExportStats stats = { 0, 0, 0, 0 };
+    for (size_t l = 0; l < levels.size(); l++) {
+      make_level_dirs(base, levels[l], options.xyz);
+      export_level(*svg, bounds, levels[l], options, &sampler, base,
+                   cache, stats);
+    }
+
+    double ms = chrono::duration<double, milli>(
+                  chrono::steady_clock::now() - t0).count();
+    msg(name << ": " << levels.size() << " levels, " << stats.tiles
+        << " tiles, " << stats.rendered << " rendered, " << stats.encoded
+        << " encoded, " << ms << " ms");
+    if (stats.failed) {
+      msg(stats.failed << " tiles of " << name << " could not be written");
+      failures++;
+    }
+
+    delete svg;
+  }
+
+  return failures ? 1 : 0;
+}
@@ -3,7 +3,9 @@
 #include "CMU462.h"
 #include "matrix3x3.h"
 
+#ifndef DRAWSVG_NO_DEBUG
 #define ENABLE_DEBUG
+#endif
 #ifdef ENABLE_DEBUG
 #define DEBUG_CODE(CODEFRAGMENT) CODEFRAGMENT;
 #else